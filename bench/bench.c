@@ -0,0 +1,399 @@
+/*
+ * Benchmarks for the hot paths of the library
+ *
+ * Every workload runs at several depths, each run in a process of its own so
+ * the peak RSS printed is the run's own. Results go to stdout, one line per
+ * run: workload, depth, operations, ns/op, throughput and peak RSS.
+ *
+ * usage: bench [workload...]
+ *      Runs every workload when none is named.
+ *
+ * Built against the library or, with OCTREE_BENCH_SH, against sh_octree.h.
+ * Needs a POSIX system for fork and getrusage.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#if defined(OCTREE_BENCH_SH)
+#include "sh_octree.h"
+#else
+#include "octree.h"
+#endif /* OCTREE_BENCH_SH */
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+/* Fixed seed so every run does the same work */
+#define BENCH_SEED 0x9e3779b97f4a7c15ull
+
+/* Operations per run, fewer for the workloads whose operations are big */
+#define BENCH_OPS (1u << 21)
+
+
+typedef struct
+{
+    uint64_t ops;
+    /* Throughput is amount per second, in millions of unit. Operations by
+     * default */
+    double amount;
+    const char *unit;
+    double seconds;
+    /* Folded results so the work can't be optimized away */
+    uint64_t check;
+} bench_result_t;
+
+
+typedef void (*bench_fn)(uint8_t depth, bench_result_t *result);
+
+
+typedef struct
+{
+    const char *name;
+    bench_fn fn;
+} bench_t;
+
+
+static uint64_t rng_state;
+
+
+static uint64_t rng_next(void)
+{
+    uint64_t x = rng_state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    rng_state = x;
+    return x;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+static octree_index_t leaf_count(uint8_t depth)
+{
+    return (octree_index_t)1 << (3 * depth);
+}
+
+
+/* Octree with a leaf in every 8th position set at random, a mix of full
+ * and split nodes */
+static octree_t *bench_octree(uint8_t depth)
+{
+    octree_t *octree = octree_construct(depth);
+    const octree_index_t mask = leaf_count(depth) - 1;
+    uint64_t n = leaf_count(depth) / 8;
+
+    if (octree == NULL) {
+        fprintf(stderr, "octree_construct(%d) failed\n", depth);
+        exit(1);
+    }
+
+    if (n > BENCH_OPS) n = BENCH_OPS;
+    for (uint64_t i = 0; i < n; i++)
+        octree_leaf_set(octree, rng_next() & mask, 1 + rng_next() % 3);
+    return octree;
+}
+
+
+static void get_random(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const octree_index_t mask = leaf_count(depth) - 1;
+    octree_index_t *indices =
+        (octree_index_t *)malloc(BENCH_OPS * sizeof(octree_index_t));
+    double start;
+
+    for (uint32_t i = 0; i < BENCH_OPS; i++) indices[i] = rng_next() & mask;
+
+    start = now();
+    for (uint32_t i = 0; i < BENCH_OPS; i++)
+        result->check += octree_leaf_get(octree, indices[i]);
+    result->seconds = now() - start;
+    result->ops = BENCH_OPS;
+
+    free(indices);
+    octree_r_free(octree);
+}
+
+
+/* Indices in order, neighbours in the tree follow each other */
+static void get_coherent(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const octree_index_t mask = leaf_count(depth) - 1;
+    const octree_index_t first = rng_next() & mask;
+    double start = now();
+
+    for (octree_index_t i = 0; i < BENCH_OPS; i++)
+        result->check += octree_leaf_get(octree, (first + i) & mask);
+    result->seconds = now() - start;
+    result->ops = BENCH_OPS;
+
+    octree_r_free(octree);
+}
+
+
+static void set_random(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const octree_index_t mask = leaf_count(depth) - 1;
+    octree_index_t *indices =
+        (octree_index_t *)malloc(BENCH_OPS * sizeof(octree_index_t));
+    double start;
+
+    for (uint32_t i = 0; i < BENCH_OPS; i++) indices[i] = rng_next() & mask;
+
+    start = now();
+    for (uint32_t i = 0; i < BENCH_OPS; i++)
+        result->check += octree_leaf_set(octree, indices[i], i & 3);
+    result->seconds = now() - start;
+    result->ops = BENCH_OPS;
+
+    free(indices);
+    octree_r_free(octree);
+}
+
+
+static void set_coherent(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const octree_index_t mask = leaf_count(depth) - 1;
+    const octree_index_t first = rng_next() & mask;
+    double start = now();
+
+    for (octree_index_t i = 0; i < BENCH_OPS; i++) {
+        result->check +=
+            octree_leaf_set(octree, (first + i) & mask, (i >> 4) & 3);
+    }
+    result->seconds = now() - start;
+    result->ops = BENCH_OPS;
+
+    octree_r_free(octree);
+}
+
+
+/* Boxes up to a quarter of the side, throughput in leaves filled */
+static void fill_box(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const int side = 1 << depth, max_size = (side > 4) ? side / 4 : 1;
+    const uint32_t n = BENCH_OPS >> (depth + 2);
+    int (*boxes)[2][3] = (int (*)[2][3])malloc(n * sizeof(*boxes));
+    double start;
+
+    for (uint32_t i = 0; i < n; i++) {
+        for (int a = 0; a < 3; a++) {
+            boxes[i][0][a] = rng_next() % side;
+            boxes[i][1][a] = boxes[i][0][a] + 1 + rng_next() % max_size;
+            if (boxes[i][1][a] > side) boxes[i][1][a] = side;
+        }
+        result->amount += (double)(boxes[i][1][0] - boxes[i][0][0]) *
+                          (boxes[i][1][1] - boxes[i][0][1]) *
+                          (boxes[i][1][2] - boxes[i][0][2]);
+    }
+    result->unit = "Mleaf/s";
+
+    start = now();
+    for (uint32_t i = 0; i < n; i++)
+        result->check +=
+            octree_fill_box(octree, boxes[i][0], boxes[i][1], i & 3);
+    result->seconds = now() - start;
+    result->ops = n;
+
+    free(boxes);
+    octree_r_free(octree);
+}
+
+
+static int count_run(const octree_run_t *run, void *data)
+{
+    *(uint64_t *)data += run->span;
+    return 0;
+}
+
+
+/* Runs of boxes up to a quarter of the side, throughput in leaves visited.
+ * Fails if an empty box visits anything */
+static void query_box(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth);
+    const int side = 1 << depth, max_size = (side > 4) ? side / 4 : 1;
+    const int empty_min[3] = {1, 1, 1}, empty_max[3] = {1, side, side};
+    const uint32_t n = BENCH_OPS >> (depth + 2);
+    int (*boxes)[2][3] = (int (*)[2][3])malloc(n * sizeof(*boxes));
+    uint64_t leaves = 0;
+    double start;
+
+    /* On a filled octree, where the root is one full node around min */
+    {
+        octree_t *filled = octree_construct(depth);
+        int all_min[3] = {0, 0, 0}, all_max[3] = {side, side, side};
+
+        octree_fill_box(filled, all_min, all_max, 1);
+        octree_query_box(filled, empty_min, empty_max, NULL, count_run,
+                         &leaves);
+        octree_r_free(filled);
+        if (leaves) {
+            fprintf(stderr, "query_box visited an empty box\n");
+            exit(1);
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        for (int a = 0; a < 3; a++) {
+            boxes[i][0][a] = rng_next() % side;
+            boxes[i][1][a] = boxes[i][0][a] + 1 + rng_next() % max_size;
+            if (boxes[i][1][a] > side) boxes[i][1][a] = side;
+        }
+    }
+
+    start = now();
+    for (uint32_t i = 0; i < n; i++)
+        octree_query_box(octree, boxes[i][0], boxes[i][1], NULL, count_run,
+                         &leaves);
+    result->seconds = now() - start;
+    result->ops = n;
+    result->amount = (double)leaves;
+    result->unit = "Mleaf/s";
+    result->check = leaves;
+
+    free(boxes);
+    octree_r_free(octree);
+}
+
+
+/* Save to a buffer and load it back, throughput in bytes saved */
+static void save_load(uint8_t depth, bench_result_t *result)
+{
+    octree_t *octree = bench_octree(depth), *copy = octree_construct(depth);
+    const size_t size = octree_save_size(octree);
+    char *buff = (char *)malloc(size);
+    uint32_t n = (uint32_t)((64u << 20) / size);
+    double start;
+
+    if (n == 0) n = 1;
+    if (n > 1024) n = 1024;
+
+    start = now();
+    for (uint32_t i = 0; i < n; i++) {
+        result->check += octree_save_buffer(octree, buff);
+        result->check += octree_load_buffer(copy, buff);
+    }
+    result->seconds = now() - start;
+    result->ops = n;
+    result->amount = (double)n * size;
+    result->unit = "MB/s";
+
+    free(buff);
+    octree_r_free(copy);
+    octree_r_free(octree);
+}
+
+
+/* Construct, touch a few leaves and free */
+static void construct_free(uint8_t depth, bench_result_t *result)
+{
+    const octree_index_t mask = leaf_count(depth) - 1;
+    const uint32_t n = BENCH_OPS / 256;
+    double start = now();
+
+    for (uint32_t i = 0; i < n; i++) {
+        octree_t *octree = octree_construct(depth);
+
+        for (int j = 0; j < 16; j++)
+            octree_leaf_set(octree, rng_next() & mask, 1);
+        result->check += octree_leaf_get(octree, rng_next() & mask);
+        octree_r_free(octree);
+    }
+    result->seconds = now() - start;
+    result->ops = n;
+}
+
+
+static const bench_t benches[] = {
+    {"get_random", get_random},
+    {"get_coherent", get_coherent},
+    {"set_random", set_random},
+    {"set_coherent", set_coherent},
+    {"fill_box", fill_box},
+    {"query_box", query_box},
+    {"save_load", save_load},
+    {"construct_free", construct_free},
+};
+
+
+static const uint8_t depths[] = {4, 6, 8, 10};
+
+
+/* Run one workload in a child process and print its line */
+static int bench_run(const bench_t *bench, uint8_t depth)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        bench_result_t result = {0, 0, "Mop/s", 0, 0};
+        struct rusage usage;
+
+        rng_state = BENCH_SEED ^ depth;
+        bench->fn(depth, &result);
+        getrusage(RUSAGE_SELF, &usage);
+
+        if (result.amount == 0) result.amount = (double)result.ops;
+        printf("%-16s %5d %10llu %12.1f %10.2f %-7s %10ld %016llx\n",
+               bench->name, depth, (unsigned long long)result.ops,
+               result.seconds * 1e9 / result.ops,
+               result.amount / result.seconds / 1e6, result.unit,
+               (long)usage.ru_maxrss, (unsigned long long)result.check);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s at depth %d failed\n", bench->name, depth);
+        return -1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    const size_t n_benches = sizeof(benches) / sizeof(benches[0]);
+    int ret = 0;
+
+    printf("%-16s %5s %10s %12s %18s %10s %16s\n",
+           "workload", "depth", "ops", "ns/op", "throughput", "rss_kb",
+           "check");
+
+    for (size_t i = 0; i < n_benches; i++) {
+        bool selected = (argc < 2);
+
+        for (int j = 1; j < argc; j++)
+            selected |= (strcmp(argv[j], benches[i].name) == 0);
+        if (!selected) continue;
+
+        for (size_t d = 0; d < sizeof(depths); d++) {
+            if (depths[d] > OCTREE_MAX_DEPTH) continue;
+            if (bench_run(benches + i, depths[d])) ret = 1;
+        }
+    }
+    return ret;
+}
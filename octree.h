@@ -1,9 +1,10 @@
 /*
  * Fast octree library(not sparse octree)
  * Limitations:
- *  - The maximum depth for an octree is 10
+ *  - The maximum depth for an octree is 10, or 21 with OCTREE_INDEX_64
  * Important remark:
- *  - Indices are 4 byte unsigned integers containing a 3-bit number represeing
+ *  - Indices(octree_index_t) are unsigned integers, 8 bytes with
+ *  OCTREE_INDEX_64 and 4 otherwise, containing a 3-bit number represeing
  *  the location of each node relative to it's parent.
  *
  *  Example:
@@ -25,7 +26,7 @@
  *          <repeat 7x>
  *
  *      this index could be defined as:
- *      uint32_t index = 1 << 0 |  2 << 3 | 0 << 6;
+ *      octree_index_t index = 1 << 0 |  2 << 3 | 0 << 6;
  *
  *      this makes iterating an octree as easy as doing index++
  *
@@ -59,6 +60,55 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(OCTREE_POSIX)
+#define OCTREE_POSIX
+#endif /* __unix__ || __APPLE__ */
+
+#if defined(OCTREE_POSIX)
+#include <unistd.h>
+#endif /* OCTREE_POSIX */
+
+
+/* Define OCTREE_THREADS to let the indexed save/load split the work across
+ * threads and give paged worlds an I/O thread, link with -pthread. Without
+ * it they run on the calling thread */
+#if defined(OCTREE_THREADS)
+#if !defined(OCTREE_POSIX)
+#error "OCTREE_THREADS needs pthreads"
+#endif /* OCTREE_POSIX */
+#include <pthread.h>
+#endif /* OCTREE_THREADS */
+
+
+/* Lets octree_save_compact deflate its output, link with -lz */
+#if defined(OCTREE_ZLIB)
+#include <zlib.h>
+#endif /* OCTREE_ZLIB */
+
+
+#if defined(__BMI2__) && !defined(OCTREE_NO_BMI2)
+#define OCTREE_BMI2
+#include <immintrin.h>
+#endif /* __BMI2__ */
+
+
+/* The SSE2 conversions work on 4 byte indices */
+#if defined(__SSE2__) && !defined(OCTREE_NO_SIMD) && !defined(OCTREE_INDEX_64)
+#define OCTREE_SSE2
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+
+/* Lets one writer thread change an octree while other threads read it
+ * without locking, see octree_reader_join. Needs the __atomic builtins */
+#if defined(OCTREE_CONCURRENT) && !defined(__GNUC__)
+#error "OCTREE_CONCURRENT needs GCC or clang"
+#endif /* OCTREE_CONCURRENT */
 
 
 #ifndef OCTREE_INLINE
@@ -76,180 +126,1545 @@
 #endif /* OCTREE_LEAF_TYPE */
 
 
+/* Indices are 64 bit with OCTREE_INDEX_64, which allows deeper octrees.
+ * OCTREE_POS_BITS is the number of bits of each coordinate in a packed
+ * position */
+#if defined(OCTREE_INDEX_64)
+#define OCTREE_MAX_DEPTH 21
+#define OCTREE_POS_BITS 21
+#else
+#define OCTREE_MAX_DEPTH 10
+#define OCTREE_POS_BITS 10
+#endif /* OCTREE_INDEX_64 */
+
+#define OCTREE_POS_MASK ((1u << OCTREE_POS_BITS) - 1)
+
+
+/* Bits of an index holding the x, y and z coordinate */
+#if defined(OCTREE_INDEX_64)
+#define OCTREE_MORTON_X 0x1249249249249249ull
+#define OCTREE_MORTON_Y 0x2492492492492492ull
+#define OCTREE_MORTON_Z 0x4924924924924924ull
+#else
+#define OCTREE_MORTON_X 0x09249249u
+#define OCTREE_MORTON_Y 0x12492492u
+#define OCTREE_MORTON_Z 0x24924924u
+#endif /* OCTREE_INDEX_64 */
+
+
 #define LEAVES_INIT(leaf) {leaf, leaf, leaf, leaf, leaf, leaf, leaf, leaf}
 
 #define LEAVES(leaf) ((leaf_t [8]) LEAVES_INIT(leaf))
 
 
+/* Version written by octree_save_compact, octree_load_compact also reads
+ * version 1 */
+#define OCTREE_COMPACT_VERSION 2
+
+/* octree_save_compact flags */
+#define OCTREE_COMPACT_DEFLATE 0x1
+
+
+/* Version written by octree_save_dag */
+#define OCTREE_DAG_VERSION 1
+
+
+/* Version written by octree_diff_save */
+#define OCTREE_DIFF_VERSION 1
+
+
+/* Version written by octree_save_indexed */
+#define OCTREE_INDEXED_VERSION 1
+
+/* Deepest level, below the saved node, octree_save_indexed can split at */
+#define OCTREE_INDEXED_MAX_SPLIT 2
+
+
+/* Bytes buffered by the streaming save/load functions */
+#ifndef OCTREE_STREAM_BUFFER
+#define OCTREE_STREAM_BUFFER 4096
+#endif /* OCTREE_STREAM_BUFFER */
+
+
+/* Each slab chunk holds 1 << OCTREE_POOL_SHIFT blocks */
+#ifndef OCTREE_POOL_SHIFT
+#define OCTREE_POOL_SHIFT 10
+#endif /* OCTREE_POOL_SHIFT */
+
+#define OCTREE_POOL_CHUNK (1u << OCTREE_POOL_SHIFT)
+
+#define OCTREE_POOL_MASK (OCTREE_POOL_CHUNK - 1)
+
+
+/* Blocks freed while readers may still see them are reclaimed each time
+ * this many are waiting */
+#ifndef OCTREE_RECLAIM_BATCH
+#define OCTREE_RECLAIM_BATCH 1024
+#endif /* OCTREE_RECLAIM_BATCH */
+
+
+/* Leaf values octree_stats keeps a dom_leaf count for, the others are
+ * counted together */
+#ifndef OCTREE_STATS_LEAVES
+#define OCTREE_STATS_LEAVES 256
+#endif /* OCTREE_STATS_LEAVES */
+
+
+/* Chunks octree_world_raycast crosses at most, whatever max_dist is */
+#ifndef OCTREE_WORLD_RAY_CHUNKS
+#define OCTREE_WORLD_RAY_CHUNKS 1024
+#endif /* OCTREE_WORLD_RAY_CHUNKS */
+
+
+/* With OCTREE_COUNTERS the pool counts the blocks in use as they're
+ * allocated and freed, see octree_stats_totals */
+
+
+#if defined(OCTREE_CONCURRENT)
+#define OCTREE_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+#define OCTREE_ACQUIRE(p) (*(p))
+#endif /* OCTREE_CONCURRENT */
+
+
 typedef OCTREE_LEAF_TYPE leaf_t;
 
 
+#if defined(OCTREE_INDEX_64)
+typedef uint64_t octree_index_t;
+#else
+typedef uint32_t octree_index_t;
+#endif /* OCTREE_INDEX_64 */
+
+
+/* childreen and leaves are block ids into the octree's node_pool_t, 0 meaning
+ * no block. The 8 childreen of a node are stored next to each other. */
 typedef struct node_s
 {
     union
     {
-        struct node_s **childreen;
-        leaf_t *leaves;
+        uint32_t childreen;
+        uint32_t leaves;
     };
     bool is_full        : 1;
     bool is_original    : 1;
-    uint8_t level       : 4;
+    uint8_t level       : 5;
     leaf_t dom_leaf;
 } node_t;
 
 
+#if defined(OCTREE_CONCURRENT)
+/* Readers load whole nodes with one atomic access */
+typedef char octree_node_t_must_be_8_bytes[(sizeof(node_t) == 8) ? 1 : -1];
+#endif /* OCTREE_CONCURRENT */
+
+
+/* Fixed size block allocator. Blocks are bump allocated from chunks of
+ * OCTREE_POOL_CHUNK blocks and recycled through an intrusive free list.
+ * Chunks never move, so pointers to blocks stay valid while the pool grows.
+ * Block id 0 is never handed out. refs is only allocated once the pool is
+ * shared and holds, for each block, the number of references beyond the
+ * first. */
+typedef struct
+{
+    char **chunks;
+    uint32_t **refs;
+    uint32_t n_chunks;
+    uint32_t cap_chunks;
+    uint32_t top;
+    uint32_t used;
+    uint32_t free_list;
+    uint32_t block_size;
+#if defined(OCTREE_CONCURRENT)
+    /* Chunk table replaced by the last allocation, readers may still
+     * hold it */
+    char **old_chunks;
+#endif /* OCTREE_CONCURRENT */
+#if defined(OCTREE_COUNTERS)
+    /* Blocks allocated and not released */
+    uint32_t live;
+#endif /* OCTREE_COUNTERS */
+} slab_t;
+
+
+#if defined(OCTREE_CONCURRENT)
+/* A block, or chunk table, waiting for the readers that could see it */
+typedef struct
+{
+    uint64_t epoch;
+    char **table;
+    uint32_t id;
+    uint8_t kind;
+} pool_retired_t;
+#endif /* OCTREE_CONCURRENT */
+
+
+/* Once shared is set blocks may be referenced by several nodes and are
+ * copied before being written to, see pool_share */
+typedef struct
+{
+    slab_t childreen;
+    slab_t leaves;
+    bool shared;
+    /* Octrees using the pool, the original and its snapshots */
+    uint32_t users;
+    /* Bumped each time a block is freed or stops being used by a node,
+     * paths cached in cursors are stale once it changed */
+    uint32_t generation;
+#if defined(OCTREE_CONCURRENT)
+    uint64_t epoch;
+    struct octree_reader_s *readers;
+    pool_retired_t *retired;
+    size_t n_retired;
+    size_t cap_retired;
+#endif /* OCTREE_CONCURRENT */
+} node_pool_t;
+
+
+#if defined(OCTREE_CONCURRENT)
+/* One per reader thread. epoch is the pool epoch the reader entered at, 0
+ * while it's outside, and sits on a cache line of its own so readers don't
+ * slow each other down */
+typedef struct octree_reader_s
+{
+    node_pool_t *pool;
+    struct octree_reader_s *next;
+    int in_use;
+    char pad_before[64];
+    uint64_t epoch;
+    char pad_after[64];
+} octree_reader_t;
+#endif /* OCTREE_CONCURRENT */
+
+
 typedef struct
 {
     node_t *root;
+    node_pool_t *pool;
     uint8_t depth;
 } octree_t;
 
 
-typedef struct {
-    bool is_full        : 1;
-    bool is_original    : 1;
-    uint8_t level       : 4;
-    leaf_t dom_leaf;
-} simple_node_t;
+typedef struct {
+    bool is_full        : 1;
+    bool is_original    : 1;
+    uint8_t level       : 5;
+    leaf_t dom_leaf;
+} simple_node_t;
+
+
+/* A subtree being freed a few blocks at a time. Holds the childreen blocks
+ * on the path to the next block to free */
+typedef struct
+{
+    node_pool_t *pool;
+    uint32_t childreen[OCTREE_MAX_DEPTH];
+    uint8_t next[OCTREE_MAX_DEPTH];
+    uint8_t top;
+    uint8_t oc_depth;
+} node_free_t;
+
+
+/* A cube of leaves covered by one node. span is a power of 8 and start a
+ * multiple of span. level is the node's level, oc_depth for single leaves */
+typedef struct
+{
+    octree_index_t start;
+    octree_index_t span;
+    leaf_t leaf;
+    uint8_t level;
+} octree_run_t;
+
+
+/* Walks the leaves of a node in index order one run at a time */
+typedef struct
+{
+    const node_pool_t *pool;
+    node_t *path[OCTREE_MAX_DEPTH];
+    octree_index_t index;
+    octree_index_t end;
+    octree_index_t prev;
+    uint8_t oc_depth;
+    uint8_t max_level;
+    uint8_t top;
+} node_iter_t;
+
+
+/* Path to the last leaf looked up through the cursor. path[k] is at level
+ * base + k. It's walked again only below the common ancestor of the
+ * previous and the next index, and from the top once the pool's generation
+ * changed */
+typedef struct
+{
+    node_pool_t *pool;
+    node_t *path[OCTREE_MAX_DEPTH];
+    octree_index_t prev;
+    uint32_t generation;
+    uint8_t oc_depth;
+    uint8_t base;
+    uint8_t top;
+} octree_cursor_t;
+
+
+/* A chunk of an octree_world_t. Resident chunks are in the LRU list, the
+ * others are waiting for the I/O thread to load or save them */
+typedef struct octree_chunk_s
+{
+    struct octree_chunk_s *hash_next;
+    struct octree_chunk_s *lru_prev;
+    struct octree_chunk_s *lru_next;
+    struct octree_chunk_s *task_next;
+    octree_t *octree;
+    size_t bytes;
+    int pos[3];
+    uint8_t state;
+    bool busy;
+    bool dirty;
+    bool failed;
+} octree_chunk_t;
+
+
+/* An unbounded world tiled into octrees of depth depth, kept as files in
+ * dir. The chunks in memory are found through a hash table on their
+ * position, the least recently used ones are saved and freed once they
+ * take more than budget bytes */
+typedef struct
+{
+    char *dir;
+    size_t budget;
+    size_t resident;
+    octree_chunk_t **buckets;
+    uint32_t mask;
+    uint32_t count;
+    octree_chunk_t *lru_head;
+    octree_chunk_t *lru_tail;
+    /* Chunks waiting for the I/O thread, loads first */
+    octree_chunk_t *tasks;
+    /* Most recently used chunk, found without locking */
+    octree_chunk_t *last;
+    /* Loads and saves queued or running */
+    uint32_t pending;
+    /* Set once an evicted chunk couldn't be saved */
+    bool error;
+    uint8_t depth;
+#if defined(OCTREE_THREADS)
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* Signals new tasks to the I/O thread */
+    pthread_cond_t wake;
+    /* Signals finished tasks to the thread waiting for a chunk */
+    pthread_cond_t done;
+    bool stop;
+#endif /* OCTREE_THREADS */
+} octree_world_t;
+
+
+/* Return non-zero to stop visiting. run is relative to the chunk at
+ * chunk[0] << depth, chunk[1] << depth, chunk[2] << depth */
+typedef int (*octree_world_fn)(
+        const int chunk[3], const octree_run_t *run, void *data);
+
+
+/* Byte stream used by the streaming save/load functions. write and read
+ * return the number of bytes transfered, anything short of size is treated
+ * as an error(or the end of the stream). Loading reads ahead, unread gives
+ * those bytes back once the octree is complete and may be NULL */
+typedef struct
+{
+    size_t (*write)(void *user, const void *data, size_t size);
+    size_t (*read)(void *user, void *data, size_t size);
+    int (*unread)(void *user, size_t size);
+    void *user;
+} octree_stream_t;
+
+
+/* Return non-zero to stop visiting */
+typedef int (*octree_visit_fn)(const octree_run_t *run, void *data);
+
+
+/* Return true for the leaves a ray or a query is looking for. Called once
+ * per node, a full node is a single leaf however big it is. Where NULL is
+ * passed instead any non-zero leaf matches */
+typedef bool (*octree_leaf_fn)(leaf_t leaf, void *data);
+
+
+/* Leaf a ray stopped at. distance is the ray parameter where it enters the
+ * leaf, a real distance when dir has a length of 1, and is negative for
+ * rays that hit nothing. normal is the face it entered by, all 0 if the ray
+ * started inside it */
+typedef struct
+{
+    octree_index_t index;
+    int pos[3];
+    int normal[3];
+    float distance;
+    leaf_t leaf;
+} octree_hit_t;
+
+
+/* Face of a mesh, the rectangle [min, max) of the plane where
+ * min[face >> 1] == max[face >> 1]. face is the way it faces in the order
+ * -x, +x, -y, +y, -z, +z, leaf the leaf it is the face of */
+typedef struct
+{
+    int min[3];
+    int max[3];
+    leaf_t leaf;
+    uint8_t face;
+} octree_quad_t;
+
+
+/* Buffers a mesh is extracted into. Start zeroed, they only grow and are
+ * kept from one extraction to the next. Only quads is the mesh, the rest
+ * is scratch space */
+typedef struct
+{
+    octree_quad_t *quads;
+    size_t n_quads;
+    size_t max_quads;
+    octree_quad_t *faces;
+    size_t n_faces;
+    size_t max_faces;
+    void *spans;
+    size_t max_spans;
+    void *sort;
+    size_t max_sort;
+} octree_mesh_t;
+
+
+/* Filled by octree_stats. Blocks shared through octree_dedup or
+ * octree_snapshot are counted once for each node using them, except in
+ * bytes, which is the whole pool */
+typedef struct
+{
+    /* Nodes at each level, the root being at level 0 */
+    uint64_t nodes[OCTREE_MAX_DEPTH];
+    uint64_t full[OCTREE_MAX_DEPTH];
+    uint64_t split[OCTREE_MAX_DEPTH];
+    uint64_t n_nodes;
+    uint64_t n_full;
+    uint64_t n_split;
+    /* Blocks of 8 childreen and of 8 leaves, the leaves being those of the
+     * split nodes of the last level */
+    uint64_t childreen_blocks;
+    uint64_t leaf_blocks;
+    /* Bytes taken from malloc by the octree, including an estimate of
+     * malloc's own overhead */
+    size_t bytes;
+    /* What octree_save_buffer would write */
+    size_t save_size;
+    /* Nodes by dom_leaf, dom_leaves_other counting the leaves past
+     * OCTREE_STATS_LEAVES */
+    uint64_t dom_leaves[OCTREE_STATS_LEAVES];
+    uint64_t dom_leaves_other;
+} octree_stats_t;
+
+
+OCTREE_DEF
+node_pool_t *pool_construct(void);
+
+
+/* Release every chunk owned by the pool and the pool itself */
+OCTREE_DEF
+void pool_free(node_pool_t *pool);
+
+
+/* Forget every block handed out so far without touching the chunks, which
+ * are reused by later allocations. No reader may be using the pool */
+OCTREE_DEF
+void pool_reset(node_pool_t *pool);
+
+
+/* Returns the id of a block of 8 nodes or 0 on failure */
+OCTREE_DEF
+uint32_t pool_alloc_childreen(node_pool_t *pool);
+
+
+/* Drops one reference to the block, the block is only given back to the
+ * pool once it was the last one. Blocks below it are left alone */
+OCTREE_DEF
+void pool_free_childreen(node_pool_t *pool, uint32_t childreen);
+
+
+/* Returns the id of a block of 8 leaves or 0 on failure */
+OCTREE_DEF
+uint32_t pool_alloc_leaves(node_pool_t *pool);
+
+
+OCTREE_DEF
+void pool_free_leaves(node_pool_t *pool, uint32_t leaves);
+
+
+/* Start counting references so blocks can be shared between nodes. Can't
+ * be undone. Returns 0 if the reference counts couldn't be allocated */
+OCTREE_DEF
+int pool_share(node_pool_t *pool);
+
+
+/* Add a reference to a block, the pool must be shared */
+OCTREE_DEF
+void pool_retain_childreen(node_pool_t *pool, uint32_t childreen);
+
+
+OCTREE_DEF
+void pool_retain_leaves(node_pool_t *pool, uint32_t leaves);
+
+
+/* Number of references to a block beyond the first, 0 if not shared */
+OCTREE_DEF
+uint32_t pool_childreen_refs(const node_pool_t *pool, uint32_t childreen);
+
+
+OCTREE_DEF
+uint32_t pool_leaves_refs(const node_pool_t *pool, uint32_t leaves);
+
+
+#if defined(OCTREE_CONCURRENT)
+/* Register the calling thread as a reader. Readers only look the pool up
+ * between octree_read_lock and octree_read_unlock, where blocks freed by
+ * the writer stay valid. Returns NULL if out of memory */
+OCTREE_DEF
+octree_reader_t *pool_reader_join(node_pool_t *pool);
+
+
+OCTREE_DEF
+void pool_reader_leave(octree_reader_t *reader);
+
+
+/* Give back the freed blocks no reader can see anymore, returns how many.
+ * Runs by itself every OCTREE_RECLAIM_BATCH frees. Writer only */
+OCTREE_DEF
+size_t pool_reclaim(node_pool_t *pool);
+
+
+/* Wait until every reader inside the pool has left, then reclaim.
+ * Writer only */
+OCTREE_DEF
+void pool_synchronize(node_pool_t *pool);
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_DEF
+node_t *node_construct(void);
+
+
+OCTREE_DEF
+int node_init_childreen(node_pool_t *pool, node_t *node);
+
+
+/* Get nodes or create them if they don't exist */
+OCTREE_DEF
+node_t *node_get_or_create(
+        node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth);
+
+
+/* Recrusively free the last level. node_r_free no longer needs one call
+ * per level, this is only kept for existing callers */
+OCTREE_DEF
+void node_r_free_last(
+        node_pool_t *pool, node_t *node, uint8_t last_level, uint8_t depth);
+
+
+/* Free every block below node in one pass, then node itself */
+OCTREE_DEF
+void node_r_free(node_pool_t *pool, node_t *node, uint8_t depth);
+
+
+/* Start freeing the blocks below a copy of node, node itself isn't changed
+ * and must not be used to reach them anymore */
+OCTREE_DEF
+void node_free_init(
+        node_free_t *it, node_pool_t *pool, const node_t *node,
+        uint8_t oc_depth);
+
+
+/* Free up to budget blocks. Returns 1 once the whole subtree is freed */
+OCTREE_DEF
+int node_free_step(node_free_t *it, size_t budget);
+
+
+/* Free the chunks of the pool about budget blocks at a time, at least one
+ * chunk per call. Returns 1 once the pool itself is freed, the pool can't be
+ * used after the first call */
+OCTREE_DEF
+int pool_free_step(node_pool_t *pool, size_t budget);
+
+
+/* Give every block below node back to the pool and make node full of leaf */
+OCTREE_DEF
+void node_clear(node_pool_t *pool, node_t *node, uint8_t oc_depth, leaf_t leaf);
+
+
+/* Copy node's childreen(or leaves) if the block is shared so node can write
+ * to it. Returns 0 if the copy couldn't be allocated */
+OCTREE_DEF
+int node_unshare(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* node_unshare every node on the path to index, down to the first full node */
+OCTREE_DEF
+int node_unshare_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth);
+
+
+/* Make identical subtrees below node share the same blocks. Shares the pool
+ * if it wasn't already. Returns the number of blocks replaced by a shared
+ * one or -1 if memory ran out, in which case node is left valid but only
+ * partially deduplicated */
+OCTREE_DEF
+int64_t node_dedup(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* Set every leaf inside [min, max) to leaf. origin is the position of node's
+ * first leaf. Nodes fully inside the box become full without descending
+ * into them, so only nodes crossing the box's faces get split. Returns 0 if
+ * a block couldn't be allocated */
+OCTREE_DEF
+int node_fill_box(
+        node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth, leaf_t leaf);
+
+
+/* Collapse every node below `node` whose 8 childreen(or leaves) are the same
+ * full leaf. Returns the number of blocks given back to the pool */
+OCTREE_DEF
+int node_optimize(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* Collapse the nodes on the path to index bottom up, stopping at the first
+ * node that can't be collapsed */
+OCTREE_DEF
+int node_optimize_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth);
+
+
+/* Look up n leaves. The path of the previous index is kept so only the part
+ * below the common ancestor of two successive indices is walked again, and
+ * indices falling in the same full node are resolved without descending.
+ * Works with any order, sorting indices first gives the most reuse */
+OCTREE_DEF
+void leaf_get_many(
+        const node_pool_t *pool, node_t *node,
+        const octree_index_t *indices, leaf_t *out, size_t n, uint8_t oc_depth);
+
+
+/* The 6 leaves sharing a face with the leaf at index, in the order -x, +x,
+ * -y, +y, -z, +z. Those past the octree's border are set to border. The
+ * indices are found with octree_index_add and looked up with leaf_get_many,
+ * so each one is resolved from its common ancestor with the previous one */
+OCTREE_DEF
+void leaf_get_neighbors(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[6]);
+
+
+/* The 3x3x3 block of leaves centered on index,
+ * out[(z + 1) * 9 + (y + 1) * 3 + x + 1] being the leaf at offset x, y, z
+ * from it. Same as leaf_get_neighbors otherwise */
+OCTREE_DEF
+void leaf_get_neighborhood(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[27]);
+
+
+/* Iterate the runs of node's subtree, with indices relative to node. Nodes
+ * at max_level aren't descended into and come out as one run of their
+ * dom_leaf; pass oc_depth to get every leaf */
+OCTREE_DEF
+void node_iter_init(
+        node_iter_t *it, const node_pool_t *pool, node_t *node,
+        uint8_t oc_depth, uint8_t max_level);
+
+
+/* Returns false once every run has been returned */
+OCTREE_DEF
+bool node_iter_next(node_iter_t *it, octree_run_t *run);
+
+
+/* Call fn for every run in index order. Returns the first non-zero value
+ * returned by fn or 0 */
+OCTREE_DEF
+int node_visit(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        uint8_t max_level, octree_visit_fn fn, void *data);
+
+
+/* Cast a ray through node, whose leaves cover [0, 2^(oc_depth - level)) on
+ * each axis. The ray stops at the first leaf matched by fn that it enters
+ * before max_dist. Full nodes
+ * are crossed in one step whatever their size. Returns 1 and fills hit if
+ * something was hit, 0 otherwise */
+OCTREE_DEF
+int node_raycast(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origin[3], const float dir[3], float max_dist,
+        octree_leaf_fn fn, void *data, octree_hit_t *hit);
+
+
+/* Cast n rays, filling hits[i] for ray i. The path walked down to the
+ * previous ray's first node is reused, so rays starting close to each
+ * other(a packet) mostly skip the top of the tree. Returns the number of
+ * rays that hit something */
+OCTREE_DEF
+size_t node_raycast_n(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origins[][3], const float dirs[][3], size_t n,
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hits);
+
+
+/* Call fn, in index order, for the runs of node's subtree overlapping the
+ * box [min, max) and matched by match. origin is the position of node's
+ * first leaf. Full nodes come out as one run without being descended into,
+ * even those only partly inside the box, so only nodes crossing its faces
+ * are walked. Returns the first non-zero value returned by fn or 0 */
+OCTREE_DEF
+int node_query_box(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data);
+
+
+/* Same as node_query_box for the convex region where
+ * p[0] * x + p[1] * y + p[2] * z + p[3] >= 0 for each of the n planes p,
+ * at most 32. A frustum is its 6 planes, in leaf units. Leaves crossing a
+ * plane are reported */
+OCTREE_DEF
+int node_query_planes(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const float planes[][4], int n, uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data);
+
+
+/* Extract the surface of the leaves matched by match into mesh->quads,
+ * replacing what was there. A face is made wherever a matched leaf touches
+ * a different leaf or the outside of the node, and coplanar faces of the
+ * same leaf are merged into bigger rectangles. Full nodes only have their
+ * sides looked at, however big they are. Returns 0 if memory ran out */
+OCTREE_DEF
+int node_mesh(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_leaf_fn match, void *data, octree_mesh_t *mesh);
+
+
+OCTREE_DEF
+void octree_mesh_free(octree_mesh_t *mesh);
+
+
+/* Add the nodes of node's subtree to stats, everything but bytes */
+OCTREE_DEF
+void node_stats(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stats_t *stats);
+
+
+/* Exact number of bytes node_save_buffer writes for node */
+OCTREE_DEF
+size_t node_save_size(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+OCTREE_DEF
+int node_save_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, char *buff);
+
+
+/* Same as node_save_buffer but never writes more than size bytes. Returns -1
+ * if the buffer is too small */
+OCTREE_DEF
+int node_save_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+OCTREE_DEF
+int node_load_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, const char *buff);
+
+
+/* Same as node_load_buffer but never reads more than size bytes. Returns -1
+ * and leaves node empty if the data is truncated or malformed */
+OCTREE_DEF
+int node_load_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+OCTREE_DEF
+octree_t *octree_construct(uint8_t depth);
+
+
+/* Free the octree. The pool goes with it unless snapshots still use it,
+ * then only the references to its blocks are dropped */
+OCTREE_DEF
+void octree_r_free(octree_t *octree);
+
+
+/* octree_snapshot
+ * params:
+ *      * octree - octree to take a snapshot of.
+ * description:
+ *      * A new octree holding what octree holds now. Both share every block
+ *      and the pool, which is switched to DAG mode like octree_dedup does,
+ *      so a write to either copies only the path it changes. Taking it
+ *      costs the same whatever the size of the octree, once the pool is
+ *      shared. Octrees sharing a pool must be written from one thread at a
+ *      time. Returns NULL if out of memory.
+ */
+OCTREE_DEF
+octree_t *octree_snapshot(octree_t *octree);
+
+
+/* octree_free_step
+ * params:
+ *      * octree - octree to free.
+ *      * budget - about how many blocks to free in this call.
+ * description:
+ *      * Free the octree over several calls, so a big one doesn't stall
+ *      the caller. Returns 1 once it's completely freed, 0 if more calls
+ *      are needed. The octree can't be used once this was called. An
+ *      octree whose pool is used by snapshots is freed in one call.
+ */
+OCTREE_DEF
+int octree_free_step(octree_t *octree, size_t budget);
+
+
+/* Drop every node of the octree at once, leaving an empty(full of 0) root.
+ * With OCTREE_CONCURRENT the blocks are freed one by one instead so
+ * readers can stay */
+OCTREE_DEF
+void octree_clear(octree_t *octree);
+
+
+OCTREE_DEF
+int octree_optimize(octree_t *octree);
+
+
+#if defined(OCTREE_CONCURRENT)
+/* octree_reader_join
+ * params:
+ *      * octree - octree to read.
+ * description:
+ *      * Register the calling thread as a reader, see pool_reader_join. The
+ *      lookup and traversal functions(leaf_get, leaf_get_many, iterators,
+ *      node_get*) may then run between octree_read_lock and
+ *      octree_read_unlock while one writer thread calls leaf_set,
+ *      fill_box, optimize, clear or dedup. Readers see each node change
+ *      whole but may see part of a multi-node change. Loading and saving
+ *      still need the writer to be the only thread in the octree.
+ */
+OCTREE_DEF
+octree_reader_t *octree_reader_join(octree_t *octree);
+
+
+OCTREE_DEF
+size_t octree_reclaim(octree_t *octree);
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_DEF
+octree_stream_t octree_stream_file(FILE *file);
+
+
+#if defined(OCTREE_POSIX)
+/* The fd is stored in the user pointer, no memory is allocated */
+OCTREE_DEF
+octree_stream_t octree_stream_fd(int fd);
+#endif /* OCTREE_POSIX */
+
+
+/* Write node in the node_save_buffer format through a buffer of
+ * OCTREE_STREAM_BUFFER bytes. Returns the bytes written or -1 */
+OCTREE_DEF
+int64_t node_save_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream);
+
+
+/* Returns the bytes belonging to the octree or -1 leaving node empty */
+OCTREE_DEF
+int64_t node_load_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream);
+
+
+/* Compact format:
+ *      "OCTC", version, flags, levels, sizeof(leaf_t), varint palette size,
+ *      varint leaves, varint payload size, [varint deflated size], payload
+ * The payload holds one bit per node in pre-order(1 if full) followed by
+ * the palette index of every node's dom_leaf and every last level leaf in
+ * the same order, stored as varint headed runs that either repeat one index
+ * or bit-pack literal indices. is_original isn't stored, loaded nodes are
+ * original. Version 1 has no leaf size and no dom_leaf for split nodes.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, int flags);
+
+
+/* Returns the bytes read or -1 leaving node empty, also when the leaves
+ * saved are wider than leaf_t */
+OCTREE_DEF
+int64_t node_load_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* DAG format:
+ *      "OCTD", version, levels
+ *      varint leaf blocks, 8 varint leaves per block
+ *      varint node blocks, per block its level then 8 nodes
+ *      root node
+ * A node is a varint that is 0 when full or 1 + the index of its block,
+ * followed by the varint dom_leaf. Blocks come after every block they
+ * reference and each shared block is stored once.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+/* Load a DAG keeping the blocks shared, this shares the pool. Returns the
+ * bytes read or -1 leaving node empty */
+OCTREE_DEF
+int64_t node_load_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* Indexed format:
+ *      "OCTI", version, levels, split
+ *      the nodes above split in pre-order, as node_save_buffer records
+ *      per subtree at split, varint childreen blocks and varint leaf blocks
+ *      every subtree at split in the node_save_buffer format
+ * The block counts give the offset of each subtree, so they are written and
+ * read on up to threads threads, 0 for one per core.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, uint8_t split, int threads);
+
+
+/* Returns the bytes read or -1 leaving node empty. The blocks come from
+ * unused chunks rather than the pool's free blocks */
+OCTREE_DEF
+int64_t node_load_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size, int threads);
+
+
+/* Diff format:
+ *      "OCTP", version, levels
+ *      the op of the root node
+ * An op is 0 when nothing changed, only allowed for the root, 1 followed by
+ * the new subtree in the node_save_buffer format, or 2 followed by the node's
+ * node_save_buffer record, a byte with a bit set per changed child and the op
+ * of each changed child in order. Identical subtrees aren't descended into
+ * when from and to share their blocks.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small or the nodes aren't at the same level */
+OCTREE_DEF
+int64_t node_diff_save(
+        node_pool_t *from_pool, const node_t *from,
+        node_pool_t *to_pool, node_t *to, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+/* Apply a diff to node, which must hold what from held. Returns the bytes
+ * read or -1, leaving node valid but only partially patched */
+OCTREE_DEF
+int64_t node_diff_apply(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* octree_load_buffer
+ * params:
+ *      * octree - octree to write to.
+ *      * buff - buffer containing the raw octree data.
+ * description:
+ *      * Attempt to load raw data into octree. On failure -1  is returned and
+ *      the octree is left empty. Otherwise the bits read is returned
+ */
+OCTREE_DEF
+int octree_load_buffer(octree_t *octree, const char *buff);
+
+
+OCTREE_DEF
+int octree_save_buffer(octree_t *octree, char *buff);
+
+
+/* Number of bytes octree_save_buffer will write */
+OCTREE_DEF
+size_t octree_save_size(octree_t *octree);
+
+
+/* Walk the octree to fill stats, in time proportional to its nodes */
+OCTREE_DEF
+void octree_stats(octree_t *octree, octree_stats_t *stats);
+
+
+#if defined(OCTREE_COUNTERS)
+/* The totals of stats in constant time, from the pool's counters: n_nodes,
+ * n_full, n_split, the block counts and bytes. The counters cover the whole
+ * pool and count shared blocks once, so this matches octree_stats until
+ * octree_dedup is used. After octree_snapshot they cover every octree
+ * sharing the pool. The rest is set to 0 */
+OCTREE_DEF
+void octree_stats_totals(const octree_t *octree, octree_stats_t *stats);
+#endif /* OCTREE_COUNTERS */
+
+
+/* octree_load_buffer_n
+ * params:
+ *      * octree - octree to write to.
+ *      * buff - buffer containing the raw octree data.
+ *      * size - number of bytes available in buff.
+ * description:
+ *      * Same as octree_load_buffer but fails with -1 instead of reading past
+ *      size bytes, leaving the octree empty.
+ */
+OCTREE_DEF
+int octree_load_buffer_n(octree_t *octree, const char *buff, size_t size);
+
+
+/* Returns -1 without writing past size bytes if buff is too small */
+OCTREE_DEF
+int octree_save_buffer_n(octree_t *octree, char *buff, size_t size);
+
+
+/* octree_save_stream
+ * params:
+ *      * octree - octree to save.
+ *      * stream - where to write, see octree_stream_file and octree_stream_fd.
+ * description:
+ *      * Writes the same bytes as octree_save_buffer using a fixed buffer of
+ *      OCTREE_STREAM_BUFFER bytes. Returns the bytes written or -1.
+ */
+OCTREE_DEF
+int64_t octree_save_stream(octree_t *octree, octree_stream_t *stream);
+
+
+OCTREE_DEF
+int64_t octree_load_stream(octree_t *octree, octree_stream_t *stream);
+
+
+/* octree_save_compact
+ * params:
+ *      * octree - octree to save.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ *      * flags - OCTREE_COMPACT_DEFLATE to deflate the payload. Ignored
+ *      unless the library is built with OCTREE_ZLIB.
+ * description:
+ *      * Save the octree in the versioned compact format. Returns the number
+ *      of bytes written or -1 if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_save_compact(
+        octree_t *octree, char *buff, size_t size, int flags);
+
+
+OCTREE_DEF
+int64_t octree_load_compact(octree_t *octree, const char *buff, size_t size);
+
+
+/* octree_dedup
+ * params:
+ *      * octree - octree to deduplicate.
+ * description:
+ *      * Switch the octree to DAG mode, where identical subtrees share their
+ *      blocks, and merge every identical subtree. Writes copy the shared
+ *      blocks they touch so the other copies aren't affected, call this
+ *      again after heavy edits. Returns the number of blocks replaced by a
+ *      shared one or -1 if memory ran out.
+ */
+OCTREE_DEF
+int64_t octree_dedup(octree_t *octree);
+
+
+/* Same as octree_save_compact with the DAG format, without flags */
+OCTREE_DEF
+int64_t octree_save_dag(octree_t *octree, char *buff, size_t size);
+
+
+OCTREE_DEF
+int64_t octree_load_dag(octree_t *octree, const char *buff, size_t size);
+
+
+/* octree_save_indexed
+ * params:
+ *      * octree - octree to save.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ *      * split - level of the subtrees saved in parallel, 1 for the 8
+ *      childreen of the root and 2 for the 64 below them.
+ *      * threads - threads to use, 0 for one per core. Only the calling
+ *      thread without OCTREE_THREADS.
+ * description:
+ *      * Save the octree in the indexed format, which octree_load_indexed
+ *      loads on several threads. Returns the number of bytes written or -1
+ *      if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_save_indexed(
+        octree_t *octree, char *buff, size_t size, uint8_t split, int threads);
+
+
+OCTREE_DEF
+int64_t octree_load_indexed(
+        octree_t *octree, const char *buff, size_t size, int threads);
+
+
+/* octree_diff_save
+ * params:
+ *      * old - octree as the receiver has it, usually a snapshot of new.
+ *      * new - octree as it is now, of the same depth as old.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ * description:
+ *      * Save what changed from old to new, octree_diff_apply turns a copy
+ *      of old into new. Subtrees whose blocks old and new share are skipped
+ *      without being read, so taking a snapshot after each diff keeps the
+ *      next one proportional to the edits. Returns the number of bytes
+ *      written or -1 if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_diff_save(
+        octree_t *old, octree_t *new, char *buff, size_t size);
+
+
+OCTREE_DEF
+int64_t octree_diff_apply(octree_t *octree, const char *buff, size_t size);
 
 
+/* octree_world_construct
+ * params:
+ *      * dir - existing directory holding one file per saved chunk.
+ *      * depth - depth of the octree of each chunk.
+ *      * budget - bytes the chunks in memory may take before the least
+ *      recently used ones are evicted.
+ * description:
+ *      * Open a paged world. Chunks are loaded the first time they're
+ *      used, empty if they have no file yet. With OCTREE_THREADS the
+ *      loading and saving is done on a thread of the world's own. The
+ *      world itself must be used from one thread at a time.
+ */
 OCTREE_DEF
-node_t *node_construct(void);
+octree_world_t *octree_world_construct(
+        const char *dir, uint8_t depth, size_t budget);
 
 
+/* Save the modified chunks and free the world. Returns 0 if a chunk
+ * couldn't be saved */
 OCTREE_DEF
-int node_init_childreen(node_t *node);
+int octree_world_free(octree_world_t *world);
 
 
-/* Get nodes or create them if they don't exist */
+/* octree_world_chunk
+ * params:
+ *      * world - world to look in.
+ *      * chunk - position of the chunk, in chunks.
+ *      * write - true if the octree is going to be modified.
+ * description:
+ *      * The chunk's octree, loaded if it wasn't in memory, or NULL if its
+ *      file couldn't be read. Other chunks may be evicted, the octree
+ *      stays valid until the next call that can load a chunk.
+ */
 OCTREE_DEF
-node_t *node_get_or_create(
-        node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth);
+octree_t *octree_world_chunk(
+        octree_world_t *world, const int chunk[3], bool write);
 
 
-/* Recrusively free the last level */
-/* TODO: write a none recursive versino of this function */
+/* Start loading the chunk in the background. Does nothing without
+ * OCTREE_THREADS */
 OCTREE_DEF
-void node_r_free_last(node_t *node, uint8_t last_level, uint8_t depth);
+void octree_world_prefetch(octree_world_t *world, const int chunk[3]);
 
 
+/* Save the modified chunks without evicting them. Returns 0 if a chunk
+ * couldn't be saved */
 OCTREE_DEF
-void node_r_free(node_t *node, uint8_t depth);
+int octree_world_flush(octree_world_t *world);
 
 
+/* The leaf at pos, in leaves from the world's origin. 0 if its chunk
+ * couldn't be loaded */
 OCTREE_DEF
-int node_save_buffer(node_t *node, uint8_t oc_depth, char *buff);
+leaf_t octree_world_leaf_get(octree_world_t *world, const int pos[3]);
 
 
 OCTREE_DEF
-int node_load_buffer(node_t *node, uint8_t oc_depth, const char *buff);
+int octree_world_leaf_set(octree_world_t *world, const int pos[3], leaf_t leaf);
 
 
+/* octree_fill_box over every chunk the box overlaps */
 OCTREE_DEF
-octree_t *octree_construct(uint8_t depth);
+int octree_world_fill_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        leaf_t leaf);
 
 
+/* node_query_box over every chunk the box overlaps, chunk by chunk */
 OCTREE_DEF
-void octree_r_free(octree_t *octree);
+int octree_world_query_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        octree_leaf_fn match, octree_world_fn fn, void *data);
 
 
-/* octree_load_buffer
- * params:
- *      * octree - octree to write to.
- *      * buff - buffer containing the raw octree data.
- * description:
- *      * Attempt to load raw data into octree. On failure -1  is returned and
- *      the octree's root node is freed. Otherwise the bits read is returned
- */
+/* octree_raycast through the chunks the ray crosses, up to max_dist and
+ * OCTREE_WORLD_RAY_CHUNKS chunks. hit->pos is in the world, hit->index in the
+ * chunk holding it. Chunks that aren't in memory and have no file are empty,
+ * they're crossed without being loaded */
 OCTREE_DEF
-int octree_load_buffer(octree_t *octree, const char *buff);
+int octree_world_raycast(
+        octree_world_t *world, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn match, void *data, octree_hit_t *hit);
 
 
+/* Convert n positions to indices. Uses SSE2 when available */
 OCTREE_DEF
-int octree_save_buffer(octree_t *octree, char *buff);
+void octree_pos_to_index_n(
+        int pos[][3], octree_index_t *index, size_t n, uint8_t oc_depth);
+
+
+OCTREE_DEF
+void octree_index_to_pos_n(
+        const octree_index_t *index, int pos[][3], size_t n, uint8_t oc_depth);
 
 
 /* TODO: rename this function to something better */
 OCTREE_INLINE
-uint32_t _octree_i3d_to_uint(uint32_t x)
+octree_index_t _octree_i3d_to_uint(octree_index_t x)
 {
-    return ((x) & 0x1) | (((x) & 0x2) << 9) | (((x) & 0x4) << 18);
+    return ((x) & 0x1) |
+           (((x) & 0x2) << (OCTREE_POS_BITS - 1)) |
+           (((x) & 0x4) << (OCTREE_POS_BITS * 2 - 2));
 }
 
 
 /* TODO: rename this function to something better */
 OCTREE_INLINE
-uint32_t _octree_uint_to_i3d(uint32_t x) {
-    return ((x) & 0x1) | (((x) >> 9) & 0x2) | (((x) >> 18) & 0x4);
+octree_index_t _octree_uint_to_i3d(octree_index_t x) {
+    return ((x) & 0x1) |
+           (((x) >> (OCTREE_POS_BITS - 1)) & 0x2) |
+           (((x) >> (OCTREE_POS_BITS * 2 - 2)) & 0x4);
 }
 
 
 OCTREE_INLINE
-uint32_t octree_pack_pos(int p[3])
+octree_index_t octree_pack_pos(int p[3])
 {
-    return (((uint32_t)p[0] & 0x3FF) |
-            ((uint32_t)p[1] & 0x3FF) << 10 |
-            ((uint32_t)p[2] & 0x3FF) << 20);
+    return (((octree_index_t)p[0] & OCTREE_POS_MASK) |
+            ((octree_index_t)p[1] & OCTREE_POS_MASK) << OCTREE_POS_BITS |
+            ((octree_index_t)p[2] & OCTREE_POS_MASK) << (OCTREE_POS_BITS * 2));
 }
 
 
 OCTREE_INLINE
-void octree_unpack_pos(uint32_t x, int pos[3])
+void octree_unpack_pos(octree_index_t x, int pos[3])
 {
-    pos[0] = (x & 0x3FF);
-    pos[1] = (x & 0xFFC00) >> 10;
-    pos[2] = (x & 0x3FF00000) >> 20;
+    pos[0] = (int)(x & OCTREE_POS_MASK);
+    pos[1] = (int)((x >> OCTREE_POS_BITS) & OCTREE_POS_MASK);
+    pos[2] = (int)((x >> (OCTREE_POS_BITS * 2)) & OCTREE_POS_MASK);
 }
 
 
+/* Spread the OCTREE_POS_BITS low bits of x so there are 2 zero bits between
+ * each bit */
 OCTREE_INLINE
-uint32_t octree_packed_pos_to_index(uint32_t packed, uint8_t oc_depth)
+octree_index_t _octree_morton_spread(octree_index_t x)
 {
-    uint32_t index = 0,
-             bit = 0;
-    for (int i = 0; i < oc_depth; i++) {
-        index += _octree_uint_to_i3d(packed >> i) << bit;
-        bit += 3;
-    }
-    return index;
+#if defined(OCTREE_INDEX_64)
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+    x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x << 2)) & OCTREE_MORTON_X;
+#else
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & OCTREE_MORTON_X;
+#endif /* OCTREE_INDEX_64 */
+    return x;
 }
 
 
+/* Inverse of _octree_morton_spread */
 OCTREE_INLINE
-uint32_t octree_index_to_packed_pos(uint32_t index, uint8_t oc_depth)
+octree_index_t _octree_morton_compact(octree_index_t x)
 {
-    uint32_t packed = 0,
-             bit = 0;
-    for (int i = 0; i < oc_depth; i++) {
-        packed += _octree_i3d_to_uint(index >> bit) << i;
-        bit += 3;
-    }
-    return packed;
+    x &= OCTREE_MORTON_X;
+#if defined(OCTREE_INDEX_64)
+    x = (x | (x >> 2)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x >> 4)) & 0x100F00F00F00F00Full;
+    x = (x | (x >> 8)) & 0x001F0000FF0000FFull;
+    x = (x | (x >> 16)) & 0x001F00000000FFFFull;
+    x = (x | (x >> 32)) & 0x1FFFFF;
+#else
+    x = (x | (x >> 2)) & 0x030C30C3;
+    x = (x | (x >> 4)) & 0x0300F00F;
+    x = (x | (x >> 8)) & 0x030000FF;
+    x = (x | (x >> 16)) & 0x3FF;
+#endif /* OCTREE_INDEX_64 */
+    return x;
+}
+
+
+/* Position of the highest set bit, x must not be 0 */
+OCTREE_INLINE
+int _octree_log2(uint32_t x)
+{
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(x);
+#else
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+#endif
+}
+
+
+/* Same as _octree_log2 for an index */
+OCTREE_INLINE
+int _octree_index_log2(octree_index_t x)
+{
+#if defined(OCTREE_INDEX_64) && defined(__GNUC__)
+    return 63 - __builtin_clzll(x);
+#elif defined(OCTREE_INDEX_64)
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+#else
+    return _octree_log2(x);
+#endif
+}
+
+
+/* Bits of an index used by an octree of depth oc_depth */
+OCTREE_INLINE
+octree_index_t octree_index_mask(uint8_t oc_depth)
+{
+    return (octree_index_t)((1ull << (oc_depth * 3)) - 1);
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_packed_pos_to_index(octree_index_t packed, uint8_t oc_depth)
+{
+#if defined(OCTREE_BMI2) && defined(OCTREE_INDEX_64)
+    octree_index_t index =
+        _pdep_u64(packed, OCTREE_MORTON_X) |
+        _pdep_u64(packed >> OCTREE_POS_BITS, OCTREE_MORTON_Y) |
+        _pdep_u64(packed >> (OCTREE_POS_BITS * 2), OCTREE_MORTON_Z);
+#elif defined(OCTREE_BMI2)
+    octree_index_t index = _pdep_u32(packed, OCTREE_MORTON_X) |
+                     _pdep_u32(packed >> 10, OCTREE_MORTON_Y) |
+                     _pdep_u32(packed >> 20, OCTREE_MORTON_Z);
+#else
+    octree_index_t index =
+        _octree_morton_spread(packed) |
+        _octree_morton_spread(packed >> OCTREE_POS_BITS) << 1 |
+        _octree_morton_spread(packed >> (OCTREE_POS_BITS * 2)) << 2;
+#endif
+    return index & octree_index_mask(oc_depth);
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_index_to_packed_pos(octree_index_t index, uint8_t oc_depth)
+{
+    index &= octree_index_mask(oc_depth);
+#if defined(OCTREE_BMI2) && defined(OCTREE_INDEX_64)
+    return _pext_u64(index, OCTREE_MORTON_X) |
+           _pext_u64(index, OCTREE_MORTON_Y) << OCTREE_POS_BITS |
+           _pext_u64(index, OCTREE_MORTON_Z) << (OCTREE_POS_BITS * 2);
+#elif defined(OCTREE_BMI2)
+    return _pext_u32(index, OCTREE_MORTON_X) |
+           _pext_u32(index, OCTREE_MORTON_Y) << 10 |
+           _pext_u32(index, OCTREE_MORTON_Z) << 20;
+#else
+    return _octree_morton_compact(index) |
+           _octree_morton_compact(index >> 1) << OCTREE_POS_BITS |
+           _octree_morton_compact(index >> 2) << (OCTREE_POS_BITS * 2);
+#endif
 }
 
 
 OCTREE_INLINE
-uint32_t octree_pos_to_index(int pos[3], uint8_t oc_depth)
+octree_index_t octree_pos_to_index(int pos[3], uint8_t oc_depth)
 {
-    uint32_t packed = octree_pack_pos(pos);
+    octree_index_t packed = octree_pack_pos(pos);
 
     return octree_packed_pos_to_index(packed, oc_depth);
 }
 
 
 OCTREE_INLINE
-void octree_index_to_pos(uint32_t index, int pos[3], uint8_t oc_depth)
+void octree_index_to_pos(octree_index_t index, int pos[3], uint8_t oc_depth)
 {
-    uint32_t packed = octree_index_to_packed_pos(index, oc_depth);
+    octree_index_t packed = octree_index_to_packed_pos(index, oc_depth);
 
     octree_unpack_pos(packed, pos);
 }
 
 
+/* Index of the leaf delta away from index, added axis by axis on the bits
+ * of the index itself(dilated integers) without going through positions.
+ * Each delta must be smaller than the octree's width. Returns false if the
+ * leaf is outside of the octree */
+OCTREE_INLINE
+bool octree_index_add(
+        octree_index_t index, const int delta[3], uint8_t oc_depth,
+        octree_index_t *out)
+{
+    const octree_index_t mask = octree_index_mask(oc_depth);
+
+    for (int a = 0; a < 3; a++) {
+        const octree_index_t m = (OCTREE_MORTON_X << a) & mask,
+                             v = index & m;
+        octree_index_t d, r;
+
+        if (delta[a] == 0) continue;
+
+        if (delta[a] > 0) {
+            d = _octree_morton_spread((octree_index_t)delta[a]) << a;
+            /* The bits between the axis' ones carry the sum over */
+            r = ((v | ~m) + d) & m;
+            if (r < v) return false;
+        }
+        else {
+            d = _octree_morton_spread((octree_index_t)-delta[a]) << a;
+            if (d > v) return false;
+            r = (v - d) & m;
+        }
+        index = (index & ~m) | r;
+    }
+    *out = index;
+    return true;
+}
+
+
+
+/* Accesses to nodes and leaves the writer may change under readers */
+OCTREE_INLINE
+node_t node_read(const node_t *node)
+{
+#if defined(OCTREE_CONCURRENT)
+    node_t copy;
+
+    __atomic_load(node, &copy, __ATOMIC_ACQUIRE);
+    return copy;
+#else
+    return *node;
+#endif
+}
+
+
+OCTREE_INLINE
+void node_write(node_t *node, node_t value)
+{
+#if defined(OCTREE_CONCURRENT)
+    __atomic_store(node, &value, __ATOMIC_RELEASE);
+#else
+    *node = value;
+#endif
+}
+
+
+OCTREE_INLINE
+leaf_t leaf_read(const leaf_t *leaves, uint32_t i)
+{
+#if defined(OCTREE_CONCURRENT)
+    return __atomic_load_n(leaves + i, __ATOMIC_RELAXED);
+#else
+    return leaves[i];
+#endif
+}
+
+
+OCTREE_INLINE
+void leaf_write(leaf_t *leaves, uint32_t i, leaf_t leaf)
+{
+#if defined(OCTREE_CONCURRENT)
+    __atomic_store_n(leaves + i, leaf, __ATOMIC_RELAXED);
+#else
+    leaves[i] = leaf;
+#endif
+}
+
+
+/* Make node full of leaf in one store. Its block isn't freed, the caller
+ * does that after so readers never reach a freed block */
+OCTREE_INLINE
+void node_set_full(node_t *node, leaf_t leaf)
+{
+    node_t full = *node;
+
+    full.childreen = 0;
+    full.is_full = true;
+    full.dom_leaf = leaf;
+    node_write(node, full);
+}
+
+
+#if defined(OCTREE_CONCURRENT)
+OCTREE_INLINE
+void octree_read_lock(octree_reader_t *reader)
+{
+    uint64_t epoch = __atomic_load_n(&reader->pool->epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+    /* The epoch must be visible before any node is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+OCTREE_INLINE
+void octree_read_unlock(octree_reader_t *reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_INLINE
+node_t *pool_childreen(const node_pool_t *pool, uint32_t childreen)
+{
+    char *chunk =
+        OCTREE_ACQUIRE(&pool->childreen.chunks)[childreen >> OCTREE_POOL_SHIFT];
+
+    return (node_t *)chunk + (size_t)(childreen & OCTREE_POOL_MASK) * 8;
+}
+
+
+OCTREE_INLINE
+leaf_t *pool_leaves(const node_pool_t *pool, uint32_t leaves)
+{
+    char *chunk =
+        OCTREE_ACQUIRE(&pool->leaves.chunks)[leaves >> OCTREE_POOL_SHIFT];
+
+    return (leaf_t *)chunk + (size_t)(leaves & OCTREE_POOL_MASK) * 8;
+}
+
 
 /* Naive function, shouldn't be used */
 OCTREE_INLINE
-node_t *node_get(node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
+node_t *node_get(
+        const node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth)
 {
     node_t *l_node = node;
     uint8_t c_level = node->level;
@@ -258,7 +1673,7 @@ node_t *node_get(node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
     for (; c_level < level; c_level++) {
         uint8_t c_index = (index >> bit) & 0x7;
         
-        l_node = l_node->childreen[c_index];
+        l_node = pool_childreen(pool, node_read(l_node).childreen) + c_index;
         bit -= 3;
     }
     return l_node;
@@ -268,7 +1683,8 @@ node_t *node_get(node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
 /* Get the nearest node to the level */
 OCTREE_INLINE
 node_t *node_get_nearest(
-        node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
+        const node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth)
 {
     node_t *l_node = node;
 
@@ -276,10 +1692,11 @@ node_t *node_get_nearest(
     uint32_t bit = (oc_depth - c_level - 1) * 3;
     for (; c_level < level; c_level++) {
         uint8_t c_index = (index >> bit) & 0x7;
+        node_t l_value = node_read(l_node);
 
-        if (l_node->is_full || !l_node->childreen) break;
+        if (l_value.is_full || !l_value.childreen) break;
 
-        l_node = l_node->childreen[c_index];
+        l_node = pool_childreen(pool, l_value.childreen) + c_index;
         bit -= 3;
     }
     return l_node;
@@ -293,6 +1710,19 @@ bool leaves_full(leaf_t *leaves, leaf_t leaf)
 }
 
 
+/* True if all 8 childreen are full of leaf */
+OCTREE_INLINE
+bool childreen_full(const node_t *childreen, leaf_t leaf)
+{
+    for (int i = 0; i < 8; i++) {
+        if (!childreen[i].is_full || childreen[i].dom_leaf != leaf) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
 OCTREE_INLINE
 void leaves_fill(leaf_t *leaves, leaf_t leaf)
 {
@@ -304,58 +1734,87 @@ void leaves_fill(leaf_t *leaves, leaf_t leaf)
 
 
 OCTREE_INLINE
-int leaf_get(node_t *node, uint32_t index, uint8_t oc_depth)
+int leaf_get(
+        const node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth)
 {
-    /* Get node at the last level*/
-    node_t *l_node = node_get_nearest(node, index, oc_depth - 1, oc_depth);
-
-    int leaf =
-        (l_node->is_full)
-            ? l_node->dom_leaf
-            : l_node->leaves[index & 0x7];
+    /* Walk down to the last level on copies of the nodes, so the node
+     * tested is the one used even if the writer changes it */
+    node_t l_value = node_read(node);
+    uint32_t bit = (oc_depth - l_value.level - 1) * 3;
+
+    while (!l_value.is_full && l_value.level < oc_depth - 1) {
+        l_value = node_read(pool_childreen(pool, l_value.childreen) +
+                            ((index >> bit) & 0x7));
+        bit -= 3;
+    }
 
-    return leaf;
+    return (l_value.is_full)
+        ? l_value.dom_leaf
+        : leaf_read(pool_leaves(pool, l_value.leaves), index & 0x7);
 }
 
 
 OCTREE_INLINE
-void node_leaves_init(node_t *node, leaf_t leaf)
+void node_leaves_init(node_pool_t *pool, node_t *node, leaf_t leaf)
 {
-    node->is_full = false;
-    node->leaves = (leaf_t *)calloc(8, sizeof(leaf_t));
+    uint32_t leaves = pool_alloc_leaves(pool);
 
-    if (node->leaves) leaves_fill(node->leaves, node->dom_leaf);
+    if (leaves) {
+        node_t split = *node;
+
+        leaves_fill(pool_leaves(pool, leaves), leaf);
+        split.leaves = leaves;
+        split.is_full = false;
+        node_write(node, split);
+    }
 }
 
 
 OCTREE_INLINE
-int leaf_set(node_t *node, uint32_t index, uint8_t oc_depth, leaf_t leaf)
+int leaf_set(
+        node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t oc_depth, leaf_t leaf)
 {
     int success = 0;
-    node_t *l_node = node_get_nearest(node, index, oc_depth - 1, oc_depth);
+    node_t *l_node =
+        node_get_nearest(pool, node, index, oc_depth - 1, oc_depth);
     bool is_last = (l_node->level == oc_depth - 1);
 
-    if (l_node->is_full) {
+    if (l_node->is_full && l_node->dom_leaf == leaf) {
         /* Nothing to be done */
-        if (l_node->dom_leaf == leaf) return 1;
+        return 1;
+    }
+
+    if (pool->shared) {
+        if (!node_unshare_path(pool, node, index, oc_depth)) return 0;
+
+        l_node = node_get_nearest(pool, node, index, oc_depth - 1, oc_depth);
+    }
 
+    if (l_node->is_full) {
         l_node = (is_last)
             ? l_node
-            : node_get_or_create(node, index, oc_depth - 1, oc_depth);
+            : node_get_or_create(pool, node, index, oc_depth - 1, oc_depth);
 
-        node_leaves_init(l_node, l_node->dom_leaf);
+        if (l_node == NULL) return 0;
+
+        node_leaves_init(pool, l_node, l_node->dom_leaf);
+        if (l_node->is_full) return 0;
     }
 
     if (l_node->leaves) {
-        l_node->leaves[index & 0x7] = leaf;
+        leaf_t *leaves = pool_leaves(pool, l_node->leaves);
+
+        leaf_write(leaves, index & 0x7, leaf);
         success = 1;
 
-        /* TODO: Add node_optimize function */
-        if (leaves_full(l_node->leaves, leaf)) {
-            free(l_node->leaves);
-            l_node->leaves = NULL;
-            l_node->is_full = true;
-            l_node->dom_leaf = leaf;
+        if (leaves_full(leaves, leaf)) {
+            uint32_t old = l_node->leaves;
+
+            node_set_full(l_node, leaf);
+            pool_free_leaves(pool, old);
+
+            node_optimize_path(pool, node, index, oc_depth);
         }
     }
 
@@ -364,38 +1823,257 @@ int leaf_set(node_t *node, uint32_t index, uint8_t oc_depth, leaf_t leaf)
 
 
 OCTREE_INLINE
-node_t *octree_node_get(octree_t *octree, uint32_t index, uint8_t level)
+void node_cursor_init(
+        octree_cursor_t *cursor, node_pool_t *pool, node_t *node,
+        uint8_t oc_depth)
+{
+    cursor->pool = pool;
+    cursor->path[0] = node;
+    /* No index shares a node with ~0, this forces the first descent */
+    cursor->prev = ~(octree_index_t)0;
+    cursor->generation = OCTREE_ACQUIRE(&pool->generation);
+    cursor->oc_depth = oc_depth;
+    cursor->base = node_read(node).level;
+    cursor->top = 0;
+}
+
+
+/* Deepest node on the path to index, kept in cursor->path[cursor->top]. A
+ * copy is returned so the node tested is the one used even if the writer
+ * changes it */
+OCTREE_INLINE
+node_t cursor_find(octree_cursor_t *cursor, octree_index_t index)
+{
+    const uint8_t oc_depth = cursor->oc_depth, base = cursor->base;
+    const uint32_t generation = OCTREE_ACQUIRE(&cursor->pool->generation);
+    node_t l_value;
+    int k = cursor->top;
+
+    if (generation != cursor->generation) {
+        cursor->generation = generation;
+        k = 0;
+    }
+    else {
+        const octree_index_t diff =
+            (index ^ cursor->prev) & octree_index_mask(oc_depth);
+
+        if (diff) {
+            /* Deepest level on the previous path still containing index */
+            int shared =
+                oc_depth - 1 - _octree_index_log2(diff) / 3 - base;
+
+            if (shared < k) k = shared;
+            if (k < 0) k = 0;
+        }
+    }
+
+    l_value = node_read(cursor->path[k]);
+    while (k + base < oc_depth - 1 && !l_value.is_full) {
+        uint32_t bit = (oc_depth - (k + base) - 1) * 3;
+
+        cursor->path[++k] = pool_childreen(cursor->pool, l_value.childreen) +
+                            ((index >> bit) & 0x7);
+        l_value = node_read(cursor->path[k]);
+    }
+    cursor->top = (uint8_t)k;
+    cursor->prev = index;
+
+    return l_value;
+}
+
+
+/* Same as leaf_get, for the tree the cursor was initialized on */
+OCTREE_INLINE
+leaf_t cursor_leaf_get(octree_cursor_t *cursor, octree_index_t index)
+{
+    const node_t l_value = cursor_find(cursor, index);
+
+    return (l_value.is_full)
+        ? l_value.dom_leaf
+        : leaf_read(pool_leaves(cursor->pool, l_value.leaves), index & 0x7);
+}
+
+
+/* Same as leaf_set. A leaf written in a block of leaves that stays mixed
+ * and isn't shared is set in place, anything else goes through leaf_set */
+OCTREE_INLINE
+int cursor_leaf_set(octree_cursor_t *cursor, octree_index_t index, leaf_t leaf)
+{
+    const node_t l_value = cursor_find(cursor, index);
+
+    if (l_value.is_full) {
+        if (l_value.dom_leaf == leaf) return 1;
+    }
+    else if (!cursor->pool->shared) {
+        leaf_t *leaves = pool_leaves(cursor->pool, l_value.leaves);
+
+        leaf_write(leaves, index & 0x7, leaf);
+        /* leaf_set collapses the block once it's filled */
+        if (!leaves_full(leaves, leaf)) return 1;
+    }
+
+    return leaf_set(
+            cursor->pool, cursor->path[0], index, cursor->oc_depth, leaf);
+}
+
+
+OCTREE_INLINE
+node_t *octree_node_get(octree_t *octree, octree_index_t index, uint8_t level)
 {
-    return node_get(octree->root, index, level, octree->depth);
+    return node_get(octree->pool, octree->root, index, level, octree->depth);
 }
 
 
 OCTREE_INLINE
-node_t *octree_node_get_nearest(octree_t *octree, uint32_t index, uint8_t level)
+node_t *octree_node_get_nearest(octree_t *octree, octree_index_t index, uint8_t level)
 {
-    return node_get_nearest(octree->root, index, level, octree->depth);
+    return node_get_nearest(
+            octree->pool, octree->root, index, level, octree->depth);
 }
 
 
 OCTREE_INLINE
 node_t *octree_node_get_or_create(
-        octree_t *octree, uint32_t index, uint8_t level)
+        octree_t *octree, octree_index_t index, uint8_t level)
+{
+    return node_get_or_create(
+            octree->pool, octree->root, index, level, octree->depth);
+}
+
+
+OCTREE_INLINE
+leaf_t octree_leaf_get(octree_t *octree, octree_index_t index)
+{
+    return leaf_get(octree->pool, octree->root, index, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_many(
+        octree_t *octree, const octree_index_t *indices, leaf_t *out, size_t n)
+{
+    leaf_get_many(octree->pool, octree->root, indices, out, n, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_neighbors(
+        octree_t *octree, octree_index_t index, leaf_t border, leaf_t out[6])
+{
+    leaf_get_neighbors(
+            octree->pool, octree->root, index, octree->depth, border, out);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_neighborhood(
+        octree_t *octree, octree_index_t index, leaf_t border, leaf_t out[27])
+{
+    leaf_get_neighborhood(
+            octree->pool, octree->root, index, octree->depth, border, out);
+}
+
+
+/* Set every leaf with min <= pos < max to leaf */
+OCTREE_INLINE
+int octree_fill_box(octree_t *octree, int min[3], int max[3], leaf_t leaf)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_fill_box(
+            octree->pool, octree->root, origin, min, max, octree->depth, leaf);
+}
+
+
+/* The cursor stays usable while the octree exists, whatever is done to it */
+OCTREE_INLINE
+void octree_cursor_init(octree_cursor_t *cursor, octree_t *octree)
+{
+    node_cursor_init(cursor, octree->pool, octree->root, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_iter_init(node_iter_t *it, octree_t *octree, uint8_t max_level)
+{
+    node_iter_init(it, octree->pool, octree->root, octree->depth, max_level);
+}
+
+
+OCTREE_INLINE
+int octree_visit(
+        octree_t *octree, uint8_t max_level, octree_visit_fn fn, void *data)
+{
+    return node_visit(
+            octree->pool, octree->root, octree->depth, max_level, fn, data);
+}
+
+
+/* Runs with leaves in [min, max), see node_query_box */
+OCTREE_INLINE
+int octree_query_box(
+        octree_t *octree, const int min[3], const int max[3],
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_query_box(
+            octree->pool, octree->root, origin, min, max, octree->depth,
+            match, fn, data);
+}
+
+
+/* Runs inside the frustum given by its planes, see node_query_planes */
+OCTREE_INLINE
+int octree_query_frustum(
+        octree_t *octree, const float planes[][4], int n,
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_query_planes(
+            octree->pool, octree->root, origin, planes, n, octree->depth,
+            match, fn, data);
+}
+
+
+OCTREE_INLINE
+int octree_mesh(
+        octree_t *octree, octree_leaf_fn match, void *data,
+        octree_mesh_t *mesh)
+{
+    return node_mesh(
+            octree->pool, octree->root, octree->depth, match, data, mesh);
+}
+
+
+OCTREE_INLINE
+int octree_raycast(
+        octree_t *octree, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hit)
 {
-    return node_get_or_create(octree->root, index, level, octree->depth);
+    return node_raycast(
+            octree->pool, octree->root, octree->depth,
+            origin, dir, max_dist, fn, data, hit);
 }
 
 
 OCTREE_INLINE
-leaf_t octree_leaf_get(octree_t *octree, uint32_t index)
+size_t octree_raycast_n(
+        octree_t *octree, const float origins[][3], const float dirs[][3],
+        size_t n, float max_dist, octree_leaf_fn fn, void *data,
+        octree_hit_t *hits)
 {
-    return leaf_get(octree->root, index, octree->depth);
+    return node_raycast_n(
+            octree->pool, octree->root, octree->depth,
+            origins, dirs, n, max_dist, fn, data, hits);
 }
 
 
 OCTREE_INLINE
-int octree_leaf_set(octree_t *octree, uint32_t index, leaf_t leaf)
+int octree_leaf_set(octree_t *octree, octree_index_t index, leaf_t leaf)
 {
-    return leaf_set(octree->root, index, octree->depth, leaf);
+    return leaf_set(octree->pool, octree->root, index, octree->depth, leaf);
 }
 
 #endif /* OCTREE_H */
@@ -1,9 +1,10 @@
 /*
  * Fast octree library(not sparse octree)
  * Limitations:
- *  - The maximum depth for an octree is 10
+ *  - The maximum depth for an octree is 10, or 21 with OCTREE_INDEX_64
  * Important remark:
- *  - Indices are 4 byte unsigned integers containing a 3-bit number represeing
+ *  - Indices(octree_index_t) are unsigned integers, 8 bytes with
+ *  OCTREE_INDEX_64 and 4 otherwise, containing a 3-bit number represeing
  *  the location of each node relative to it's parent.
  *
  *  Example:
@@ -25,7 +26,7 @@
  *          <repeat 7x>
  *
  *      this index could be defined as:
- *      uint32_t index = 1 << 0 |  2 << 3 | 0 << 6;
+ *      octree_index_t index = 1 << 0 |  2 << 3 | 0 << 6;
  *
  *      this makes iterating an octree as easy as doing index++
  *
@@ -59,6 +60,55 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(OCTREE_POSIX)
+#define OCTREE_POSIX
+#endif /* __unix__ || __APPLE__ */
+
+#if defined(OCTREE_POSIX)
+#include <unistd.h>
+#endif /* OCTREE_POSIX */
+
+
+/* Define OCTREE_THREADS to let the indexed save/load split the work across
+ * threads and give paged worlds an I/O thread, link with -pthread. Without
+ * it they run on the calling thread */
+#if defined(OCTREE_THREADS)
+#if !defined(OCTREE_POSIX)
+#error "OCTREE_THREADS needs pthreads"
+#endif /* OCTREE_POSIX */
+#include <pthread.h>
+#endif /* OCTREE_THREADS */
+
+
+/* Lets octree_save_compact deflate its output, link with -lz */
+#if defined(OCTREE_ZLIB)
+#include <zlib.h>
+#endif /* OCTREE_ZLIB */
+
+
+#if defined(__BMI2__) && !defined(OCTREE_NO_BMI2)
+#define OCTREE_BMI2
+#include <immintrin.h>
+#endif /* __BMI2__ */
+
+
+/* The SSE2 conversions work on 4 byte indices */
+#if defined(__SSE2__) && !defined(OCTREE_NO_SIMD) && !defined(OCTREE_INDEX_64)
+#define OCTREE_SSE2
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+
+/* Lets one writer thread change an octree while other threads read it
+ * without locking, see octree_reader_join. Needs the __atomic builtins */
+#if defined(OCTREE_CONCURRENT) && !defined(__GNUC__)
+#error "OCTREE_CONCURRENT needs GCC or clang"
+#endif /* OCTREE_CONCURRENT */
 
 
 #ifndef OCTREE_INLINE
@@ -76,525 +126,7347 @@
 #endif /* OCTREE_LEAF_TYPE */
 
 
+/* Indices are 64 bit with OCTREE_INDEX_64, which allows deeper octrees.
+ * OCTREE_POS_BITS is the number of bits of each coordinate in a packed
+ * position */
+#if defined(OCTREE_INDEX_64)
+#define OCTREE_MAX_DEPTH 21
+#define OCTREE_POS_BITS 21
+#else
+#define OCTREE_MAX_DEPTH 10
+#define OCTREE_POS_BITS 10
+#endif /* OCTREE_INDEX_64 */
+
+#define OCTREE_POS_MASK ((1u << OCTREE_POS_BITS) - 1)
+
+
+/* Bits of an index holding the x, y and z coordinate */
+#if defined(OCTREE_INDEX_64)
+#define OCTREE_MORTON_X 0x1249249249249249ull
+#define OCTREE_MORTON_Y 0x2492492492492492ull
+#define OCTREE_MORTON_Z 0x4924924924924924ull
+#else
+#define OCTREE_MORTON_X 0x09249249u
+#define OCTREE_MORTON_Y 0x12492492u
+#define OCTREE_MORTON_Z 0x24924924u
+#endif /* OCTREE_INDEX_64 */
+
+
 #define LEAVES_INIT(leaf) {leaf, leaf, leaf, leaf, leaf, leaf, leaf, leaf}
 
 #define LEAVES(leaf) ((leaf_t [8]) LEAVES_INIT(leaf))
 
 
+/* Version written by octree_save_compact, octree_load_compact also reads
+ * version 1 */
+#define OCTREE_COMPACT_VERSION 2
+
+/* octree_save_compact flags */
+#define OCTREE_COMPACT_DEFLATE 0x1
+
+
+/* Version written by octree_save_dag */
+#define OCTREE_DAG_VERSION 1
+
+
+/* Version written by octree_diff_save */
+#define OCTREE_DIFF_VERSION 1
+
+
+/* Version written by octree_save_indexed */
+#define OCTREE_INDEXED_VERSION 1
+
+/* Deepest level, below the saved node, octree_save_indexed can split at */
+#define OCTREE_INDEXED_MAX_SPLIT 2
+
+
+/* Bytes buffered by the streaming save/load functions */
+#ifndef OCTREE_STREAM_BUFFER
+#define OCTREE_STREAM_BUFFER 4096
+#endif /* OCTREE_STREAM_BUFFER */
+
+
+/* Each slab chunk holds 1 << OCTREE_POOL_SHIFT blocks */
+#ifndef OCTREE_POOL_SHIFT
+#define OCTREE_POOL_SHIFT 10
+#endif /* OCTREE_POOL_SHIFT */
+
+#define OCTREE_POOL_CHUNK (1u << OCTREE_POOL_SHIFT)
+
+#define OCTREE_POOL_MASK (OCTREE_POOL_CHUNK - 1)
+
+
+/* Blocks freed while readers may still see them are reclaimed each time
+ * this many are waiting */
+#ifndef OCTREE_RECLAIM_BATCH
+#define OCTREE_RECLAIM_BATCH 1024
+#endif /* OCTREE_RECLAIM_BATCH */
+
+
+/* Leaf values octree_stats keeps a dom_leaf count for, the others are
+ * counted together */
+#ifndef OCTREE_STATS_LEAVES
+#define OCTREE_STATS_LEAVES 256
+#endif /* OCTREE_STATS_LEAVES */
+
+
+/* Chunks octree_world_raycast crosses at most, whatever max_dist is */
+#ifndef OCTREE_WORLD_RAY_CHUNKS
+#define OCTREE_WORLD_RAY_CHUNKS 1024
+#endif /* OCTREE_WORLD_RAY_CHUNKS */
+
+
+/* With OCTREE_COUNTERS the pool counts the blocks in use as they're
+ * allocated and freed, see octree_stats_totals */
+
+
+#if defined(OCTREE_CONCURRENT)
+#define OCTREE_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+#define OCTREE_ACQUIRE(p) (*(p))
+#endif /* OCTREE_CONCURRENT */
+
+
 typedef OCTREE_LEAF_TYPE leaf_t;
 
 
+#if defined(OCTREE_INDEX_64)
+typedef uint64_t octree_index_t;
+#else
+typedef uint32_t octree_index_t;
+#endif /* OCTREE_INDEX_64 */
+
+
+/* childreen and leaves are block ids into the octree's node_pool_t, 0 meaning
+ * no block. The 8 childreen of a node are stored next to each other. */
 typedef struct node_s
 {
     union
     {
-        struct node_s **childreen;
-        leaf_t *leaves;
+        uint32_t childreen;
+        uint32_t leaves;
     };
     bool is_full        : 1;
     bool is_original    : 1;
-    uint8_t level       : 4;
+    uint8_t level       : 5;
     leaf_t dom_leaf;
 } node_t;
 
 
+#if defined(OCTREE_CONCURRENT)
+/* Readers load whole nodes with one atomic access */
+typedef char octree_node_t_must_be_8_bytes[(sizeof(node_t) == 8) ? 1 : -1];
+#endif /* OCTREE_CONCURRENT */
+
+
+/* Fixed size block allocator. Blocks are bump allocated from chunks of
+ * OCTREE_POOL_CHUNK blocks and recycled through an intrusive free list.
+ * Chunks never move, so pointers to blocks stay valid while the pool grows.
+ * Block id 0 is never handed out. refs is only allocated once the pool is
+ * shared and holds, for each block, the number of references beyond the
+ * first. */
+typedef struct
+{
+    char **chunks;
+    uint32_t **refs;
+    uint32_t n_chunks;
+    uint32_t cap_chunks;
+    uint32_t top;
+    uint32_t used;
+    uint32_t free_list;
+    uint32_t block_size;
+#if defined(OCTREE_CONCURRENT)
+    /* Chunk table replaced by the last allocation, readers may still
+     * hold it */
+    char **old_chunks;
+#endif /* OCTREE_CONCURRENT */
+#if defined(OCTREE_COUNTERS)
+    /* Blocks allocated and not released */
+    uint32_t live;
+#endif /* OCTREE_COUNTERS */
+} slab_t;
+
+
+#if defined(OCTREE_CONCURRENT)
+/* A block, or chunk table, waiting for the readers that could see it */
+typedef struct
+{
+    uint64_t epoch;
+    char **table;
+    uint32_t id;
+    uint8_t kind;
+} pool_retired_t;
+#endif /* OCTREE_CONCURRENT */
+
+
+/* Once shared is set blocks may be referenced by several nodes and are
+ * copied before being written to, see pool_share */
+typedef struct
+{
+    slab_t childreen;
+    slab_t leaves;
+    bool shared;
+    /* Octrees using the pool, the original and its snapshots */
+    uint32_t users;
+    /* Bumped each time a block is freed or stops being used by a node,
+     * paths cached in cursors are stale once it changed */
+    uint32_t generation;
+#if defined(OCTREE_CONCURRENT)
+    uint64_t epoch;
+    struct octree_reader_s *readers;
+    pool_retired_t *retired;
+    size_t n_retired;
+    size_t cap_retired;
+#endif /* OCTREE_CONCURRENT */
+} node_pool_t;
+
+
+#if defined(OCTREE_CONCURRENT)
+/* One per reader thread. epoch is the pool epoch the reader entered at, 0
+ * while it's outside, and sits on a cache line of its own so readers don't
+ * slow each other down */
+typedef struct octree_reader_s
+{
+    node_pool_t *pool;
+    struct octree_reader_s *next;
+    int in_use;
+    char pad_before[64];
+    uint64_t epoch;
+    char pad_after[64];
+} octree_reader_t;
+#endif /* OCTREE_CONCURRENT */
+
+
 typedef struct
 {
     node_t *root;
+    node_pool_t *pool;
     uint8_t depth;
 } octree_t;
 
 
-typedef struct {
-    bool is_full        : 1;
-    bool is_original    : 1;
-    uint8_t level       : 4;
-    leaf_t dom_leaf;
-} simple_node_t;
+typedef struct {
+    bool is_full        : 1;
+    bool is_original    : 1;
+    uint8_t level       : 5;
+    leaf_t dom_leaf;
+} simple_node_t;
+
+
+/* A subtree being freed a few blocks at a time. Holds the childreen blocks
+ * on the path to the next block to free */
+typedef struct
+{
+    node_pool_t *pool;
+    uint32_t childreen[OCTREE_MAX_DEPTH];
+    uint8_t next[OCTREE_MAX_DEPTH];
+    uint8_t top;
+    uint8_t oc_depth;
+} node_free_t;
+
+
+/* A cube of leaves covered by one node. span is a power of 8 and start a
+ * multiple of span. level is the node's level, oc_depth for single leaves */
+typedef struct
+{
+    octree_index_t start;
+    octree_index_t span;
+    leaf_t leaf;
+    uint8_t level;
+} octree_run_t;
+
+
+/* Walks the leaves of a node in index order one run at a time */
+typedef struct
+{
+    const node_pool_t *pool;
+    node_t *path[OCTREE_MAX_DEPTH];
+    octree_index_t index;
+    octree_index_t end;
+    octree_index_t prev;
+    uint8_t oc_depth;
+    uint8_t max_level;
+    uint8_t top;
+} node_iter_t;
+
+
+/* Path to the last leaf looked up through the cursor. path[k] is at level
+ * base + k. It's walked again only below the common ancestor of the
+ * previous and the next index, and from the top once the pool's generation
+ * changed */
+typedef struct
+{
+    node_pool_t *pool;
+    node_t *path[OCTREE_MAX_DEPTH];
+    octree_index_t prev;
+    uint32_t generation;
+    uint8_t oc_depth;
+    uint8_t base;
+    uint8_t top;
+} octree_cursor_t;
+
+
+/* A chunk of an octree_world_t. Resident chunks are in the LRU list, the
+ * others are waiting for the I/O thread to load or save them */
+typedef struct octree_chunk_s
+{
+    struct octree_chunk_s *hash_next;
+    struct octree_chunk_s *lru_prev;
+    struct octree_chunk_s *lru_next;
+    struct octree_chunk_s *task_next;
+    octree_t *octree;
+    size_t bytes;
+    int pos[3];
+    uint8_t state;
+    bool busy;
+    bool dirty;
+    bool failed;
+} octree_chunk_t;
+
+
+/* An unbounded world tiled into octrees of depth depth, kept as files in
+ * dir. The chunks in memory are found through a hash table on their
+ * position, the least recently used ones are saved and freed once they
+ * take more than budget bytes */
+typedef struct
+{
+    char *dir;
+    size_t budget;
+    size_t resident;
+    octree_chunk_t **buckets;
+    uint32_t mask;
+    uint32_t count;
+    octree_chunk_t *lru_head;
+    octree_chunk_t *lru_tail;
+    /* Chunks waiting for the I/O thread, loads first */
+    octree_chunk_t *tasks;
+    /* Most recently used chunk, found without locking */
+    octree_chunk_t *last;
+    /* Loads and saves queued or running */
+    uint32_t pending;
+    /* Set once an evicted chunk couldn't be saved */
+    bool error;
+    uint8_t depth;
+#if defined(OCTREE_THREADS)
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* Signals new tasks to the I/O thread */
+    pthread_cond_t wake;
+    /* Signals finished tasks to the thread waiting for a chunk */
+    pthread_cond_t done;
+    bool stop;
+#endif /* OCTREE_THREADS */
+} octree_world_t;
+
+
+/* Return non-zero to stop visiting. run is relative to the chunk at
+ * chunk[0] << depth, chunk[1] << depth, chunk[2] << depth */
+typedef int (*octree_world_fn)(
+        const int chunk[3], const octree_run_t *run, void *data);
+
+
+/* Byte stream used by the streaming save/load functions. write and read
+ * return the number of bytes transfered, anything short of size is treated
+ * as an error(or the end of the stream). Loading reads ahead, unread gives
+ * those bytes back once the octree is complete and may be NULL */
+typedef struct
+{
+    size_t (*write)(void *user, const void *data, size_t size);
+    size_t (*read)(void *user, void *data, size_t size);
+    int (*unread)(void *user, size_t size);
+    void *user;
+} octree_stream_t;
+
+
+/* Return non-zero to stop visiting */
+typedef int (*octree_visit_fn)(const octree_run_t *run, void *data);
+
+
+/* Return true for the leaves a ray or a query is looking for. Called once
+ * per node, a full node is a single leaf however big it is. Where NULL is
+ * passed instead any non-zero leaf matches */
+typedef bool (*octree_leaf_fn)(leaf_t leaf, void *data);
+
+
+/* Leaf a ray stopped at. distance is the ray parameter where it enters the
+ * leaf, a real distance when dir has a length of 1, and is negative for
+ * rays that hit nothing. normal is the face it entered by, all 0 if the ray
+ * started inside it */
+typedef struct
+{
+    octree_index_t index;
+    int pos[3];
+    int normal[3];
+    float distance;
+    leaf_t leaf;
+} octree_hit_t;
+
+
+/* Face of a mesh, the rectangle [min, max) of the plane where
+ * min[face >> 1] == max[face >> 1]. face is the way it faces in the order
+ * -x, +x, -y, +y, -z, +z, leaf the leaf it is the face of */
+typedef struct
+{
+    int min[3];
+    int max[3];
+    leaf_t leaf;
+    uint8_t face;
+} octree_quad_t;
+
+
+/* Buffers a mesh is extracted into. Start zeroed, they only grow and are
+ * kept from one extraction to the next. Only quads is the mesh, the rest
+ * is scratch space */
+typedef struct
+{
+    octree_quad_t *quads;
+    size_t n_quads;
+    size_t max_quads;
+    octree_quad_t *faces;
+    size_t n_faces;
+    size_t max_faces;
+    void *spans;
+    size_t max_spans;
+    void *sort;
+    size_t max_sort;
+} octree_mesh_t;
+
+
+/* Filled by octree_stats. Blocks shared through octree_dedup or
+ * octree_snapshot are counted once for each node using them, except in
+ * bytes, which is the whole pool */
+typedef struct
+{
+    /* Nodes at each level, the root being at level 0 */
+    uint64_t nodes[OCTREE_MAX_DEPTH];
+    uint64_t full[OCTREE_MAX_DEPTH];
+    uint64_t split[OCTREE_MAX_DEPTH];
+    uint64_t n_nodes;
+    uint64_t n_full;
+    uint64_t n_split;
+    /* Blocks of 8 childreen and of 8 leaves, the leaves being those of the
+     * split nodes of the last level */
+    uint64_t childreen_blocks;
+    uint64_t leaf_blocks;
+    /* Bytes taken from malloc by the octree, including an estimate of
+     * malloc's own overhead */
+    size_t bytes;
+    /* What octree_save_buffer would write */
+    size_t save_size;
+    /* Nodes by dom_leaf, dom_leaves_other counting the leaves past
+     * OCTREE_STATS_LEAVES */
+    uint64_t dom_leaves[OCTREE_STATS_LEAVES];
+    uint64_t dom_leaves_other;
+} octree_stats_t;
+
+
+OCTREE_DEF
+node_pool_t *pool_construct(void);
+
+
+/* Release every chunk owned by the pool and the pool itself */
+OCTREE_DEF
+void pool_free(node_pool_t *pool);
+
+
+/* Forget every block handed out so far without touching the chunks, which
+ * are reused by later allocations. No reader may be using the pool */
+OCTREE_DEF
+void pool_reset(node_pool_t *pool);
+
+
+/* Returns the id of a block of 8 nodes or 0 on failure */
+OCTREE_DEF
+uint32_t pool_alloc_childreen(node_pool_t *pool);
+
+
+/* Drops one reference to the block, the block is only given back to the
+ * pool once it was the last one. Blocks below it are left alone */
+OCTREE_DEF
+void pool_free_childreen(node_pool_t *pool, uint32_t childreen);
+
+
+/* Returns the id of a block of 8 leaves or 0 on failure */
+OCTREE_DEF
+uint32_t pool_alloc_leaves(node_pool_t *pool);
+
+
+OCTREE_DEF
+void pool_free_leaves(node_pool_t *pool, uint32_t leaves);
+
+
+/* Start counting references so blocks can be shared between nodes. Can't
+ * be undone. Returns 0 if the reference counts couldn't be allocated */
+OCTREE_DEF
+int pool_share(node_pool_t *pool);
+
+
+/* Add a reference to a block, the pool must be shared */
+OCTREE_DEF
+void pool_retain_childreen(node_pool_t *pool, uint32_t childreen);
+
+
+OCTREE_DEF
+void pool_retain_leaves(node_pool_t *pool, uint32_t leaves);
+
+
+/* Number of references to a block beyond the first, 0 if not shared */
+OCTREE_DEF
+uint32_t pool_childreen_refs(const node_pool_t *pool, uint32_t childreen);
+
+
+OCTREE_DEF
+uint32_t pool_leaves_refs(const node_pool_t *pool, uint32_t leaves);
+
+
+#if defined(OCTREE_CONCURRENT)
+/* Register the calling thread as a reader. Readers only look the pool up
+ * between octree_read_lock and octree_read_unlock, where blocks freed by
+ * the writer stay valid. Returns NULL if out of memory */
+OCTREE_DEF
+octree_reader_t *pool_reader_join(node_pool_t *pool);
+
+
+OCTREE_DEF
+void pool_reader_leave(octree_reader_t *reader);
+
+
+/* Give back the freed blocks no reader can see anymore, returns how many.
+ * Runs by itself every OCTREE_RECLAIM_BATCH frees. Writer only */
+OCTREE_DEF
+size_t pool_reclaim(node_pool_t *pool);
+
+
+/* Wait until every reader inside the pool has left, then reclaim.
+ * Writer only */
+OCTREE_DEF
+void pool_synchronize(node_pool_t *pool);
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_DEF
+node_t *node_construct(void);
+
+
+OCTREE_DEF
+int node_init_childreen(node_pool_t *pool, node_t *node);
+
+
+/* Get nodes or create them if they don't exist */
+OCTREE_DEF
+node_t *node_get_or_create(
+        node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth);
+
+
+/* Recrusively free the last level. node_r_free no longer needs one call
+ * per level, this is only kept for existing callers */
+OCTREE_DEF
+void node_r_free_last(
+        node_pool_t *pool, node_t *node, uint8_t last_level, uint8_t depth);
+
+
+/* Free every block below node in one pass, then node itself */
+OCTREE_DEF
+void node_r_free(node_pool_t *pool, node_t *node, uint8_t depth);
+
+
+/* Start freeing the blocks below a copy of node, node itself isn't changed
+ * and must not be used to reach them anymore */
+OCTREE_DEF
+void node_free_init(
+        node_free_t *it, node_pool_t *pool, const node_t *node,
+        uint8_t oc_depth);
+
+
+/* Free up to budget blocks. Returns 1 once the whole subtree is freed */
+OCTREE_DEF
+int node_free_step(node_free_t *it, size_t budget);
+
+
+/* Free the chunks of the pool about budget blocks at a time, at least one
+ * chunk per call. Returns 1 once the pool itself is freed, the pool can't be
+ * used after the first call */
+OCTREE_DEF
+int pool_free_step(node_pool_t *pool, size_t budget);
+
+
+/* Give every block below node back to the pool and make node full of leaf */
+OCTREE_DEF
+void node_clear(node_pool_t *pool, node_t *node, uint8_t oc_depth, leaf_t leaf);
+
+
+/* Copy node's childreen(or leaves) if the block is shared so node can write
+ * to it. Returns 0 if the copy couldn't be allocated */
+OCTREE_DEF
+int node_unshare(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* node_unshare every node on the path to index, down to the first full node */
+OCTREE_DEF
+int node_unshare_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth);
+
+
+/* Make identical subtrees below node share the same blocks. Shares the pool
+ * if it wasn't already. Returns the number of blocks replaced by a shared
+ * one or -1 if memory ran out, in which case node is left valid but only
+ * partially deduplicated */
+OCTREE_DEF
+int64_t node_dedup(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* Set every leaf inside [min, max) to leaf. origin is the position of node's
+ * first leaf. Nodes fully inside the box become full without descending
+ * into them, so only nodes crossing the box's faces get split. Returns 0 if
+ * a block couldn't be allocated */
+OCTREE_DEF
+int node_fill_box(
+        node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth, leaf_t leaf);
+
+
+/* Collapse every node below `node` whose 8 childreen(or leaves) are the same
+ * full leaf. Returns the number of blocks given back to the pool */
+OCTREE_DEF
+int node_optimize(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+/* Collapse the nodes on the path to index bottom up, stopping at the first
+ * node that can't be collapsed */
+OCTREE_DEF
+int node_optimize_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth);
+
+
+/* Look up n leaves. The path of the previous index is kept so only the part
+ * below the common ancestor of two successive indices is walked again, and
+ * indices falling in the same full node are resolved without descending.
+ * Works with any order, sorting indices first gives the most reuse */
+OCTREE_DEF
+void leaf_get_many(
+        const node_pool_t *pool, node_t *node,
+        const octree_index_t *indices, leaf_t *out, size_t n, uint8_t oc_depth);
+
+
+/* The 6 leaves sharing a face with the leaf at index, in the order -x, +x,
+ * -y, +y, -z, +z. Those past the octree's border are set to border. The
+ * indices are found with octree_index_add and looked up with leaf_get_many,
+ * so each one is resolved from its common ancestor with the previous one */
+OCTREE_DEF
+void leaf_get_neighbors(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[6]);
+
+
+/* The 3x3x3 block of leaves centered on index,
+ * out[(z + 1) * 9 + (y + 1) * 3 + x + 1] being the leaf at offset x, y, z
+ * from it. Same as leaf_get_neighbors otherwise */
+OCTREE_DEF
+void leaf_get_neighborhood(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[27]);
+
+
+/* Iterate the runs of node's subtree, with indices relative to node. Nodes
+ * at max_level aren't descended into and come out as one run of their
+ * dom_leaf; pass oc_depth to get every leaf */
+OCTREE_DEF
+void node_iter_init(
+        node_iter_t *it, const node_pool_t *pool, node_t *node,
+        uint8_t oc_depth, uint8_t max_level);
+
+
+/* Returns false once every run has been returned */
+OCTREE_DEF
+bool node_iter_next(node_iter_t *it, octree_run_t *run);
+
+
+/* Call fn for every run in index order. Returns the first non-zero value
+ * returned by fn or 0 */
+OCTREE_DEF
+int node_visit(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        uint8_t max_level, octree_visit_fn fn, void *data);
+
+
+/* Cast a ray through node, whose leaves cover [0, 2^(oc_depth - level)) on
+ * each axis. The ray stops at the first leaf matched by fn that it enters
+ * before max_dist. Full nodes
+ * are crossed in one step whatever their size. Returns 1 and fills hit if
+ * something was hit, 0 otherwise */
+OCTREE_DEF
+int node_raycast(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origin[3], const float dir[3], float max_dist,
+        octree_leaf_fn fn, void *data, octree_hit_t *hit);
+
+
+/* Cast n rays, filling hits[i] for ray i. The path walked down to the
+ * previous ray's first node is reused, so rays starting close to each
+ * other(a packet) mostly skip the top of the tree. Returns the number of
+ * rays that hit something */
+OCTREE_DEF
+size_t node_raycast_n(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origins[][3], const float dirs[][3], size_t n,
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hits);
+
+
+/* Call fn, in index order, for the runs of node's subtree overlapping the
+ * box [min, max) and matched by match. origin is the position of node's
+ * first leaf. Full nodes come out as one run without being descended into,
+ * even those only partly inside the box, so only nodes crossing its faces
+ * are walked. Returns the first non-zero value returned by fn or 0 */
+OCTREE_DEF
+int node_query_box(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data);
+
+
+/* Same as node_query_box for the convex region where
+ * p[0] * x + p[1] * y + p[2] * z + p[3] >= 0 for each of the n planes p,
+ * at most 32. A frustum is its 6 planes, in leaf units. Leaves crossing a
+ * plane are reported */
+OCTREE_DEF
+int node_query_planes(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const float planes[][4], int n, uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data);
+
+
+/* Extract the surface of the leaves matched by match into mesh->quads,
+ * replacing what was there. A face is made wherever a matched leaf touches
+ * a different leaf or the outside of the node, and coplanar faces of the
+ * same leaf are merged into bigger rectangles. Full nodes only have their
+ * sides looked at, however big they are. Returns 0 if memory ran out */
+OCTREE_DEF
+int node_mesh(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_leaf_fn match, void *data, octree_mesh_t *mesh);
+
+
+OCTREE_DEF
+void octree_mesh_free(octree_mesh_t *mesh);
+
+
+/* Add the nodes of node's subtree to stats, everything but bytes */
+OCTREE_DEF
+void node_stats(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stats_t *stats);
+
+
+/* Exact number of bytes node_save_buffer writes for node */
+OCTREE_DEF
+size_t node_save_size(node_pool_t *pool, node_t *node, uint8_t oc_depth);
+
+
+OCTREE_DEF
+int node_save_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, char *buff);
+
+
+/* Same as node_save_buffer but never writes more than size bytes. Returns -1
+ * if the buffer is too small */
+OCTREE_DEF
+int node_save_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+OCTREE_DEF
+int node_load_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, const char *buff);
+
+
+/* Same as node_load_buffer but never reads more than size bytes. Returns -1
+ * and leaves node empty if the data is truncated or malformed */
+OCTREE_DEF
+int node_load_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+OCTREE_DEF
+octree_t *octree_construct(uint8_t depth);
+
+
+/* Free the octree. The pool goes with it unless snapshots still use it,
+ * then only the references to its blocks are dropped */
+OCTREE_DEF
+void octree_r_free(octree_t *octree);
+
+
+/* octree_snapshot
+ * params:
+ *      * octree - octree to take a snapshot of.
+ * description:
+ *      * A new octree holding what octree holds now. Both share every block
+ *      and the pool, which is switched to DAG mode like octree_dedup does,
+ *      so a write to either copies only the path it changes. Taking it
+ *      costs the same whatever the size of the octree, once the pool is
+ *      shared. Octrees sharing a pool must be written from one thread at a
+ *      time. Returns NULL if out of memory.
+ */
+OCTREE_DEF
+octree_t *octree_snapshot(octree_t *octree);
+
+
+/* octree_free_step
+ * params:
+ *      * octree - octree to free.
+ *      * budget - about how many blocks to free in this call.
+ * description:
+ *      * Free the octree over several calls, so a big one doesn't stall
+ *      the caller. Returns 1 once it's completely freed, 0 if more calls
+ *      are needed. The octree can't be used once this was called. An
+ *      octree whose pool is used by snapshots is freed in one call.
+ */
+OCTREE_DEF
+int octree_free_step(octree_t *octree, size_t budget);
+
+
+/* Drop every node of the octree at once, leaving an empty(full of 0) root.
+ * With OCTREE_CONCURRENT the blocks are freed one by one instead so
+ * readers can stay */
+OCTREE_DEF
+void octree_clear(octree_t *octree);
+
+
+OCTREE_DEF
+int octree_optimize(octree_t *octree);
+
+
+#if defined(OCTREE_CONCURRENT)
+/* octree_reader_join
+ * params:
+ *      * octree - octree to read.
+ * description:
+ *      * Register the calling thread as a reader, see pool_reader_join. The
+ *      lookup and traversal functions(leaf_get, leaf_get_many, iterators,
+ *      node_get*) may then run between octree_read_lock and
+ *      octree_read_unlock while one writer thread calls leaf_set,
+ *      fill_box, optimize, clear or dedup. Readers see each node change
+ *      whole but may see part of a multi-node change. Loading and saving
+ *      still need the writer to be the only thread in the octree.
+ */
+OCTREE_DEF
+octree_reader_t *octree_reader_join(octree_t *octree);
+
+
+OCTREE_DEF
+size_t octree_reclaim(octree_t *octree);
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_DEF
+octree_stream_t octree_stream_file(FILE *file);
+
+
+#if defined(OCTREE_POSIX)
+/* The fd is stored in the user pointer, no memory is allocated */
+OCTREE_DEF
+octree_stream_t octree_stream_fd(int fd);
+#endif /* OCTREE_POSIX */
+
+
+/* Write node in the node_save_buffer format through a buffer of
+ * OCTREE_STREAM_BUFFER bytes. Returns the bytes written or -1 */
+OCTREE_DEF
+int64_t node_save_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream);
+
+
+/* Returns the bytes belonging to the octree or -1 leaving node empty */
+OCTREE_DEF
+int64_t node_load_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream);
+
+
+/* Compact format:
+ *      "OCTC", version, flags, levels, sizeof(leaf_t), varint palette size,
+ *      varint leaves, varint payload size, [varint deflated size], payload
+ * The payload holds one bit per node in pre-order(1 if full) followed by
+ * the palette index of every node's dom_leaf and every last level leaf in
+ * the same order, stored as varint headed runs that either repeat one index
+ * or bit-pack literal indices. is_original isn't stored, loaded nodes are
+ * original. Version 1 has no leaf size and no dom_leaf for split nodes.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, int flags);
+
+
+/* Returns the bytes read or -1 leaving node empty, also when the leaves
+ * saved are wider than leaf_t */
+OCTREE_DEF
+int64_t node_load_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* DAG format:
+ *      "OCTD", version, levels
+ *      varint leaf blocks, 8 varint leaves per block
+ *      varint node blocks, per block its level then 8 nodes
+ *      root node
+ * A node is a varint that is 0 when full or 1 + the index of its block,
+ * followed by the varint dom_leaf. Blocks come after every block they
+ * reference and each shared block is stored once.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+/* Load a DAG keeping the blocks shared, this shares the pool. Returns the
+ * bytes read or -1 leaving node empty */
+OCTREE_DEF
+int64_t node_load_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* Indexed format:
+ *      "OCTI", version, levels, split
+ *      the nodes above split in pre-order, as node_save_buffer records
+ *      per subtree at split, varint childreen blocks and varint leaf blocks
+ *      every subtree at split in the node_save_buffer format
+ * The block counts give the offset of each subtree, so they are written and
+ * read on up to threads threads, 0 for one per core.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small */
+OCTREE_DEF
+int64_t node_save_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, uint8_t split, int threads);
+
+
+/* Returns the bytes read or -1 leaving node empty. The blocks come from
+ * unused chunks rather than the pool's free blocks */
+OCTREE_DEF
+int64_t node_load_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size, int threads);
+
+
+/* Diff format:
+ *      "OCTP", version, levels
+ *      the op of the root node
+ * An op is 0 when nothing changed, only allowed for the root, 1 followed by
+ * the new subtree in the node_save_buffer format, or 2 followed by the node's
+ * node_save_buffer record, a byte with a bit set per changed child and the op
+ * of each changed child in order. Identical subtrees aren't descended into
+ * when from and to share their blocks.
+ *
+ * Returns the bytes written, or needed when buff is NULL, and -1 if size is
+ * too small or the nodes aren't at the same level */
+OCTREE_DEF
+int64_t node_diff_save(
+        node_pool_t *from_pool, const node_t *from,
+        node_pool_t *to_pool, node_t *to, uint8_t oc_depth,
+        char *buff, size_t size);
+
+
+/* Apply a diff to node, which must hold what from held. Returns the bytes
+ * read or -1, leaving node valid but only partially patched */
+OCTREE_DEF
+int64_t node_diff_apply(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size);
+
+
+/* octree_load_buffer
+ * params:
+ *      * octree - octree to write to.
+ *      * buff - buffer containing the raw octree data.
+ * description:
+ *      * Attempt to load raw data into octree. On failure -1  is returned and
+ *      the octree is left empty. Otherwise the bits read is returned
+ */
+OCTREE_DEF
+int octree_load_buffer(octree_t *octree, const char *buff);
+
+
+OCTREE_DEF
+int octree_save_buffer(octree_t *octree, char *buff);
+
+
+/* Number of bytes octree_save_buffer will write */
+OCTREE_DEF
+size_t octree_save_size(octree_t *octree);
+
+
+/* Walk the octree to fill stats, in time proportional to its nodes */
+OCTREE_DEF
+void octree_stats(octree_t *octree, octree_stats_t *stats);
+
+
+#if defined(OCTREE_COUNTERS)
+/* The totals of stats in constant time, from the pool's counters: n_nodes,
+ * n_full, n_split, the block counts and bytes. The counters cover the whole
+ * pool and count shared blocks once, so this matches octree_stats until
+ * octree_dedup is used. After octree_snapshot they cover every octree
+ * sharing the pool. The rest is set to 0 */
+OCTREE_DEF
+void octree_stats_totals(const octree_t *octree, octree_stats_t *stats);
+#endif /* OCTREE_COUNTERS */
+
+
+/* octree_load_buffer_n
+ * params:
+ *      * octree - octree to write to.
+ *      * buff - buffer containing the raw octree data.
+ *      * size - number of bytes available in buff.
+ * description:
+ *      * Same as octree_load_buffer but fails with -1 instead of reading past
+ *      size bytes, leaving the octree empty.
+ */
+OCTREE_DEF
+int octree_load_buffer_n(octree_t *octree, const char *buff, size_t size);
+
+
+/* Returns -1 without writing past size bytes if buff is too small */
+OCTREE_DEF
+int octree_save_buffer_n(octree_t *octree, char *buff, size_t size);
+
+
+/* octree_save_stream
+ * params:
+ *      * octree - octree to save.
+ *      * stream - where to write, see octree_stream_file and octree_stream_fd.
+ * description:
+ *      * Writes the same bytes as octree_save_buffer using a fixed buffer of
+ *      OCTREE_STREAM_BUFFER bytes. Returns the bytes written or -1.
+ */
+OCTREE_DEF
+int64_t octree_save_stream(octree_t *octree, octree_stream_t *stream);
+
+
+OCTREE_DEF
+int64_t octree_load_stream(octree_t *octree, octree_stream_t *stream);
+
+
+/* octree_save_compact
+ * params:
+ *      * octree - octree to save.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ *      * flags - OCTREE_COMPACT_DEFLATE to deflate the payload. Ignored
+ *      unless the library is built with OCTREE_ZLIB.
+ * description:
+ *      * Save the octree in the versioned compact format. Returns the number
+ *      of bytes written or -1 if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_save_compact(
+        octree_t *octree, char *buff, size_t size, int flags);
+
+
+OCTREE_DEF
+int64_t octree_load_compact(octree_t *octree, const char *buff, size_t size);
+
+
+/* octree_dedup
+ * params:
+ *      * octree - octree to deduplicate.
+ * description:
+ *      * Switch the octree to DAG mode, where identical subtrees share their
+ *      blocks, and merge every identical subtree. Writes copy the shared
+ *      blocks they touch so the other copies aren't affected, call this
+ *      again after heavy edits. Returns the number of blocks replaced by a
+ *      shared one or -1 if memory ran out.
+ */
+OCTREE_DEF
+int64_t octree_dedup(octree_t *octree);
+
+
+/* Same as octree_save_compact with the DAG format, without flags */
+OCTREE_DEF
+int64_t octree_save_dag(octree_t *octree, char *buff, size_t size);
+
+
+OCTREE_DEF
+int64_t octree_load_dag(octree_t *octree, const char *buff, size_t size);
+
+
+/* octree_save_indexed
+ * params:
+ *      * octree - octree to save.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ *      * split - level of the subtrees saved in parallel, 1 for the 8
+ *      childreen of the root and 2 for the 64 below them.
+ *      * threads - threads to use, 0 for one per core. Only the calling
+ *      thread without OCTREE_THREADS.
+ * description:
+ *      * Save the octree in the indexed format, which octree_load_indexed
+ *      loads on several threads. Returns the number of bytes written or -1
+ *      if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_save_indexed(
+        octree_t *octree, char *buff, size_t size, uint8_t split, int threads);
+
+
+OCTREE_DEF
+int64_t octree_load_indexed(
+        octree_t *octree, const char *buff, size_t size, int threads);
+
+
+/* octree_diff_save
+ * params:
+ *      * old - octree as the receiver has it, usually a snapshot of new.
+ *      * new - octree as it is now, of the same depth as old.
+ *      * buff - buffer to write to, NULL to only get the size.
+ *      * size - bytes available in buff.
+ * description:
+ *      * Save what changed from old to new, octree_diff_apply turns a copy
+ *      of old into new. Subtrees whose blocks old and new share are skipped
+ *      without being read, so taking a snapshot after each diff keeps the
+ *      next one proportional to the edits. Returns the number of bytes
+ *      written or -1 if they don't fit in size.
+ */
+OCTREE_DEF
+int64_t octree_diff_save(
+        octree_t *old, octree_t *new, char *buff, size_t size);
+
+
+OCTREE_DEF
+int64_t octree_diff_apply(octree_t *octree, const char *buff, size_t size);
+
+
+/* octree_world_construct
+ * params:
+ *      * dir - existing directory holding one file per saved chunk.
+ *      * depth - depth of the octree of each chunk.
+ *      * budget - bytes the chunks in memory may take before the least
+ *      recently used ones are evicted.
+ * description:
+ *      * Open a paged world. Chunks are loaded the first time they're
+ *      used, empty if they have no file yet. With OCTREE_THREADS the
+ *      loading and saving is done on a thread of the world's own. The
+ *      world itself must be used from one thread at a time.
+ */
+OCTREE_DEF
+octree_world_t *octree_world_construct(
+        const char *dir, uint8_t depth, size_t budget);
+
+
+/* Save the modified chunks and free the world. Returns 0 if a chunk
+ * couldn't be saved */
+OCTREE_DEF
+int octree_world_free(octree_world_t *world);
+
+
+/* octree_world_chunk
+ * params:
+ *      * world - world to look in.
+ *      * chunk - position of the chunk, in chunks.
+ *      * write - true if the octree is going to be modified.
+ * description:
+ *      * The chunk's octree, loaded if it wasn't in memory, or NULL if its
+ *      file couldn't be read. Other chunks may be evicted, the octree
+ *      stays valid until the next call that can load a chunk.
+ */
+OCTREE_DEF
+octree_t *octree_world_chunk(
+        octree_world_t *world, const int chunk[3], bool write);
+
+
+/* Start loading the chunk in the background. Does nothing without
+ * OCTREE_THREADS */
+OCTREE_DEF
+void octree_world_prefetch(octree_world_t *world, const int chunk[3]);
+
+
+/* Save the modified chunks without evicting them. Returns 0 if a chunk
+ * couldn't be saved */
+OCTREE_DEF
+int octree_world_flush(octree_world_t *world);
+
+
+/* The leaf at pos, in leaves from the world's origin. 0 if its chunk
+ * couldn't be loaded */
+OCTREE_DEF
+leaf_t octree_world_leaf_get(octree_world_t *world, const int pos[3]);
+
+
+OCTREE_DEF
+int octree_world_leaf_set(octree_world_t *world, const int pos[3], leaf_t leaf);
+
+
+/* octree_fill_box over every chunk the box overlaps */
+OCTREE_DEF
+int octree_world_fill_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        leaf_t leaf);
+
+
+/* node_query_box over every chunk the box overlaps, chunk by chunk */
+OCTREE_DEF
+int octree_world_query_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        octree_leaf_fn match, octree_world_fn fn, void *data);
+
+
+/* octree_raycast through the chunks the ray crosses, up to max_dist and
+ * OCTREE_WORLD_RAY_CHUNKS chunks. hit->pos is in the world, hit->index in the
+ * chunk holding it. Chunks that aren't in memory and have no file are empty,
+ * they're crossed without being loaded */
+OCTREE_DEF
+int octree_world_raycast(
+        octree_world_t *world, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn match, void *data, octree_hit_t *hit);
+
+
+/* Convert n positions to indices. Uses SSE2 when available */
+OCTREE_DEF
+void octree_pos_to_index_n(
+        int pos[][3], octree_index_t *index, size_t n, uint8_t oc_depth);
+
+
+OCTREE_DEF
+void octree_index_to_pos_n(
+        const octree_index_t *index, int pos[][3], size_t n, uint8_t oc_depth);
+
+
+/* TODO: rename this function to something better */
+OCTREE_INLINE
+octree_index_t _octree_i3d_to_uint(octree_index_t x)
+{
+    return ((x) & 0x1) |
+           (((x) & 0x2) << (OCTREE_POS_BITS - 1)) |
+           (((x) & 0x4) << (OCTREE_POS_BITS * 2 - 2));
+}
+
+
+/* TODO: rename this function to something better */
+OCTREE_INLINE
+octree_index_t _octree_uint_to_i3d(octree_index_t x) {
+    return ((x) & 0x1) |
+           (((x) >> (OCTREE_POS_BITS - 1)) & 0x2) |
+           (((x) >> (OCTREE_POS_BITS * 2 - 2)) & 0x4);
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_pack_pos(int p[3])
+{
+    return (((octree_index_t)p[0] & OCTREE_POS_MASK) |
+            ((octree_index_t)p[1] & OCTREE_POS_MASK) << OCTREE_POS_BITS |
+            ((octree_index_t)p[2] & OCTREE_POS_MASK) << (OCTREE_POS_BITS * 2));
+}
+
+
+OCTREE_INLINE
+void octree_unpack_pos(octree_index_t x, int pos[3])
+{
+    pos[0] = (int)(x & OCTREE_POS_MASK);
+    pos[1] = (int)((x >> OCTREE_POS_BITS) & OCTREE_POS_MASK);
+    pos[2] = (int)((x >> (OCTREE_POS_BITS * 2)) & OCTREE_POS_MASK);
+}
+
+
+/* Spread the OCTREE_POS_BITS low bits of x so there are 2 zero bits between
+ * each bit */
+OCTREE_INLINE
+octree_index_t _octree_morton_spread(octree_index_t x)
+{
+#if defined(OCTREE_INDEX_64)
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+    x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x << 2)) & OCTREE_MORTON_X;
+#else
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & OCTREE_MORTON_X;
+#endif /* OCTREE_INDEX_64 */
+    return x;
+}
+
+
+/* Inverse of _octree_morton_spread */
+OCTREE_INLINE
+octree_index_t _octree_morton_compact(octree_index_t x)
+{
+    x &= OCTREE_MORTON_X;
+#if defined(OCTREE_INDEX_64)
+    x = (x | (x >> 2)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x >> 4)) & 0x100F00F00F00F00Full;
+    x = (x | (x >> 8)) & 0x001F0000FF0000FFull;
+    x = (x | (x >> 16)) & 0x001F00000000FFFFull;
+    x = (x | (x >> 32)) & 0x1FFFFF;
+#else
+    x = (x | (x >> 2)) & 0x030C30C3;
+    x = (x | (x >> 4)) & 0x0300F00F;
+    x = (x | (x >> 8)) & 0x030000FF;
+    x = (x | (x >> 16)) & 0x3FF;
+#endif /* OCTREE_INDEX_64 */
+    return x;
+}
+
+
+/* Position of the highest set bit, x must not be 0 */
+OCTREE_INLINE
+int _octree_log2(uint32_t x)
+{
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(x);
+#else
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+#endif
+}
+
+
+/* Same as _octree_log2 for an index */
+OCTREE_INLINE
+int _octree_index_log2(octree_index_t x)
+{
+#if defined(OCTREE_INDEX_64) && defined(__GNUC__)
+    return 63 - __builtin_clzll(x);
+#elif defined(OCTREE_INDEX_64)
+    int n = 0;
+    while (x >>= 1) n++;
+    return n;
+#else
+    return _octree_log2(x);
+#endif
+}
+
+
+/* Bits of an index used by an octree of depth oc_depth */
+OCTREE_INLINE
+octree_index_t octree_index_mask(uint8_t oc_depth)
+{
+    return (octree_index_t)((1ull << (oc_depth * 3)) - 1);
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_packed_pos_to_index(octree_index_t packed, uint8_t oc_depth)
+{
+#if defined(OCTREE_BMI2) && defined(OCTREE_INDEX_64)
+    octree_index_t index =
+        _pdep_u64(packed, OCTREE_MORTON_X) |
+        _pdep_u64(packed >> OCTREE_POS_BITS, OCTREE_MORTON_Y) |
+        _pdep_u64(packed >> (OCTREE_POS_BITS * 2), OCTREE_MORTON_Z);
+#elif defined(OCTREE_BMI2)
+    octree_index_t index = _pdep_u32(packed, OCTREE_MORTON_X) |
+                     _pdep_u32(packed >> 10, OCTREE_MORTON_Y) |
+                     _pdep_u32(packed >> 20, OCTREE_MORTON_Z);
+#else
+    octree_index_t index =
+        _octree_morton_spread(packed) |
+        _octree_morton_spread(packed >> OCTREE_POS_BITS) << 1 |
+        _octree_morton_spread(packed >> (OCTREE_POS_BITS * 2)) << 2;
+#endif
+    return index & octree_index_mask(oc_depth);
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_index_to_packed_pos(octree_index_t index, uint8_t oc_depth)
+{
+    index &= octree_index_mask(oc_depth);
+#if defined(OCTREE_BMI2) && defined(OCTREE_INDEX_64)
+    return _pext_u64(index, OCTREE_MORTON_X) |
+           _pext_u64(index, OCTREE_MORTON_Y) << OCTREE_POS_BITS |
+           _pext_u64(index, OCTREE_MORTON_Z) << (OCTREE_POS_BITS * 2);
+#elif defined(OCTREE_BMI2)
+    return _pext_u32(index, OCTREE_MORTON_X) |
+           _pext_u32(index, OCTREE_MORTON_Y) << 10 |
+           _pext_u32(index, OCTREE_MORTON_Z) << 20;
+#else
+    return _octree_morton_compact(index) |
+           _octree_morton_compact(index >> 1) << OCTREE_POS_BITS |
+           _octree_morton_compact(index >> 2) << (OCTREE_POS_BITS * 2);
+#endif
+}
+
+
+OCTREE_INLINE
+octree_index_t octree_pos_to_index(int pos[3], uint8_t oc_depth)
+{
+    octree_index_t packed = octree_pack_pos(pos);
+
+    return octree_packed_pos_to_index(packed, oc_depth);
+}
+
+
+OCTREE_INLINE
+void octree_index_to_pos(octree_index_t index, int pos[3], uint8_t oc_depth)
+{
+    octree_index_t packed = octree_index_to_packed_pos(index, oc_depth);
+
+    octree_unpack_pos(packed, pos);
+}
+
+
+/* Index of the leaf delta away from index, added axis by axis on the bits
+ * of the index itself(dilated integers) without going through positions.
+ * Each delta must be smaller than the octree's width. Returns false if the
+ * leaf is outside of the octree */
+OCTREE_INLINE
+bool octree_index_add(
+        octree_index_t index, const int delta[3], uint8_t oc_depth,
+        octree_index_t *out)
+{
+    const octree_index_t mask = octree_index_mask(oc_depth);
+
+    for (int a = 0; a < 3; a++) {
+        const octree_index_t m = (OCTREE_MORTON_X << a) & mask,
+                             v = index & m;
+        octree_index_t d, r;
+
+        if (delta[a] == 0) continue;
+
+        if (delta[a] > 0) {
+            d = _octree_morton_spread((octree_index_t)delta[a]) << a;
+            /* The bits between the axis' ones carry the sum over */
+            r = ((v | ~m) + d) & m;
+            if (r < v) return false;
+        }
+        else {
+            d = _octree_morton_spread((octree_index_t)-delta[a]) << a;
+            if (d > v) return false;
+            r = (v - d) & m;
+        }
+        index = (index & ~m) | r;
+    }
+    *out = index;
+    return true;
+}
+
+
+
+/* Accesses to nodes and leaves the writer may change under readers */
+OCTREE_INLINE
+node_t node_read(const node_t *node)
+{
+#if defined(OCTREE_CONCURRENT)
+    node_t copy;
+
+    __atomic_load(node, &copy, __ATOMIC_ACQUIRE);
+    return copy;
+#else
+    return *node;
+#endif
+}
+
+
+OCTREE_INLINE
+void node_write(node_t *node, node_t value)
+{
+#if defined(OCTREE_CONCURRENT)
+    __atomic_store(node, &value, __ATOMIC_RELEASE);
+#else
+    *node = value;
+#endif
+}
+
+
+OCTREE_INLINE
+leaf_t leaf_read(const leaf_t *leaves, uint32_t i)
+{
+#if defined(OCTREE_CONCURRENT)
+    return __atomic_load_n(leaves + i, __ATOMIC_RELAXED);
+#else
+    return leaves[i];
+#endif
+}
+
+
+OCTREE_INLINE
+void leaf_write(leaf_t *leaves, uint32_t i, leaf_t leaf)
+{
+#if defined(OCTREE_CONCURRENT)
+    __atomic_store_n(leaves + i, leaf, __ATOMIC_RELAXED);
+#else
+    leaves[i] = leaf;
+#endif
+}
+
+
+/* Make node full of leaf in one store. Its block isn't freed, the caller
+ * does that after so readers never reach a freed block */
+OCTREE_INLINE
+void node_set_full(node_t *node, leaf_t leaf)
+{
+    node_t full = *node;
+
+    full.childreen = 0;
+    full.is_full = true;
+    full.dom_leaf = leaf;
+    node_write(node, full);
+}
+
+
+#if defined(OCTREE_CONCURRENT)
+OCTREE_INLINE
+void octree_read_lock(octree_reader_t *reader)
+{
+    uint64_t epoch = __atomic_load_n(&reader->pool->epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+    /* The epoch must be visible before any node is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+OCTREE_INLINE
+void octree_read_unlock(octree_reader_t *reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+#endif /* OCTREE_CONCURRENT */
+
+
+OCTREE_INLINE
+node_t *pool_childreen(const node_pool_t *pool, uint32_t childreen)
+{
+    char *chunk =
+        OCTREE_ACQUIRE(&pool->childreen.chunks)[childreen >> OCTREE_POOL_SHIFT];
+
+    return (node_t *)chunk + (size_t)(childreen & OCTREE_POOL_MASK) * 8;
+}
+
+
+OCTREE_INLINE
+leaf_t *pool_leaves(const node_pool_t *pool, uint32_t leaves)
+{
+    char *chunk =
+        OCTREE_ACQUIRE(&pool->leaves.chunks)[leaves >> OCTREE_POOL_SHIFT];
+
+    return (leaf_t *)chunk + (size_t)(leaves & OCTREE_POOL_MASK) * 8;
+}
+
+
+/* Naive function, shouldn't be used */
+OCTREE_INLINE
+node_t *node_get(
+        const node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth)
+{
+    node_t *l_node = node;
+    uint8_t c_level = node->level;
+    uint32_t bit = (oc_depth - c_level - 1) * 3;
+
+    for (; c_level < level; c_level++) {
+        uint8_t c_index = (index >> bit) & 0x7;
+        
+        l_node = pool_childreen(pool, node_read(l_node).childreen) + c_index;
+        bit -= 3;
+    }
+    return l_node;
+}
+
+
+/* Get the nearest node to the level */
+OCTREE_INLINE
+node_t *node_get_nearest(
+        const node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth)
+{
+    node_t *l_node = node;
+
+    uint8_t c_level = node->level;
+    uint32_t bit = (oc_depth - c_level - 1) * 3;
+    for (; c_level < level; c_level++) {
+        uint8_t c_index = (index >> bit) & 0x7;
+        node_t l_value = node_read(l_node);
+
+        if (l_value.is_full || !l_value.childreen) break;
+
+        l_node = pool_childreen(pool, l_value.childreen) + c_index;
+        bit -= 3;
+    }
+    return l_node;
+}
+
+
+OCTREE_INLINE
+bool leaves_full(leaf_t *leaves, leaf_t leaf)
+{
+    return memcmp(leaves, LEAVES(leaf), sizeof(leaf_t) * 8) == 0;
+}
+
+
+/* True if all 8 childreen are full of leaf */
+OCTREE_INLINE
+bool childreen_full(const node_t *childreen, leaf_t leaf)
+{
+    for (int i = 0; i < 8; i++) {
+        if (!childreen[i].is_full || childreen[i].dom_leaf != leaf) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+OCTREE_INLINE
+void leaves_fill(leaf_t *leaves, leaf_t leaf)
+{
+    leaves[0] = leaves[1] =
+    leaves[2] = leaves[3] =
+    leaves[4] = leaves[5] =
+    leaves[6] = leaves[7] = leaf;
+}
+
+
+OCTREE_INLINE
+int leaf_get(
+        const node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth)
+{
+    /* Walk down to the last level on copies of the nodes, so the node
+     * tested is the one used even if the writer changes it */
+    node_t l_value = node_read(node);
+    uint32_t bit = (oc_depth - l_value.level - 1) * 3;
+
+    while (!l_value.is_full && l_value.level < oc_depth - 1) {
+        l_value = node_read(pool_childreen(pool, l_value.childreen) +
+                            ((index >> bit) & 0x7));
+        bit -= 3;
+    }
+
+    return (l_value.is_full)
+        ? l_value.dom_leaf
+        : leaf_read(pool_leaves(pool, l_value.leaves), index & 0x7);
+}
+
+
+OCTREE_INLINE
+void node_leaves_init(node_pool_t *pool, node_t *node, leaf_t leaf)
+{
+    uint32_t leaves = pool_alloc_leaves(pool);
+
+    if (leaves) {
+        node_t split = *node;
+
+        leaves_fill(pool_leaves(pool, leaves), leaf);
+        split.leaves = leaves;
+        split.is_full = false;
+        node_write(node, split);
+    }
+}
+
+
+OCTREE_INLINE
+int leaf_set(
+        node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t oc_depth, leaf_t leaf)
+{
+    int success = 0;
+    node_t *l_node =
+        node_get_nearest(pool, node, index, oc_depth - 1, oc_depth);
+    bool is_last = (l_node->level == oc_depth - 1);
+
+    if (l_node->is_full && l_node->dom_leaf == leaf) {
+        /* Nothing to be done */
+        return 1;
+    }
+
+    if (pool->shared) {
+        if (!node_unshare_path(pool, node, index, oc_depth)) return 0;
+
+        l_node = node_get_nearest(pool, node, index, oc_depth - 1, oc_depth);
+    }
+
+    if (l_node->is_full) {
+        l_node = (is_last)
+            ? l_node
+            : node_get_or_create(pool, node, index, oc_depth - 1, oc_depth);
+
+        if (l_node == NULL) return 0;
+
+        node_leaves_init(pool, l_node, l_node->dom_leaf);
+        if (l_node->is_full) return 0;
+    }
+
+    if (l_node->leaves) {
+        leaf_t *leaves = pool_leaves(pool, l_node->leaves);
+
+        leaf_write(leaves, index & 0x7, leaf);
+        success = 1;
+
+        if (leaves_full(leaves, leaf)) {
+            uint32_t old = l_node->leaves;
+
+            node_set_full(l_node, leaf);
+            pool_free_leaves(pool, old);
+
+            node_optimize_path(pool, node, index, oc_depth);
+        }
+    }
+
+    return success;
+}
+
+
+OCTREE_INLINE
+void node_cursor_init(
+        octree_cursor_t *cursor, node_pool_t *pool, node_t *node,
+        uint8_t oc_depth)
+{
+    cursor->pool = pool;
+    cursor->path[0] = node;
+    /* No index shares a node with ~0, this forces the first descent */
+    cursor->prev = ~(octree_index_t)0;
+    cursor->generation = OCTREE_ACQUIRE(&pool->generation);
+    cursor->oc_depth = oc_depth;
+    cursor->base = node_read(node).level;
+    cursor->top = 0;
+}
+
+
+/* Deepest node on the path to index, kept in cursor->path[cursor->top]. A
+ * copy is returned so the node tested is the one used even if the writer
+ * changes it */
+OCTREE_INLINE
+node_t cursor_find(octree_cursor_t *cursor, octree_index_t index)
+{
+    const uint8_t oc_depth = cursor->oc_depth, base = cursor->base;
+    const uint32_t generation = OCTREE_ACQUIRE(&cursor->pool->generation);
+    node_t l_value;
+    int k = cursor->top;
+
+    if (generation != cursor->generation) {
+        cursor->generation = generation;
+        k = 0;
+    }
+    else {
+        const octree_index_t diff =
+            (index ^ cursor->prev) & octree_index_mask(oc_depth);
+
+        if (diff) {
+            /* Deepest level on the previous path still containing index */
+            int shared =
+                oc_depth - 1 - _octree_index_log2(diff) / 3 - base;
+
+            if (shared < k) k = shared;
+            if (k < 0) k = 0;
+        }
+    }
+
+    l_value = node_read(cursor->path[k]);
+    while (k + base < oc_depth - 1 && !l_value.is_full) {
+        uint32_t bit = (oc_depth - (k + base) - 1) * 3;
+
+        cursor->path[++k] = pool_childreen(cursor->pool, l_value.childreen) +
+                            ((index >> bit) & 0x7);
+        l_value = node_read(cursor->path[k]);
+    }
+    cursor->top = (uint8_t)k;
+    cursor->prev = index;
+
+    return l_value;
+}
+
+
+/* Same as leaf_get, for the tree the cursor was initialized on */
+OCTREE_INLINE
+leaf_t cursor_leaf_get(octree_cursor_t *cursor, octree_index_t index)
+{
+    const node_t l_value = cursor_find(cursor, index);
+
+    return (l_value.is_full)
+        ? l_value.dom_leaf
+        : leaf_read(pool_leaves(cursor->pool, l_value.leaves), index & 0x7);
+}
+
+
+/* Same as leaf_set. A leaf written in a block of leaves that stays mixed
+ * and isn't shared is set in place, anything else goes through leaf_set */
+OCTREE_INLINE
+int cursor_leaf_set(octree_cursor_t *cursor, octree_index_t index, leaf_t leaf)
+{
+    const node_t l_value = cursor_find(cursor, index);
+
+    if (l_value.is_full) {
+        if (l_value.dom_leaf == leaf) return 1;
+    }
+    else if (!cursor->pool->shared) {
+        leaf_t *leaves = pool_leaves(cursor->pool, l_value.leaves);
+
+        leaf_write(leaves, index & 0x7, leaf);
+        /* leaf_set collapses the block once it's filled */
+        if (!leaves_full(leaves, leaf)) return 1;
+    }
+
+    return leaf_set(
+            cursor->pool, cursor->path[0], index, cursor->oc_depth, leaf);
+}
+
+
+OCTREE_INLINE
+node_t *octree_node_get(octree_t *octree, octree_index_t index, uint8_t level)
+{
+    return node_get(octree->pool, octree->root, index, level, octree->depth);
+}
+
+
+OCTREE_INLINE
+node_t *octree_node_get_nearest(octree_t *octree, octree_index_t index, uint8_t level)
+{
+    return node_get_nearest(
+            octree->pool, octree->root, index, level, octree->depth);
+}
+
+
+OCTREE_INLINE
+node_t *octree_node_get_or_create(
+        octree_t *octree, octree_index_t index, uint8_t level)
+{
+    return node_get_or_create(
+            octree->pool, octree->root, index, level, octree->depth);
+}
+
+
+OCTREE_INLINE
+leaf_t octree_leaf_get(octree_t *octree, octree_index_t index)
+{
+    return leaf_get(octree->pool, octree->root, index, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_many(
+        octree_t *octree, const octree_index_t *indices, leaf_t *out, size_t n)
+{
+    leaf_get_many(octree->pool, octree->root, indices, out, n, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_neighbors(
+        octree_t *octree, octree_index_t index, leaf_t border, leaf_t out[6])
+{
+    leaf_get_neighbors(
+            octree->pool, octree->root, index, octree->depth, border, out);
+}
+
+
+OCTREE_INLINE
+void octree_leaf_get_neighborhood(
+        octree_t *octree, octree_index_t index, leaf_t border, leaf_t out[27])
+{
+    leaf_get_neighborhood(
+            octree->pool, octree->root, index, octree->depth, border, out);
+}
+
+
+/* Set every leaf with min <= pos < max to leaf */
+OCTREE_INLINE
+int octree_fill_box(octree_t *octree, int min[3], int max[3], leaf_t leaf)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_fill_box(
+            octree->pool, octree->root, origin, min, max, octree->depth, leaf);
+}
+
+
+/* The cursor stays usable while the octree exists, whatever is done to it */
+OCTREE_INLINE
+void octree_cursor_init(octree_cursor_t *cursor, octree_t *octree)
+{
+    node_cursor_init(cursor, octree->pool, octree->root, octree->depth);
+}
+
+
+OCTREE_INLINE
+void octree_iter_init(node_iter_t *it, octree_t *octree, uint8_t max_level)
+{
+    node_iter_init(it, octree->pool, octree->root, octree->depth, max_level);
+}
+
+
+OCTREE_INLINE
+int octree_visit(
+        octree_t *octree, uint8_t max_level, octree_visit_fn fn, void *data)
+{
+    return node_visit(
+            octree->pool, octree->root, octree->depth, max_level, fn, data);
+}
+
+
+/* Runs with leaves in [min, max), see node_query_box */
+OCTREE_INLINE
+int octree_query_box(
+        octree_t *octree, const int min[3], const int max[3],
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_query_box(
+            octree->pool, octree->root, origin, min, max, octree->depth,
+            match, fn, data);
+}
+
+
+/* Runs inside the frustum given by its planes, see node_query_planes */
+OCTREE_INLINE
+int octree_query_frustum(
+        octree_t *octree, const float planes[][4], int n,
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const int origin[3] = {0, 0, 0};
+
+    return node_query_planes(
+            octree->pool, octree->root, origin, planes, n, octree->depth,
+            match, fn, data);
+}
+
+
+OCTREE_INLINE
+int octree_mesh(
+        octree_t *octree, octree_leaf_fn match, void *data,
+        octree_mesh_t *mesh)
+{
+    return node_mesh(
+            octree->pool, octree->root, octree->depth, match, data, mesh);
+}
+
+
+OCTREE_INLINE
+int octree_raycast(
+        octree_t *octree, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hit)
+{
+    return node_raycast(
+            octree->pool, octree->root, octree->depth,
+            origin, dir, max_dist, fn, data, hit);
+}
+
+
+OCTREE_INLINE
+size_t octree_raycast_n(
+        octree_t *octree, const float origins[][3], const float dirs[][3],
+        size_t n, float max_dist, octree_leaf_fn fn, void *data,
+        octree_hit_t *hits)
+{
+    return node_raycast_n(
+            octree->pool, octree->root, octree->depth,
+            origins, dirs, n, max_dist, fn, data, hits);
+}
+
+
+OCTREE_INLINE
+int octree_leaf_set(octree_t *octree, octree_index_t index, leaf_t leaf)
+{
+    return leaf_set(octree->pool, octree->root, index, octree->depth, leaf);
+}
+
+
+#if defined(OCTREE_CONCURRENT)
+/* Set on the count of blocks that were ever shared. Readers may still be
+ * looking at them through a node that got its own copy, so they're copied
+ * on write even once they're down to one reference */
+#define REF_FROZEN 0x80000000u
+#else
+#define REF_FROZEN 0
+#endif /* OCTREE_CONCURRENT */
+
+#define REF_COUNT(ref) ((ref) & ~REF_FROZEN)
+
+
+#if defined(OCTREE_COUNTERS)
+#define SLAB_COUNT(slab, n) ((slab)->live += (n))
+#else
+#define SLAB_COUNT(slab, n) ((void)0)
+#endif /* OCTREE_COUNTERS */
+
+
+static void slab_init(slab_t *slab, uint32_t block_size)
+{
+    /* The optional fields start at 0 too */
+    memset(slab, 0, sizeof(*slab));
+    slab->used = 1;
+    slab->block_size = block_size;
+}
+
+
+static uint32_t *slab_ref(const slab_t *slab, uint32_t id)
+{
+    return slab->refs[id >> OCTREE_POOL_SHIFT] + (id & OCTREE_POOL_MASK);
+}
+
+
+static uint32_t *slab_alloc_refs(void)
+{
+    return (uint32_t *)calloc(OCTREE_POOL_CHUNK, sizeof(uint32_t));
+}
+
+
+static char *slab_block(const slab_t *slab, uint32_t id)
+{
+    return slab->chunks[id >> OCTREE_POOL_SHIFT] +
+           (size_t)(id & OCTREE_POOL_MASK) * slab->block_size;
+}
+
+
+static uint32_t slab_alloc(slab_t *slab)
+{
+    uint32_t id = slab->free_list;
+
+    if (id) {
+        memcpy(&slab->free_list, slab_block(slab, id), sizeof(uint32_t));
+        if (slab->refs) *slab_ref(slab, id) = 0;
+        SLAB_COUNT(slab, 1);
+        return id;
+    }
+
+    if (slab->n_chunks == 0 || slab->used == OCTREE_POOL_CHUNK) {
+        /* Chunks left over by pool_reset are reused before allocating */
+        uint32_t next = (slab->n_chunks == 0) ? 0 : slab->top + 1;
+
+        if (next == slab->n_chunks) {
+            char *chunk;
+
+            if (slab->n_chunks == slab->cap_chunks) {
+                uint32_t cap = (slab->cap_chunks) ? slab->cap_chunks * 2 : 16;
+#if defined(OCTREE_CONCURRENT)
+                /* Readers may be indexing the old table, it's retired by
+                 * the pool instead of freed */
+                char **chunks = (char **)malloc(cap * sizeof(char *));
+
+                if (chunks == NULL) return 0;
+
+                if (slab->n_chunks) {
+                    memcpy(chunks, slab->chunks,
+                           slab->n_chunks * sizeof(char *));
+                }
+                slab->old_chunks = slab->chunks;
+                __atomic_store_n(&slab->chunks, chunks, __ATOMIC_RELEASE);
+#else
+                char **chunks =
+                    (char **)realloc(slab->chunks, cap * sizeof(char *));
+
+                if (chunks == NULL) return 0;
+
+                slab->chunks = chunks;
+#endif /* OCTREE_CONCURRENT */
+
+                if (slab->refs) {
+                    uint32_t **refs = (uint32_t **)realloc(
+                            slab->refs, cap * sizeof(uint32_t *));
+
+                    if (refs == NULL) return 0;
+
+                    slab->refs = refs;
+                }
+                slab->cap_chunks = cap;
+            }
+            chunk = (char *)malloc(
+                    (size_t)slab->block_size * OCTREE_POOL_CHUNK);
+
+            if (chunk == NULL) return 0;
+
+            if (slab->refs) {
+                uint32_t *refs = slab_alloc_refs();
+
+                if (refs == NULL) {
+                    free(chunk);
+                    return 0;
+                }
+                slab->refs[slab->n_chunks] = refs;
+            }
+            slab->chunks[slab->n_chunks++] = chunk;
+        }
+        slab->top = next;
+        /* Block 0 is reserved as the null block */
+        slab->used = (next == 0);
+    }
+
+    id = (slab->top << OCTREE_POOL_SHIFT) | slab->used++;
+    /* Chunks reused after pool_reset still hold old counts */
+    if (slab->refs) *slab_ref(slab, id) = 0;
+    SLAB_COUNT(slab, 1);
+
+    return id;
+}
+
+
+/* Drop a reference to a block, true if it was the last one */
+static bool slab_unref(slab_t *slab, uint32_t id)
+{
+    if (slab->refs) {
+        uint32_t *ref = slab_ref(slab, id);
+
+        if (REF_COUNT(*ref)) {
+            (*ref)--;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void slab_release(slab_t *slab, uint32_t id)
+{
+    memcpy(slab_block(slab, id), &slab->free_list, sizeof(uint32_t));
+    slab->free_list = id;
+    SLAB_COUNT(slab, -1);
+}
+
+
+static void slab_reset(slab_t *slab)
+{
+    slab->free_list = 0;
+    slab->top = 0;
+    slab->used = 1;
+#if defined(OCTREE_COUNTERS)
+    slab->live = 0;
+#endif /* OCTREE_COUNTERS */
+}
+
+
+static bool slab_share(slab_t *slab)
+{
+    if (slab->refs) return true;
+
+    slab->refs = (uint32_t **)calloc(
+            (slab->cap_chunks) ? slab->cap_chunks : 1, sizeof(uint32_t *));
+    if (slab->refs == NULL) return false;
+
+    for (uint32_t i = 0; i < slab->n_chunks; i++) {
+        slab->refs[i] = slab_alloc_refs();
+
+        if (slab->refs[i] == NULL) {
+            while (i-- > 0) free(slab->refs[i]);
+            free(slab->refs);
+            slab->refs = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void slab_destroy(slab_t *slab)
+{
+    for (uint32_t i = 0; i < slab->n_chunks; i++) {
+        free(slab->chunks[i]);
+        if (slab->refs) free(slab->refs[i]);
+    }
+    free(slab->chunks);
+    free(slab->refs);
+#if defined(OCTREE_CONCURRENT)
+    free(slab->old_chunks);
+#endif /* OCTREE_CONCURRENT */
+    slab_init(slab, slab->block_size);
+}
+
+
+OCTREE_DEF
+node_pool_t *pool_construct(void)
+{
+    node_pool_t *pool = (node_pool_t *)malloc(sizeof(node_pool_t));
+
+    if (pool) {
+        slab_init(&pool->childreen, sizeof(node_t [8]));
+        slab_init(&pool->leaves, sizeof(leaf_t [8]));
+        pool->shared = false;
+        pool->users = 1;
+        pool->generation = 0;
+#if defined(OCTREE_CONCURRENT)
+        /* 0 is the epoch of readers outside the pool */
+        pool->epoch = 1;
+        pool->readers = NULL;
+        pool->retired = NULL;
+        pool->n_retired = 0;
+        pool->cap_retired = 0;
+#endif /* OCTREE_CONCURRENT */
+    }
+    return pool;
+}
+
+
+#if defined(OCTREE_CONCURRENT)
+enum
+{
+    RETIRED_CHILDREEN,
+    RETIRED_LEAVES,
+    RETIRED_TABLE
+};
+
+
+static void pool_release_retired(node_pool_t *pool, const pool_retired_t *r)
+{
+    /* Blocks stop counting as live when they're retired */
+    switch (r->kind) {
+    case RETIRED_CHILDREEN:
+        SLAB_COUNT(&pool->childreen, 1);
+        slab_release(&pool->childreen, r->id);
+        break;
+    case RETIRED_LEAVES:
+        SLAB_COUNT(&pool->leaves, 1);
+        slab_release(&pool->leaves, r->id);
+        break;
+    default:
+        free(r->table);
+        break;
+    }
+}
+
+
+/* Free a block, or table, once the readers that could still see it left */
+static void pool_retire(node_pool_t *pool, uint8_t kind, uint32_t id,
+                        char **table)
+{
+    pool_retired_t r = {pool->epoch, table, id, kind};
+
+    if (pool->n_retired == pool->cap_retired) {
+        size_t cap = (pool->cap_retired) ? pool->cap_retired * 2 : 256;
+        pool_retired_t *retired = (pool_retired_t *)realloc(
+                pool->retired, cap * sizeof(pool_retired_t));
+
+        if (retired == NULL) {
+            /* Nowhere to keep it, wait for the readers instead */
+            pool_synchronize(pool);
+            pool_release_retired(pool, &r);
+            return;
+        }
+        pool->retired = retired;
+        pool->cap_retired = cap;
+    }
+    pool->retired[pool->n_retired++] = r;
+
+    if (pool->n_retired % OCTREE_RECLAIM_BATCH == 0) pool_reclaim(pool);
+}
+
+
+static void slab_retire_table(node_pool_t *pool, slab_t *slab)
+{
+    if (slab->old_chunks) {
+        char **table = slab->old_chunks;
+
+        slab->old_chunks = NULL;
+        pool_retire(pool, RETIRED_TABLE, 0, table);
+    }
+}
+
+
+OCTREE_DEF
+octree_reader_t *pool_reader_join(node_pool_t *pool)
+{
+    octree_reader_t *reader = __atomic_load_n(&pool->readers, __ATOMIC_ACQUIRE);
+
+    /* Take over a reader that left */
+    for (; reader; reader = reader->next) {
+        int in_use = 0;
+
+        if (__atomic_compare_exchange_n(
+                    &reader->in_use, &in_use, 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return reader;
+    }
+
+    reader = (octree_reader_t *)calloc(1, sizeof(octree_reader_t));
+    if (reader == NULL) return NULL;
+
+    reader->pool = pool;
+    reader->in_use = 1;
+    reader->next = __atomic_load_n(&pool->readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+                &pool->readers, &reader->next, reader, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return reader;
+}
+
+
+OCTREE_DEF
+void pool_reader_leave(octree_reader_t *reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Start a new epoch and return the oldest one a reader is still in */
+static uint64_t pool_advance(node_pool_t *pool)
+{
+    uint64_t oldest = __atomic_add_fetch(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+    octree_reader_t *reader;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    reader = __atomic_load_n(&pool->readers, __ATOMIC_ACQUIRE);
+    for (; reader; reader = reader->next) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+    return oldest;
+}
+
+
+OCTREE_DEF
+size_t pool_reclaim(node_pool_t *pool)
+{
+    /* Anything retired before the oldest reader came in is unreachable */
+    uint64_t oldest = pool_advance(pool);
+    size_t n = 0;
+
+    while (n < pool->n_retired && pool->retired[n].epoch < oldest) {
+        pool_release_retired(pool, pool->retired + n);
+        n++;
+    }
+    if (n) {
+        memmove(pool->retired, pool->retired + n,
+                (pool->n_retired - n) * sizeof(pool_retired_t));
+        pool->n_retired -= n;
+    }
+
+    return n;
+}
+
+
+OCTREE_DEF
+void pool_synchronize(node_pool_t *pool)
+{
+    /* Readers inside now are in an epoch before this one */
+    const uint64_t epoch = pool->epoch + 1;
+
+    while (pool_advance(pool) < epoch) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    pool_reclaim(pool);
+}
+#endif /* OCTREE_CONCURRENT */
+
+
+/* Cursors walking a path through a block freed, or replaced, since they
+ * last looked see the generation change */
+static void pool_bump(node_pool_t *pool)
+{
+#if defined(OCTREE_CONCURRENT)
+    __atomic_store_n(&pool->generation, pool->generation + 1,
+                     __ATOMIC_RELEASE);
+#else
+    pool->generation++;
+#endif /* OCTREE_CONCURRENT */
+}
+
+
+OCTREE_DEF
+void pool_free(node_pool_t *pool)
+{
+#if defined(OCTREE_CONCURRENT)
+    octree_reader_t *reader = pool->readers;
+
+    for (size_t i = 0; i < pool->n_retired; i++) {
+        if (pool->retired[i].kind == RETIRED_TABLE) {
+            free(pool->retired[i].table);
+        }
+    }
+    free(pool->retired);
+
+    while (reader) {
+        octree_reader_t *next = reader->next;
+
+        free(reader);
+        reader = next;
+    }
+#endif /* OCTREE_CONCURRENT */
+    slab_destroy(&pool->childreen);
+    slab_destroy(&pool->leaves);
+    free(pool);
+}
+
+
+/* Free up to *n chunks from the end of the slab */
+static void slab_free_chunks(slab_t *slab, size_t *n)
+{
+    for (; *n && slab->n_chunks; (*n)--) {
+        slab->n_chunks--;
+        free(slab->chunks[slab->n_chunks]);
+        if (slab->refs) free(slab->refs[slab->n_chunks]);
+    }
+}
+
+
+OCTREE_DEF
+int pool_free_step(node_pool_t *pool, size_t budget)
+{
+    size_t n = budget / OCTREE_POOL_CHUNK + 1;
+
+    slab_free_chunks(&pool->childreen, &n);
+    slab_free_chunks(&pool->leaves, &n);
+
+    if (pool->childreen.n_chunks || pool->leaves.n_chunks) return 0;
+
+    pool_free(pool);
+    return 1;
+}
+
+
+OCTREE_DEF
+void pool_reset(node_pool_t *pool)
+{
+#if defined(OCTREE_CONCURRENT)
+    /* The retired blocks go with the rest */
+    for (size_t i = 0; i < pool->n_retired; i++) {
+        if (pool->retired[i].kind == RETIRED_TABLE) {
+            free(pool->retired[i].table);
+        }
+    }
+    pool->n_retired = 0;
+#endif /* OCTREE_CONCURRENT */
+    slab_reset(&pool->childreen);
+    slab_reset(&pool->leaves);
+    pool_bump(pool);
+}
+
+
+OCTREE_DEF
+uint32_t pool_alloc_childreen(node_pool_t *pool)
+{
+    uint32_t id = slab_alloc(&pool->childreen);
+
+#if defined(OCTREE_CONCURRENT)
+    slab_retire_table(pool, &pool->childreen);
+#endif /* OCTREE_CONCURRENT */
+    return id;
+}
+
+
+OCTREE_DEF
+void pool_free_childreen(node_pool_t *pool, uint32_t childreen)
+{
+    pool_bump(pool);
+    if (!slab_unref(&pool->childreen, childreen)) return;
+
+#if defined(OCTREE_CONCURRENT)
+    SLAB_COUNT(&pool->childreen, -1);
+    pool_retire(pool, RETIRED_CHILDREEN, childreen, NULL);
+#else
+    slab_release(&pool->childreen, childreen);
+#endif /* OCTREE_CONCURRENT */
+}
+
+
+OCTREE_DEF
+uint32_t pool_alloc_leaves(node_pool_t *pool)
+{
+    uint32_t id = slab_alloc(&pool->leaves);
+
+#if defined(OCTREE_CONCURRENT)
+    slab_retire_table(pool, &pool->leaves);
+#endif /* OCTREE_CONCURRENT */
+    return id;
+}
+
+
+OCTREE_DEF
+void pool_free_leaves(node_pool_t *pool, uint32_t leaves)
+{
+    pool_bump(pool);
+    if (!slab_unref(&pool->leaves, leaves)) return;
+
+#if defined(OCTREE_CONCURRENT)
+    SLAB_COUNT(&pool->leaves, -1);
+    pool_retire(pool, RETIRED_LEAVES, leaves, NULL);
+#else
+    slab_release(&pool->leaves, leaves);
+#endif /* OCTREE_CONCURRENT */
+}
+
+
+OCTREE_DEF
+int pool_share(node_pool_t *pool)
+{
+    if (!slab_share(&pool->childreen) || !slab_share(&pool->leaves)) return 0;
+
+    pool->shared = true;
+    return 1;
+}
+
+
+OCTREE_DEF
+void pool_retain_childreen(node_pool_t *pool, uint32_t childreen)
+{
+    uint32_t *ref = slab_ref(&pool->childreen, childreen);
+
+    *ref = (*ref + 1) | REF_FROZEN;
+}
+
+
+OCTREE_DEF
+void pool_retain_leaves(node_pool_t *pool, uint32_t leaves)
+{
+    uint32_t *ref = slab_ref(&pool->leaves, leaves);
+
+    *ref = (*ref + 1) | REF_FROZEN;
+}
+
+
+OCTREE_DEF
+uint32_t pool_childreen_refs(const node_pool_t *pool, uint32_t childreen)
+{
+    return (pool->shared)
+        ? REF_COUNT(*slab_ref(&pool->childreen, childreen))
+        : 0;
+}
+
+
+OCTREE_DEF
+uint32_t pool_leaves_refs(const node_pool_t *pool, uint32_t leaves)
+{
+    return (pool->shared) ? REF_COUNT(*slab_ref(&pool->leaves, leaves)) : 0;
+}
+
+
+/* Blocks that are or were shared can't be written in place */
+static bool slab_writable(const slab_t *slab, uint32_t id)
+{
+    return slab->refs == NULL || *slab_ref(slab, id) == 0;
+}
+
+
+OCTREE_DEF
+node_t *node_construct(void)
+{
+    node_t *node = (node_t *)malloc(sizeof(node_t));
+
+    if (node) *node = (node_t) {{0}, 0, 0, 0, 0};
+    return node;
+}
+
+
+/* Split node into the block childreen, each full of node's dom_leaf */
+static void node_attach_childreen(
+        node_pool_t *pool, node_t *node, uint32_t childreen)
+{
+    const uint8_t level = node->level + 1;
+    node_t base_node = {{0}, 1, 1, level, node->dom_leaf};
+    node_t *nodes = pool_childreen(pool, childreen);
+
+    for (int i = 0; i < 8; i++) {
+        nodes[i] = base_node;
+    }
+    /* The block is filled before readers can reach it */
+    base_node = *node;
+    base_node.childreen = childreen;
+    base_node.is_full = 0;
+    node_write(node, base_node);
+}
+
+
+OCTREE_DEF
+int node_init_childreen(node_pool_t *pool, node_t *node)
+{
+    uint32_t childreen = pool_alloc_childreen(pool);
+
+    if (childreen == 0) return 0;
+
+    node_attach_childreen(pool, node, childreen);
+    return 1;
+}
+
+
+/* Get nodes or create them if they don't exist */
+OCTREE_DEF
+node_t *node_get_or_create(
+        node_pool_t *pool,
+        node_t *node, octree_index_t index, uint8_t level, uint8_t oc_depth)
+{
+    node_t *l_node = node;
+
+    uint8_t c_level = node->level;
+    uint32_t bit = (oc_depth - c_level - 1) * 3;
+    for (; c_level < level; c_level++) {
+        uint8_t c_index = (index >> bit) & 0x7;
+
+        if (l_node->is_full) {
+            if (!node_init_childreen(pool, l_node)) return NULL;
+        }
+        else if (pool->shared && !node_unshare(pool, l_node, oc_depth)) {
+            return NULL;
+        }
+
+        l_node = pool_childreen(pool, l_node->childreen) + c_index;
+        bit -= 3;
+    }
+    return l_node;
+}
+
+
+/* Recrusively free the last level */
+OCTREE_DEF
+void node_r_free_last(
+        node_pool_t *pool, node_t *node, uint8_t last_level, uint8_t depth)
+{
+    uint8_t level = node->level;
+    bool is_local_last = (level == last_level - 1);
+    bool is_last_node = (level == depth - 1);
+
+    if (node->is_full) return;
+
+    if (is_local_last) {
+        if (is_last_node) {
+            pool_free_leaves(pool, node->leaves);
+            node->leaves = 0;
+        }
+        else {
+            pool_free_childreen(pool, node->childreen);
+            node->childreen = 0;
+        }
+    }
+    else {
+        node_t *childreen = pool_childreen(pool, node->childreen);
+
+        for (int i = 0; i < 8; i++) {
+            node_r_free_last(pool, childreen + i, last_level, depth);
+        }
+    }
+}
+
+
+/* Free node's own block, or push it to descend into its childreen first.
+ * Returns the number of blocks freed */
+static size_t node_free_visit(node_free_t *it, const node_t *node)
+{
+    if (node->is_full) return 0;
+
+    if (node->level == it->oc_depth - 1) {
+        pool_free_leaves(it->pool, node->leaves);
+        return 1;
+    }
+    if (node->childreen == 0) return 0;
+
+    /* Other references keep the blocks below alive */
+    if (pool_childreen_refs(it->pool, node->childreen)) {
+        pool_free_childreen(it->pool, node->childreen);
+        return 1;
+    }
+    it->childreen[it->top] = node->childreen;
+    it->next[it->top] = 0;
+    it->top++;
+    return 0;
+}
+
+
+OCTREE_DEF
+void node_free_init(
+        node_free_t *it, node_pool_t *pool, const node_t *node,
+        uint8_t oc_depth)
+{
+    it->pool = pool;
+    it->top = 0;
+    it->oc_depth = oc_depth;
+
+    node_free_visit(it, node);
+}
+
+
+OCTREE_DEF
+int node_free_step(node_free_t *it, size_t budget)
+{
+    size_t freed = 0;
+
+    while (it->top && freed < budget) {
+        const uint8_t k = it->top - 1;
+        const uint32_t childreen = it->childreen[k];
+
+        if (it->next[k] == 8) {
+            /* Every child is done, the block's links aren't needed */
+            pool_free_childreen(it->pool, childreen);
+            it->top--;
+            freed++;
+        }
+        else {
+            const node_t child =
+                pool_childreen(it->pool, childreen)[it->next[k]++];
+
+            freed += node_free_visit(it, &child);
+        }
+    }
+    return it->top == 0;
+}
+
+
+OCTREE_DEF
+void node_r_free(node_pool_t *pool, node_t *node, uint8_t depth)
+{
+    node_free_t it;
+
+    node_free_init(&it, pool, node, depth);
+    node_free_step(&it, SIZE_MAX);
+
+    free(node);
+}
+
+
+/* Free the blocks below node without writing to any node, readers may
+ * still be walking them */
+static void node_release(
+        node_pool_t *pool, const node_t *node, uint8_t oc_depth)
+{
+    node_free_t it;
+
+    node_free_init(&it, pool, node, oc_depth);
+    node_free_step(&it, SIZE_MAX);
+}
+
+
+OCTREE_DEF
+void node_clear(node_pool_t *pool, node_t *node, uint8_t oc_depth, leaf_t leaf)
+{
+    node_t old = *node;
+
+    node_set_full(node, leaf);
+    node_release(pool, &old, oc_depth);
+}
+
+
+OCTREE_DEF
+int node_unshare(node_pool_t *pool, node_t *node, uint8_t oc_depth)
+{
+    const node_t old = *node;
+    node_t copy = old;
+
+    if (node->is_full) return 1;
+
+    if (node->level == oc_depth - 1) {
+        uint32_t leaves;
+
+        if (slab_writable(&pool->leaves, node->leaves)) return 1;
+
+        leaves = pool_alloc_leaves(pool);
+        if (leaves == 0) return 0;
+
+        memcpy(pool_leaves(pool, leaves), pool_leaves(pool, node->leaves),
+               sizeof(leaf_t [8]));
+        copy.leaves = leaves;
+        node_write(node, copy);
+        pool_free_leaves(pool, old.leaves);
+    }
+    else {
+        const uint32_t refs = pool_childreen_refs(pool, node->childreen);
+        uint32_t childreen;
+        node_t *nodes;
+
+        if (slab_writable(&pool->childreen, node->childreen)) return 1;
+
+        childreen = pool_alloc_childreen(pool);
+        if (childreen == 0) return 0;
+
+        nodes = pool_childreen(pool, childreen);
+        memcpy(nodes, pool_childreen(pool, node->childreen),
+               sizeof(node_t [8]));
+
+        /* The copy references the same blocks as the original, or takes
+         * the original's references over if it's about to be freed */
+        for (int i = 0; i < 8; i++) {
+            if (nodes[i].is_full || refs == 0) continue;
+
+            if (nodes[i].level == oc_depth - 1) {
+                pool_retain_leaves(pool, nodes[i].leaves);
+            }
+            else {
+                pool_retain_childreen(pool, nodes[i].childreen);
+            }
+        }
+        copy.childreen = childreen;
+        node_write(node, copy);
+        pool_free_childreen(pool, old.childreen);
+    }
+    return 1;
+}
+
+
+OCTREE_DEF
+int node_unshare_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth)
+{
+    node_t *l_node = node;
+
+    uint8_t c_level = node->level;
+    uint32_t bit = (oc_depth - c_level - 1) * 3;
+    for (; !l_node->is_full; c_level++) {
+        if (!node_unshare(pool, l_node, oc_depth)) return 0;
+        if (c_level == oc_depth - 1) break;
+
+        l_node = pool_childreen(pool, l_node->childreen) +
+                 ((index >> bit) & 0x7);
+        bit -= 3;
+    }
+    return 1;
+}
+
+
+OCTREE_DEF
+int node_fill_box(
+        node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth, leaf_t leaf)
+{
+    const int size = 1 << (oc_depth - node->level);
+    bool inside = true;
+
+    for (int a = 0; a < 3; a++) {
+        /* An empty box overlaps nothing, even when it's inside the node */
+        if (min[a] >= max[a] ||
+            max[a] <= origin[a] || min[a] >= origin[a] + size) return 1;
+
+        inside &= (min[a] <= origin[a] && origin[a] + size <= max[a]);
+    }
+
+    if (inside) {
+        node_clear(pool, node, oc_depth, leaf);
+        return 1;
+    }
+
+    if (node->is_full && node->dom_leaf == leaf) return 1;
+
+    if (node->level == oc_depth - 1) {
+        leaf_t *leaves;
+
+        if (node->is_full) {
+            node_leaves_init(pool, node, node->dom_leaf);
+            if (node->is_full) return 0;
+        }
+        else if (!node_unshare(pool, node, oc_depth)) {
+            return 0;
+        }
+        leaves = pool_leaves(pool, node->leaves);
+
+        for (int i = 0; i < 8; i++) {
+            const int x = origin[0] + (i & 1),
+                      y = origin[1] + ((i >> 1) & 1),
+                      z = origin[2] + ((i >> 2) & 1);
+
+            if (min[0] <= x && x < max[0] &&
+                min[1] <= y && y < max[1] &&
+                min[2] <= z && z < max[2]) leaf_write(leaves, i, leaf);
+        }
+
+        if (leaves_full(leaves, leaf)) {
+            const uint32_t old = node->leaves;
+
+            node_set_full(node, leaf);
+            pool_free_leaves(pool, old);
+        }
+    }
+    else {
+        const int half = size >> 1;
+        node_t *childreen;
+
+        if (node->is_full) {
+            if (!node_init_childreen(pool, node)) return 0;
+        }
+        else if (!node_unshare(pool, node, oc_depth)) {
+            return 0;
+        }
+
+        childreen = pool_childreen(pool, node->childreen);
+        for (int i = 0; i < 8; i++) {
+            const int c_origin[3] = {
+                origin[0] + (i & 1) * half,
+                origin[1] + ((i >> 1) & 1) * half,
+                origin[2] + ((i >> 2) & 1) * half
+            };
+
+            if (!node_fill_box(
+                        pool, childreen + i, c_origin,
+                        min, max, oc_depth, leaf)) return 0;
+        }
+
+        if (childreen_full(childreen, leaf)) {
+            const uint32_t old = node->childreen;
+
+            node_set_full(node, leaf);
+            pool_free_childreen(pool, old);
+        }
+    }
+    return 1;
+}
+
+
+OCTREE_DEF
+int node_optimize(node_pool_t *pool, node_t *node, uint8_t oc_depth)
+{
+    int freed = 0;
+    node_t *childreen;
+
+    if (node->is_full) return 0;
+
+    if (node->level == oc_depth - 1) {
+        const uint32_t old = node->leaves;
+        leaf_t *leaves = pool_leaves(pool, old);
+        leaf_t leaf = leaves[0];
+
+        if (!leaves_full(leaves, leaf)) return 0;
+
+        node_set_full(node, leaf);
+        pool_free_leaves(pool, old);
+        return 1;
+    }
+
+    childreen = pool_childreen(pool, node->childreen);
+    for (int i = 0; i < 8; i++) {
+        freed += node_optimize(pool, childreen + i, oc_depth);
+    }
+
+    if (childreen_full(childreen, childreen[0].dom_leaf)) {
+        const uint32_t old = node->childreen;
+
+        node_set_full(node, childreen[0].dom_leaf);
+        pool_free_childreen(pool, old);
+        freed++;
+    }
+    return freed;
+}
+
+
+OCTREE_DEF
+int node_optimize_path(
+        node_pool_t *pool, node_t *node, octree_index_t index, uint8_t oc_depth)
+{
+    node_t *path[OCTREE_MAX_DEPTH];
+    node_t *l_node = node;
+    int n = 0, freed = 0;
+
+    uint8_t c_level = node->level;
+    uint32_t bit = (oc_depth - c_level - 1) * 3;
+    for (; c_level < oc_depth - 1 && !l_node->is_full; c_level++) {
+        path[n++] = l_node;
+        l_node = pool_childreen(pool, l_node->childreen) +
+                 ((index >> bit) & 0x7);
+        bit -= 3;
+    }
+
+    while (n-- > 0) {
+        node_t *parent = path[n];
+        node_t *childreen = pool_childreen(pool, parent->childreen);
+        leaf_t leaf = childreen[0].dom_leaf;
+        uint32_t old;
+
+        if (!childreen_full(childreen, leaf)) break;
+
+        old = parent->childreen;
+        node_set_full(parent, leaf);
+        pool_free_childreen(pool, old);
+        freed++;
+    }
+    return freed;
+}
+
+
+OCTREE_DEF
+void leaf_get_many(
+        const node_pool_t *pool, node_t *node,
+        const octree_index_t *indices, leaf_t *out, size_t n, uint8_t oc_depth)
+{
+    /* path[k] is the node at level node->level + k on the previous path */
+    node_t *path[OCTREE_MAX_DEPTH];
+    const uint8_t base = node_read(node).level;
+    const octree_index_t mask = octree_index_mask(oc_depth);
+    /* No index can share a node with ~0, this forces the first descent */
+    octree_index_t prev = ~(octree_index_t)0;
+    uint32_t shift = 0;
+    const leaf_t *leaves = NULL;
+    leaf_t leaf = 0;
+    int top = 0;
+
+    path[0] = node;
+
+    for (size_t i = 0; i < n; i++) {
+        octree_index_t index = indices[i] & mask;
+        octree_index_t diff = index ^ prev;
+
+        /* index is outside of the node found for the previous index */
+        if (diff >> shift) {
+            /* Deepest level on the previous path still containing index */
+            int k = oc_depth - 1 - _octree_index_log2(diff) / 3 - base;
+            node_t l_value;
+
+            if (k > top) k = top;
+            if (k < 0) k = 0;
+
+            l_value = node_read(path[k]);
+            while (k + base < oc_depth - 1 &&
+                   !l_value.is_full && l_value.childreen) {
+                uint32_t bit = (oc_depth - (k + base) - 1) * 3;
+
+                path[++k] = pool_childreen(pool, l_value.childreen) +
+                            ((index >> bit) & 0x7);
+                l_value = node_read(path[k]);
+            }
+            top = k;
+            shift = (oc_depth - (k + base)) * 3;
+
+            leaf = l_value.dom_leaf;
+            leaves = (l_value.is_full)
+                ? NULL
+                : pool_leaves(pool, l_value.leaves);
+        }
+        prev = index;
+
+        out[i] = (leaves) ? leaf_read(leaves, index & 0x7) : leaf;
+    }
+}
+
+
+OCTREE_DEF
+void leaf_get_neighbors(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[6])
+{
+    octree_index_t indices[6];
+    bool valid[6];
+
+    for (int i = 0; i < 6; i++) {
+        int delta[3] = {0, 0, 0};
+
+        delta[i >> 1] = (i & 1) ? 1 : -1;
+        /* Leaves past the border are looked up at index and replaced */
+        valid[i] = octree_index_add(index, delta, oc_depth, indices + i);
+        if (!valid[i]) indices[i] = index;
+    }
+    leaf_get_many(pool, node, indices, out, 6, oc_depth);
+    for (int i = 0; i < 6; i++) if (!valid[i]) out[i] = border;
+}
+
+
+OCTREE_DEF
+void leaf_get_neighborhood(
+        const node_pool_t *pool, node_t *node, octree_index_t index,
+        uint8_t oc_depth, leaf_t border, leaf_t out[27])
+{
+    /* Bits of index for each axis at offsets -1, 0 and 1 */
+    octree_index_t axis[3][3];
+    bool axis_valid[3][3];
+    octree_index_t indices[27];
+    bool valid[27];
+
+    for (int a = 0; a < 3; a++) {
+        const octree_index_t m =
+            (OCTREE_MORTON_X << a) & octree_index_mask(oc_depth);
+
+        for (int o = 0; o < 3; o++) {
+            int delta[3] = {0, 0, 0};
+            octree_index_t moved = index;
+
+            delta[a] = o - 1;
+            /* Leaves past the border are looked up at index and replaced */
+            axis_valid[a][o] = octree_index_add(index, delta, oc_depth, &moved);
+            axis[a][o] = moved & m;
+        }
+    }
+
+    for (int i = 0; i < 27; i++) {
+        const int x = i % 3, y = (i / 3) % 3, z = i / 9;
+
+        indices[i] = axis[0][x] | axis[1][y] | axis[2][z];
+        valid[i] = axis_valid[0][x] && axis_valid[1][y] && axis_valid[2][z];
+    }
+    leaf_get_many(pool, node, indices, out, 27, oc_depth);
+    for (int i = 0; i < 27; i++) if (!valid[i]) out[i] = border;
+}
+
+
+OCTREE_DEF
+void node_iter_init(
+        node_iter_t *it, const node_pool_t *pool, node_t *node,
+        uint8_t oc_depth, uint8_t max_level)
+{
+    it->pool = pool;
+    it->path[0] = node;
+    it->index = 0;
+    it->end = (octree_index_t)1 << ((oc_depth - node_read(node).level) * 3);
+    it->prev = ~(octree_index_t)0;
+    it->oc_depth = oc_depth;
+    it->max_level = max_level;
+    it->top = 0;
+}
+
+
+OCTREE_DEF
+bool node_iter_next(node_iter_t *it, octree_run_t *run)
+{
+    const uint8_t oc_depth = it->oc_depth;
+    const uint8_t base = node_read(it->path[0]).level;
+    const octree_index_t index = it->index;
+    node_t l_value;
+    uint8_t level;
+    int k = it->top;
+
+    if (index >= it->end) return false;
+
+    if (it->prev != ~(octree_index_t)0) {
+        /* Deepest level on the previous path still containing index */
+        int shared =
+            oc_depth - 1 - _octree_index_log2(index ^ it->prev) / 3 - base;
+
+        if (shared < k) k = shared;
+        if (k < 0) k = 0;
+    }
+
+    l_value = node_read(it->path[k]);
+    level = base + k;
+    while (level < it->max_level && level < oc_depth - 1 &&
+           !l_value.is_full && l_value.childreen) {
+        uint32_t bit = (oc_depth - level - 1) * 3;
+
+        it->path[++k] = pool_childreen(it->pool, l_value.childreen) +
+                        ((index >> bit) & 0x7);
+        l_value = node_read(it->path[k]);
+        level++;
+    }
+
+    run->start = index;
+    if (l_value.is_full || level >= it->max_level) {
+        /* The node may have been filled by a writer after part of it was
+         * returned, the run ends with it */
+        const octree_index_t size =
+            (octree_index_t)1 << ((oc_depth - level) * 3);
+
+        run->span = size - (index & (size - 1));
+        run->leaf = l_value.dom_leaf;
+        run->level = level;
+    }
+    else {
+        run->span = 1;
+        run->leaf = leaf_read(
+                pool_leaves(it->pool, l_value.leaves), index & 0x7);
+        run->level = oc_depth;
+    }
+
+    it->top = (uint8_t)k;
+    it->prev = index;
+    it->index = index + run->span;
+
+    return true;
+}
+
+
+OCTREE_DEF
+int node_visit(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        uint8_t max_level, octree_visit_fn fn, void *data)
+{
+    node_iter_t it;
+    octree_run_t run;
+
+    node_iter_init(&it, pool, node, oc_depth, max_level);
+    while (node_iter_next(&it, &run)) {
+        int ret = fn(&run, data);
+
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+
+static bool leaf_match(octree_leaf_fn fn, void *data, leaf_t leaf)
+{
+    return (fn) ? fn(leaf, data) : leaf != 0;
+}
+
+
+/* Region walked by a query, the box [min, max) or the planes when planes
+ * isn't NULL */
+typedef struct
+{
+    const node_pool_t *pool;
+    const int *min;
+    const int *max;
+    const float (*planes)[4];
+    int n_planes;
+    uint8_t oc_depth;
+    octree_leaf_fn match;
+    octree_visit_fn fn;
+    void *data;
+} query_t;
+
+
+/* Returns false if the cube of side size at origin is outside of the
+ * region. Otherwise clears the bits of mask for the planes(or the box) the
+ * cube is inside of, its childreen don't need to be tested against them */
+static bool query_overlap(
+        const query_t *q, const int origin[3], int size, uint32_t *mask)
+{
+    if (q->planes == NULL) {
+        bool inside = true;
+
+        for (int a = 0; a < 3; a++) {
+            if (q->max[a] <= origin[a] || q->min[a] >= origin[a] + size)
+                return false;
+
+            inside &= (q->min[a] <= origin[a] && origin[a] + size <= q->max[a]);
+        }
+        if (inside) *mask = 0;
+        return true;
+    }
+
+    for (int i = 0; i < q->n_planes; i++) {
+        const float *p = q->planes[i];
+        float lo = p[3], hi = p[3];
+
+        if (!((*mask >> i) & 1)) continue;
+
+        /* Smallest and biggest value of the plane over the cube */
+        for (int a = 0; a < 3; a++) {
+            const float near = p[a] * (float)origin[a],
+                        far = p[a] * (float)(origin[a] + size);
+
+            lo += (p[a] > 0) ? near : far;
+            hi += (p[a] > 0) ? far : near;
+        }
+        if (hi < 0) return false;
+        if (lo >= 0) *mask &= ~(1u << i);
+    }
+    return true;
+}
+
+
+static int query_node(
+        const query_t *q, node_t *node, const int origin[3],
+        octree_index_t start, uint32_t mask)
+{
+    const node_t l_value = node_read(node);
+    const uint8_t oc_depth = q->oc_depth, level = l_value.level;
+    const int size = 1 << (oc_depth - level);
+
+    if (mask && !query_overlap(q, origin, size, &mask)) return 0;
+
+    if (l_value.is_full) {
+        octree_run_t run = {
+            start, (octree_index_t)1 << ((oc_depth - level) * 3),
+            l_value.dom_leaf, level
+        };
+
+        if (!leaf_match(q->match, q->data, run.leaf)) return 0;
+        return q->fn(&run, q->data);
+    }
+
+    if (level == oc_depth - 1) {
+        const leaf_t *leaves = pool_leaves(q->pool, l_value.leaves);
+
+        for (int i = 0; i < 8; i++) {
+            const int pos[3] = {
+                origin[0] + (i & 1),
+                origin[1] + ((i >> 1) & 1),
+                origin[2] + ((i >> 2) & 1)
+            };
+            octree_run_t run = {start + i, 1, leaf_read(leaves, i), oc_depth};
+            uint32_t l_mask = mask;
+            int ret;
+
+            if (l_mask && !query_overlap(q, pos, 1, &l_mask)) continue;
+            if (!leaf_match(q->match, q->data, run.leaf)) continue;
+
+            ret = q->fn(&run, q->data);
+            if (ret) return ret;
+        }
+    }
+    else {
+        node_t *childreen = pool_childreen(q->pool, l_value.childreen);
+        const int half = size >> 1,
+                  shift = (oc_depth - level - 1) * 3;
+
+        for (int i = 0; i < 8; i++) {
+            const int c_origin[3] = {
+                origin[0] + (i & 1) * half,
+                origin[1] + ((i >> 1) & 1) * half,
+                origin[2] + ((i >> 2) & 1) * half
+            };
+            int ret = query_node(
+                    q, childreen + i, c_origin,
+                    start + ((octree_index_t)i << shift), mask);
+
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+
+OCTREE_DEF
+int node_query_box(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const int min[3], const int max[3], uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const query_t q = {pool, min, max, NULL, 0, oc_depth, match, fn, data};
+
+    /* An empty box overlaps nothing, even the nodes around min */
+    for (int a = 0; a < 3; a++) {
+        if (max[a] <= min[a]) return 0;
+    }
+    return query_node(&q, node, origin, 0, 1);
+}
+
+
+OCTREE_DEF
+int node_query_planes(
+        const node_pool_t *pool, node_t *node, const int origin[3],
+        const float planes[][4], int n, uint8_t oc_depth,
+        octree_leaf_fn match, octree_visit_fn fn, void *data)
+{
+    const query_t q = {pool, NULL, NULL, planes, n, oc_depth, match, fn, data};
+
+    if (n < 0 || n > 32) return 0;
+
+    return query_node(&q, node, origin, 0, (n < 32) ? (1u << n) - 1 : ~0u);
+}
+
+
+/* Row of merged faces, row being its position along the plane's second
+ * axis. quad is the quad it went into */
+typedef struct
+{
+    int row;
+    int min;
+    int max;
+    leaf_t leaf;
+    size_t quad;
+} mesh_span_t;
+
+
+typedef struct
+{
+    const node_pool_t *pool;
+    uint8_t oc_depth;
+    octree_leaf_fn match;
+    void *data;
+    octree_mesh_t *mesh;
+} mesh_t;
+
+
+/* A node, or a single leaf when uniform. Full nodes are uniform too and
+ * stand for their own childreen. outside is the space around the root */
+typedef struct
+{
+    node_t value;
+    leaf_t leaf;
+    bool uniform;
+    bool outside;
+} mesh_cell_t;
+
+
+/* buff with room for n items, NULL if it couldn't be grown */
+static void *mesh_grow(void *buff, size_t *max, size_t n, size_t size)
+{
+    size_t l_max = (*max) ? *max : 64;
+
+    if (n <= *max) return buff;
+
+    while (l_max < n) l_max *= 2;
+    buff = realloc(buff, l_max * size);
+    if (buff) *max = l_max;
+    return buff;
+}
+
+
+static mesh_cell_t mesh_cell(node_t *node)
+{
+    const node_t l_value = node_read(node);
+    const mesh_cell_t cell = {
+        l_value, l_value.dom_leaf, l_value.is_full, false
+    };
+
+    return cell;
+}
+
+
+static mesh_cell_t mesh_child(const mesh_t *m, const mesh_cell_t *cell, int i)
+{
+    mesh_cell_t child = *cell;
+
+    if (cell->uniform) return child;
+
+    if (cell->value.level == m->oc_depth - 1) {
+        child.leaf = leaf_read(pool_leaves(m->pool, cell->value.leaves), i);
+        child.uniform = true;
+        return child;
+    }
+    return mesh_cell(pool_childreen(m->pool, cell->value.childreen) + i);
+}
+
+
+/* Add the face of leaf facing face on the square of side size at lo, lo
+ * being on the plane */
+static bool mesh_emit(
+        octree_mesh_t *mesh, uint8_t face, const int lo[3], int size,
+        leaf_t leaf)
+{
+    octree_quad_t *faces = (octree_quad_t *)mesh_grow(
+            mesh->faces, &mesh->max_faces, mesh->n_faces + 1,
+            sizeof(octree_quad_t));
+    octree_quad_t *quad;
+
+    if (faces == NULL) return false;
+
+    mesh->faces = faces;
+    quad = faces + mesh->n_faces++;
+    for (int a = 0; a < 3; a++) {
+        quad->min[a] = lo[a];
+        quad->max[a] = lo[a] + ((a == face >> 1) ? 0 : size);
+    }
+    quad->leaf = leaf;
+    quad->face = face;
+    return true;
+}
+
+
+/* Faces between low and high, cells of side size on each side of the
+ * square at origin, low below it along axis. Both are walked down together
+ * until they're uniform */
+static bool mesh_face(
+        const mesh_t *m, const mesh_cell_t *low, const mesh_cell_t *high,
+        int axis, const int origin[3], int size)
+{
+    const int half = size >> 1;
+
+    if (low->uniform && high->uniform) {
+        const bool differ = low->outside || high->outside ||
+                            low->leaf != high->leaf;
+
+        if (!differ) return true;
+        if (!low->outside && leaf_match(m->match, m->data, low->leaf) &&
+            !mesh_emit(m->mesh, axis * 2 + 1, origin, size, low->leaf))
+            return false;
+        if (!high->outside && leaf_match(m->match, m->data, high->leaf) &&
+            !mesh_emit(m->mesh, axis * 2, origin, size, high->leaf))
+            return false;
+        return true;
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const int u = (axis + 1) % 3, v = (axis + 2) % 3,
+                  i = ((j & 1) << u) | ((j >> 1) << v);
+        const mesh_cell_t c_low = mesh_child(m, low, i | (1 << axis)),
+                          c_high = mesh_child(m, high, i);
+        int c_origin[3];
+
+        memcpy(c_origin, origin, sizeof(c_origin));
+        c_origin[u] += (j & 1) * half;
+        c_origin[v] += (j >> 1) * half;
+        if (!mesh_face(m, &c_low, &c_high, axis, c_origin, half))
+            return false;
+    }
+    return true;
+}
+
+
+/* Faces inside cell, of side size at origin: those inside each child and
+ * those between them */
+static bool mesh_node(
+        const mesh_t *m, const mesh_cell_t *cell, const int origin[3],
+        int size)
+{
+    const int half = size >> 1;
+    mesh_cell_t childreen[8];
+
+    if (cell->uniform) return true;
+
+    for (int i = 0; i < 8; i++) {
+        const int c_origin[3] = {
+            origin[0] + (i & 1) * half,
+            origin[1] + ((i >> 1) & 1) * half,
+            origin[2] + ((i >> 2) & 1) * half
+        };
+
+        childreen[i] = mesh_child(m, cell, i);
+        if (!mesh_node(m, childreen + i, c_origin, half)) return false;
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        for (int i = 0; i < 8; i++) {
+            int c_origin[3];
+
+            if ((i >> axis) & 1) continue;
+
+            for (int a = 0; a < 3; a++)
+                c_origin[a] = origin[a] + ((i >> a) & 1) * half;
+            c_origin[axis] += half;
+            if (!mesh_face(m, childreen + i, childreen + (i | (1 << axis)),
+                           axis, c_origin, half))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+/* Sort keys, coordinates take bits bits */
+typedef uint64_t (*mesh_key_fn)(const void *item, int bits);
+
+
+static uint64_t mesh_face_key(const void *item, int bits)
+{
+    const octree_quad_t *face = (const octree_quad_t *)item;
+
+    return ((uint64_t)face->face << bits) |
+           (uint32_t)face->min[face->face >> 1];
+}
+
+
+static uint64_t mesh_span_key(const void *item, int bits)
+{
+    const mesh_span_t *span = (const mesh_span_t *)item;
+
+    return ((uint64_t)(uint32_t)span->row << bits) | (uint32_t)span->min;
+}
+
+
+/* Stable radix sort of n items on the low key_bits bits of their key, a
+ * byte at a time. Bytes that are the same for every item are skipped */
+static bool mesh_sort(
+        octree_mesh_t *mesh, void *items, size_t n, size_t size,
+        mesh_key_fn key, int bits, int key_bits)
+{
+    char *from = (char *)items, *to;
+
+    if (n < 2) return true;
+
+    to = (char *)mesh_grow(mesh->sort, &mesh->max_sort, n * size, 1);
+    if (to == NULL) return false;
+    mesh->sort = to;
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        size_t count[256] = {0}, at = 0;
+        char *swap;
+
+        for (size_t i = 0; i < n; i++)
+            count[(key(from + i * size, bits) >> shift) & 0xff]++;
+        if (count[(key(from, bits) >> shift) & 0xff] == n) continue;
+
+        for (int d = 0; d < 256; d++) {
+            const size_t c = count[d];
+
+            count[d] = at;
+            at += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            const char *item = from + i * size;
+
+            memcpy(to + count[(key(item, bits) >> shift) & 0xff]++ * size,
+                   item, size);
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != (char *)items) memcpy(items, from, n * size);
+    return true;
+}
+
+
+/* Merge the faces of one plane, faces[0..n). They're cut in rows as high as
+ * the finest alignment among them, touching pieces of a row are joined and
+ * runs with the same extent in consecutive rows stacked into one quad */
+static bool mesh_merge_plane(
+        octree_mesh_t *mesh, const octree_quad_t *faces, size_t n, int bits)
+{
+    const uint8_t face = faces[0].face;
+    const int axis = face >> 1, u = (axis + 1) % 3, v = (axis + 2) % 3;
+    size_t n_spans = 0, k = 0, prev = 0, prev_end = 0;
+    mesh_span_t *spans;
+    unsigned used = 0;
+    int step;
+
+    for (size_t i = 0; i < n; i++) {
+        used |= (unsigned)(faces[i].min[u] | faces[i].max[u] |
+                           faces[i].min[v] | faces[i].max[v]);
+    }
+    step = (int)(used & (~used + 1));
+    for (size_t i = 0; i < n; i++)
+        n_spans += (size_t)((faces[i].max[v] - faces[i].min[v]) / step);
+
+    spans = (mesh_span_t *)mesh_grow(
+            mesh->spans, &mesh->max_spans, n_spans, sizeof(mesh_span_t));
+    if (spans == NULL) return false;
+    mesh->spans = spans;
+
+    n_spans = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (int row = faces[i].min[v]; row < faces[i].max[v]; row += step) {
+            mesh_span_t *span = spans + n_spans++;
+
+            span->row = row;
+            span->min = faces[i].min[u];
+            span->max = faces[i].max[u];
+            span->leaf = faces[i].leaf;
+        }
+    }
+    if (!mesh_sort(mesh, spans, n_spans, sizeof(mesh_span_t),
+                   mesh_span_key, bits, bits * 2))
+        return false;
+
+    for (size_t i = 0; i < n_spans; i++) {
+        if (k && spans[k - 1].row == spans[i].row &&
+            spans[k - 1].max == spans[i].min &&
+            spans[k - 1].leaf == spans[i].leaf)
+            spans[k - 1].max = spans[i].max;
+        else
+            spans[k++] = spans[i];
+    }
+
+    for (size_t row = 0, end; row < k; row = end) {
+        const bool stack =
+            prev_end > prev && spans[prev].row + step == spans[row].row;
+        size_t p = prev;
+
+        for (end = row; end < k && spans[end].row == spans[row].row; end++) {
+            mesh_span_t *span = spans + end;
+            octree_quad_t *quads;
+
+            while (stack && p < prev_end && spans[p].min < span->min) p++;
+            if (stack && p < prev_end && spans[p].min == span->min &&
+                spans[p].max == span->max && spans[p].leaf == span->leaf) {
+                span->quad = spans[p].quad;
+                mesh->quads[span->quad].max[v] += step;
+                continue;
+            }
+
+            quads = (octree_quad_t *)mesh_grow(
+                    mesh->quads, &mesh->max_quads, mesh->n_quads + 1,
+                    sizeof(octree_quad_t));
+            if (quads == NULL) return false;
+            mesh->quads = quads;
+
+            span->quad = mesh->n_quads++;
+            quads += span->quad;
+            quads->min[axis] = quads->max[axis] = faces[0].min[axis];
+            quads->min[u] = span->min;
+            quads->max[u] = span->max;
+            quads->min[v] = span->row;
+            quads->max[v] = span->row + step;
+            quads->leaf = span->leaf;
+            quads->face = face;
+        }
+        prev = row;
+        prev_end = end;
+    }
+    return true;
+}
+
+
+OCTREE_DEF
+int node_mesh(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_leaf_fn match, void *data, octree_mesh_t *mesh)
+{
+    const mesh_t m = {pool, oc_depth, match, data, mesh};
+    const mesh_cell_t root = mesh_cell(node),
+                      outside = {root.value, 0, true, true};
+    const int size = 1 << (oc_depth - root.value.level),
+              bits = oc_depth + 1;
+
+    mesh->n_quads = mesh->n_faces = 0;
+    if (!mesh_node(&m, &root, (const int[3]){0, 0, 0}, size)) return 0;
+
+    /* The sides of the node */
+    for (int axis = 0; axis < 3; axis++) {
+        int origin[3] = {0, 0, 0};
+
+        if (!mesh_face(&m, &outside, &root, axis, origin, size)) return 0;
+
+        origin[axis] = size;
+        if (!mesh_face(&m, &root, &outside, axis, origin, size)) return 0;
+    }
+    if (mesh->n_faces == 0) return 1;
+
+    /* Group the faces by plane */
+    if (!mesh_sort(mesh, mesh->faces, mesh->n_faces, sizeof(octree_quad_t),
+                   mesh_face_key, bits, bits + 3))
+        return 0;
+
+    for (size_t i = 0, end; i < mesh->n_faces; i = end) {
+        const uint64_t key = mesh_face_key(mesh->faces + i, bits);
+
+        for (end = i + 1; end < mesh->n_faces &&
+             mesh_face_key(mesh->faces + end, bits) == key; end++);
+
+        if (!mesh_merge_plane(mesh, mesh->faces + i, end - i, bits)) return 0;
+    }
+    return 1;
+}
+
+
+OCTREE_DEF
+void octree_mesh_free(octree_mesh_t *mesh)
+{
+    free(mesh->quads);
+    free(mesh->faces);
+    free(mesh->spans);
+    free(mesh->sort);
+    memset(mesh, 0, sizeof(octree_mesh_t));
+}
+
+
+/* Nodes on the path to the last position a ray looked up. path[k] is at
+ * level base + k */
+typedef struct
+{
+    const node_pool_t *pool;
+    node_t *path[OCTREE_MAX_DEPTH];
+    int prev[3];
+    int top;
+    uint8_t base;
+    uint8_t oc_depth;
+} ray_path_t;
+
+
+static void ray_path_init(
+        ray_path_t *rp, const node_pool_t *pool, node_t *node,
+        uint8_t oc_depth)
+{
+    rp->pool = pool;
+    rp->path[0] = node;
+    /* No position shares a node with -1, this forces the first descent */
+    rp->prev[0] = rp->prev[1] = rp->prev[2] = -1;
+    rp->top = 0;
+    rp->base = node_read(node).level;
+    rp->oc_depth = oc_depth;
+}
+
+
+/* Leaf at pos. size is set to the width of the cube of leaves sharing it,
+ * 1 unless it comes from a full node */
+static leaf_t ray_lookup(ray_path_t *rp, const int pos[3], int *size)
+{
+    const int base = rp->base, oc_depth = rp->oc_depth;
+    const uint32_t diff = (uint32_t)((pos[0] ^ rp->prev[0]) |
+                                     (pos[1] ^ rp->prev[1]) |
+                                     (pos[2] ^ rp->prev[2]));
+    node_t l_value;
+    int k = rp->top;
+
+    if (diff) {
+        /* Deepest level on the previous path still containing pos */
+        int shared = oc_depth - 1 - _octree_log2(diff) - base;
+
+        if (shared < k) k = shared;
+        if (k < 0) k = 0;
+    }
+
+    l_value = node_read(rp->path[k]);
+    while (k + base < oc_depth - 1 && !l_value.is_full && l_value.childreen) {
+        const int bit = oc_depth - (k + base) - 1;
+
+        rp->path[++k] = pool_childreen(rp->pool, l_value.childreen) +
+                        (((pos[0] >> bit) & 1) |
+                         ((pos[1] >> bit) & 1) << 1 |
+                         ((pos[2] >> bit) & 1) << 2);
+        l_value = node_read(rp->path[k]);
+    }
+    rp->top = k;
+    memcpy(rp->prev, pos, sizeof(rp->prev));
+
+    if (l_value.is_full) {
+        *size = 1 << (oc_depth - (k + base));
+        return l_value.dom_leaf;
+    }
+    *size = 1;
+    return leaf_read(pool_leaves(rp->pool, l_value.leaves),
+                     (pos[0] & 1) | (pos[1] & 1) << 1 | (pos[2] & 1) << 2);
+}
+
+
+/* floor(x) clamped to [lo, hi], lo >= 0 */
+static int ray_floor(double x, int lo, int hi)
+{
+    if (x <= lo) return lo;
+    if (x >= hi) return hi;
+    return (int)x;
+}
+
+
+/* Walk the ray one node at a time. Each step leaves the cube covered by the
+ * current node through its nearest face and looks up the node past it.
+ * Positions are kept as integers and only move in the direction of the ray,
+ * so rounding can't send it back or make it loop */
+static int ray_cast(
+        ray_path_t *rp, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hit)
+{
+    const int side = 1 << (rp->oc_depth - rp->base);
+    double o[3], inv[3], t = 0, t_end = max_dist;
+    int pos[3], normal[3] = {0, 0, 0}, entry = -1;
+
+    /* Clip the ray to the node's cube */
+    for (int a = 0; a < 3; a++) {
+        double t0, t1;
+
+        o[a] = origin[a];
+        inv[a] = 0;
+        if (dir[a] == 0) {
+            if (o[a] < 0 || o[a] >= side) return 0;
+            continue;
+        }
+        inv[a] = 1.0 / dir[a];
+        t0 = (0 - o[a]) * inv[a];
+        t1 = (side - o[a]) * inv[a];
+        if (t0 > t1) {
+            double tmp = t0;
+
+            t0 = t1;
+            t1 = tmp;
+        }
+        if (t0 > t) {
+            t = t0;
+            entry = a;
+        }
+        if (t1 < t_end) t_end = t1;
+    }
+    if (t > t_end) return 0;
+
+    for (int a = 0; a < 3; a++) {
+        if (a == entry) {
+            pos[a] = (dir[a] > 0) ? 0 : side - 1;
+            normal[a] = (dir[a] > 0) ? -1 : 1;
+        }
+        else {
+            pos[a] = ray_floor(o[a] + t * dir[a], 0, side - 1);
+        }
+    }
+
+    for (;;) {
+        double t_exit = t_end;
+        int size, axis = -1, lo[3];
+        leaf_t leaf = ray_lookup(rp, pos, &size);
+
+        if (leaf_match(fn, data, leaf)) {
+            hit->index = octree_pos_to_index(pos, rp->oc_depth - rp->base);
+            memcpy(hit->pos, pos, sizeof(hit->pos));
+            memcpy(hit->normal, normal, sizeof(hit->normal));
+            hit->distance = (float)t;
+            hit->leaf = leaf;
+            return 1;
+        }
+
+        for (int a = 0; a < 3; a++) {
+            double ta;
+
+            lo[a] = pos[a] & ~(size - 1);
+            if (dir[a] == 0) continue;
+
+            ta = (((dir[a] > 0) ? lo[a] + size : lo[a]) - o[a]) * inv[a];
+            if (ta <= t_exit) {
+                t_exit = ta;
+                axis = a;
+            }
+        }
+        /* The ray ends inside this node */
+        if (axis < 0) return 0;
+        if (t_exit > t) t = t_exit;
+
+        for (int a = 0; a < 3; a++) {
+            int p;
+
+            normal[a] = 0;
+            if (a == axis || dir[a] == 0) continue;
+
+            p = ray_floor(o[a] + t * dir[a], lo[a], lo[a] + size - 1);
+            if ((dir[a] > 0) ? p > pos[a] : p < pos[a]) pos[a] = p;
+        }
+        pos[axis] = (dir[axis] > 0) ? lo[axis] + size : lo[axis] - 1;
+        normal[axis] = (dir[axis] > 0) ? -1 : 1;
+        if (pos[axis] < 0 || pos[axis] >= side) return 0;
+    }
+}
+
+
+OCTREE_DEF
+int node_raycast(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origin[3], const float dir[3], float max_dist,
+        octree_leaf_fn fn, void *data, octree_hit_t *hit)
+{
+    ray_path_t rp;
+
+    ray_path_init(&rp, pool, node, oc_depth);
+    if (ray_cast(&rp, origin, dir, max_dist, fn, data, hit)) return 1;
+
+    hit->distance = -1;
+    return 0;
+}
+
+
+OCTREE_DEF
+size_t node_raycast_n(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const float origins[][3], const float dirs[][3], size_t n,
+        float max_dist, octree_leaf_fn fn, void *data, octree_hit_t *hits)
+{
+    ray_path_t rp;
+    size_t count = 0;
+
+    ray_path_init(&rp, pool, node, oc_depth);
+    for (size_t i = 0; i < n; i++) {
+        if (ray_cast(&rp, origins[i], dirs[i], max_dist, fn, data, hits + i))
+            count++;
+        else
+            hits[i].distance = -1;
+    }
+    return count;
+}
+
+
+OCTREE_DEF
+size_t node_save_size(node_pool_t *pool, node_t *node, uint8_t oc_depth)
+{
+    size_t size = sizeof(simple_node_t);
+
+    if (node->is_full) return size;
+
+    if (node->level == oc_depth - 1) return size + sizeof(leaf_t [8]);
+
+    for (int i = 0; i < 8; i++) {
+        size += node_save_size(
+                pool, pool_childreen(pool, node->childreen) + i, oc_depth);
+    }
+    return size;
+}
+
+
+OCTREE_DEF
+void node_stats(
+        const node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stats_t *stats)
+{
+    const node_t l_value = node_read(node);
+    const uint8_t level = l_value.level;
+
+    stats->nodes[level]++;
+    stats->n_nodes++;
+    stats->save_size += sizeof(simple_node_t);
+    if (l_value.dom_leaf < OCTREE_STATS_LEAVES)
+        stats->dom_leaves[l_value.dom_leaf]++;
+    else
+        stats->dom_leaves_other++;
+
+    if (l_value.is_full) {
+        stats->full[level]++;
+        stats->n_full++;
+        return;
+    }
+    stats->split[level]++;
+    stats->n_split++;
+
+    if (level == oc_depth - 1) {
+        stats->leaf_blocks++;
+        stats->save_size += sizeof(leaf_t [8]);
+        return;
+    }
+
+    stats->childreen_blocks++;
+    for (int i = 0; i < 8; i++) {
+        node_stats(pool, pool_childreen(pool, l_value.childreen) + i,
+                   oc_depth, stats);
+    }
+}
+
+
+/* Destination of node_save, either a caller buffer or a stream flushed
+ * whenever buff fills up. A NULL buff only counts the bytes */
+typedef struct
+{
+    char *buff;
+    size_t size;
+    size_t ofs;
+    uint64_t total;
+    octree_stream_t *stream;
+} save_sink_t;
+
+
+/* Blocks set aside for a subtree loaded on its own thread. They're handed
+ * out in order so the thread never touches the pool's free lists */
+typedef struct
+{
+    uint32_t childreen;
+    uint32_t end_childreen;
+    uint32_t leaves;
+    uint32_t end_leaves;
+} load_range_t;
+
+
+/* Source of node_load. Streams refill buff once it has been consumed */
+typedef struct
+{
+    const char *buff;
+    size_t size;
+    size_t ofs;
+    uint64_t total;
+    octree_stream_t *stream;
+    char *local;
+    size_t cap;
+    load_range_t *range;
+} load_source_t;
+
+
+static bool sink_flush(save_sink_t *sink)
+{
+    if (sink->stream == NULL) return sink->ofs == 0;
+
+    if (sink->ofs &&
+        sink->stream->write(
+            sink->stream->user, sink->buff, sink->ofs) != sink->ofs) {
+        return false;
+    }
+    sink->ofs = 0;
+    return true;
+}
+
+
+static bool sink_write(save_sink_t *sink, const void *data, size_t n)
+{
+    if (sink->size - sink->ofs < n) {
+        if (sink->stream == NULL || !sink_flush(sink)) return false;
+    }
+    if (sink->buff) memcpy(sink->buff + sink->ofs, data, n);
+    sink->ofs += n;
+    sink->total += n;
+    return true;
+}
+
+
+static bool source_read(load_source_t *src, void *data, size_t n)
+{
+    char *dst = (char *)data;
+
+    while (n) {
+        size_t take;
+
+        if (src->ofs == src->size) {
+            if (src->stream == NULL) return false;
+
+            src->size = src->stream->read(
+                    src->stream->user, src->local, src->cap);
+            src->buff = src->local;
+            src->ofs = 0;
+
+            if (src->size == 0) return false;
+        }
+        take = src->size - src->ofs;
+        if (take > n) take = n;
+
+        memcpy(dst, src->buff + src->ofs, take);
+        src->ofs += take;
+        src->total += take;
+        dst += take;
+        n -= take;
+    }
+    return true;
+}
+
+
+static simple_node_t simple_node(const node_t *node)
+{
+    simple_node_t snode;
+
+    /* Keep the padding bytes deterministic */
+    memset(&snode, 0, sizeof(snode));
+    snode.is_full = node->is_full;
+    snode.is_original = node->is_original;
+    snode.level = node->level;
+    snode.dom_leaf = node->dom_leaf;
+    return snode;
+}
+
+
+static bool node_save(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, save_sink_t *sink)
+{
+    node_t *cnode = node;
+    octree_index_t i = 0,
+                   max_i = (octree_index_t)1 << ((oc_depth - node->level) * 3);
+
+    while (i < max_i) {
+        simple_node_t snode = simple_node(cnode);
+        bool is_last, is_full;
+        uint8_t depth, levels;
+        octree_index_t increment, prev_i = i;
+        uint32_t nl;
+
+        is_last = (snode.level == oc_depth - 1);
+        is_full = snode.is_full;
+        depth = oc_depth - snode.level;
+        levels = depth - (!(is_full || is_last));
+        increment = (octree_index_t)(is_full || is_last) << (levels * 3);
+
+        if (!sink_write(sink, &snode, sizeof(snode))) return false;
+
+        if (!is_full && is_last) {
+            if (!sink_write(sink, pool_leaves(pool, cnode->leaves),
+                            sizeof(leaf_t [8]))) return false;
+        }
+        i+= increment;
+
+        if (i >= max_i) break;
+
+        /* Next level to write */
+        if (increment == 0) {
+            nl = snode.level + 1;
+        }
+        else {
+            octree_index_t diff = i ^ prev_i;
+            nl = 1;
+            for (; nl < snode.level; nl++)
+                if ((diff >> ((oc_depth - nl) * 3)) & 0x7) break;
+        }
+        cnode = node_get_nearest(pool, node, i, nl, oc_depth);
+    }
+    return true;
+}
+
+
+static uint32_t load_alloc_childreen(
+        node_pool_t *pool, load_source_t *src)
+{
+    load_range_t *range = src->range;
+
+    if (range == NULL) return pool_alloc_childreen(pool);
+
+    return (range->childreen < range->end_childreen) ? range->childreen++ : 0;
+}
+
+
+static uint32_t load_alloc_leaves(node_pool_t *pool, load_source_t *src)
+{
+    load_range_t *range = src->range;
+
+    if (range == NULL) return pool_alloc_leaves(pool);
+
+    return (range->leaves < range->end_leaves) ? range->leaves++ : 0;
+}
+
+
+static bool node_load(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, load_source_t *src)
+{
+    /* Nodes from node down to the current one, indexed by level */
+    node_t *path[OCTREE_MAX_DEPTH + 1];
+    node_t *cnode = node;
+    const uint8_t base = node->level;
+    octree_index_t i = 0,
+                   max_i = (octree_index_t)1 << ((oc_depth - base) * 3);
+
+    /* Whatever was in node before is replaced */
+    node_clear(pool, node, oc_depth, 0);
+    path[base] = node;
+
+    while (i < max_i) {
+        simple_node_t snode;
+        octree_index_t increment;
+        uint32_t levels, depth;
+        uint8_t level;
+        bool is_last;
+
+        if (!source_read(src, &snode, sizeof(snode))) goto error;
+
+        /* Records must come in the order node_save_buffer writes them */
+        if (snode.level != cnode->level) goto error;
+
+        depth = oc_depth - snode.level;
+        is_last = (snode.level == oc_depth - 1);
+        levels = depth - (!(snode.is_full || is_last));
+
+        cnode->is_full = true;
+        cnode->is_original = snode.is_original;
+        cnode->dom_leaf = snode.dom_leaf;
+
+        increment = (octree_index_t)(snode.is_full || is_last) << (levels * 3);
+
+        if (!snode.is_full) {
+            if (is_last) {
+                uint32_t leaves = load_alloc_leaves(pool, src);
+
+                if (leaves == 0) goto error;
+
+                cnode->leaves = leaves;
+                cnode->is_full = false;
+                if (!source_read(src, pool_leaves(pool, leaves),
+                                 sizeof(leaf_t [8]))) goto error;
+            }
+            else {
+                uint32_t childreen = load_alloc_childreen(pool, src);
+
+                if (childreen == 0) goto error;
+
+                node_attach_childreen(pool, cnode, childreen);
+            }
+        }
+        i += increment;
+        if (i >= max_i) break;
+
+        /* The next record is the first child of this node, or the sibling
+         * of the deepest node the index moved past */
+        level = (increment == 0) ? snode.level + 1 : snode.level;
+        while (increment && level > base + 1 &&
+               ((i >> ((oc_depth - level) * 3)) & 0x7) == 0) level--;
+
+        cnode = pool_childreen(pool, path[level - 1]->childreen) +
+                ((i >> ((oc_depth - level) * 3)) & 0x7);
+        path[level] = cnode;
+    }
+    return true;
+
+error:
+    /* A subtree loaded on its own thread is cleared by the caller */
+    if (src->range == NULL) node_clear(pool, node, oc_depth, 0);
+    return false;
+}
+
+
+OCTREE_DEF
+int node_save_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size)
+{
+    save_sink_t sink = {buff, size, 0, 0, NULL};
+
+    if (!node_save(pool, node, oc_depth, &sink)) return -1;
+
+    return (int)sink.total;
+}
+
+
+OCTREE_DEF
+int node_save_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, char *buff)
+{
+    return node_save_buffer_n(pool, node, oc_depth, buff, SIZE_MAX);
+}
+
+
+OCTREE_DEF
+int node_load_buffer_n(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size)
+{
+    load_source_t src = {buff, size, 0, 0, NULL, NULL, 0, NULL};
+
+    if (!node_load(pool, node, oc_depth, &src)) return -1;
+
+    return (int)src.total;
+}
+
+
+OCTREE_DEF
+int node_load_buffer(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, const char *buff)
+{
+    return node_load_buffer_n(pool, node, oc_depth, buff, SIZE_MAX);
+}
+
+
+/* Op codes of the diff format */
+enum
+{
+    DIFF_SAME = 0,
+    DIFF_REPLACE = 1,
+    DIFF_DESCEND = 2
+};
+
+
+typedef struct
+{
+    node_pool_t *from_pool;
+    node_pool_t *to_pool;
+    uint8_t oc_depth;
+    save_sink_t *sink;
+    /* DESCEND records of the nodes on the current path, indexed by level.
+     * They're only written once a node below them has changed, levels
+     * below written still need to be */
+    simple_node_t heads[OCTREE_MAX_DEPTH];
+    size_t mask_ofs[OCTREE_MAX_DEPTH];
+    uint8_t written;
+} diff_t;
+
+
+/* Write the DESCEND records held back for the nodes above level */
+static bool diff_flush(diff_t *d, uint8_t level)
+{
+    const uint8_t op = DIFF_DESCEND, mask = 0;
+
+    for (; d->written < level; d->written++) {
+        d->mask_ofs[d->written] = d->sink->ofs + 1 + sizeof(simple_node_t);
+
+        if (!sink_write(d->sink, &op, 1) ||
+            !sink_write(d->sink, d->heads + d->written,
+                        sizeof(simple_node_t)) ||
+            !sink_write(d->sink, &mask, 1)) return false;
+    }
+    return true;
+}
+
+
+/* Write the ops turning from into to. Returns 0 if they're identical, when
+ * nothing is written, 1 once the ops are written and -1 if they don't fit */
+static int diff_node(diff_t *d, const node_t *from, node_t *to)
+{
+    const bool same_node = (from->is_full == to->is_full &&
+                            from->dom_leaf == to->dom_leaf &&
+                            from->is_original == to->is_original);
+    const uint8_t op = DIFF_REPLACE;
+    const node_t *from_childreen;
+    node_t *to_childreen;
+    uint8_t mask = 0;
+
+    if (same_node) {
+        if (to->is_full) return 0;
+
+        /* Blocks shared by snapshots or dedup are identical below */
+        if (d->from_pool == d->to_pool && from->childreen == to->childreen) {
+            return 0;
+        }
+    }
+    if (from->is_full || to->is_full) goto replace;
+
+    if (to->level == d->oc_depth - 1) {
+        if (same_node &&
+            memcmp(pool_leaves(d->from_pool, from->leaves),
+                   pool_leaves(d->to_pool, to->leaves),
+                   sizeof(leaf_t [8])) == 0) return 0;
+        goto replace;
+    }
+
+    d->heads[to->level] = simple_node(to);
+
+    from_childreen = pool_childreen(d->from_pool, from->childreen);
+    to_childreen = pool_childreen(d->to_pool, to->childreen);
+    for (int i = 0; i < 8; i++) {
+        const int ret = diff_node(d, from_childreen + i, to_childreen + i);
+
+        if (ret < 0) return -1;
+        mask |= ret << i;
+    }
+
+    if (mask == 0 && same_node) return 0;
+
+    /* The record isn't written yet if only the node itself changed */
+    if (!diff_flush(d, to->level + 1)) return -1;
+
+    if (d->sink->buff) d->sink->buff[d->mask_ofs[to->level]] = (char)mask;
+    d->written = to->level;
+    return 1;
+
+replace:
+    if (!diff_flush(d, to->level) ||
+        !sink_write(d->sink, &op, 1) ||
+        !node_save(d->to_pool, to, d->oc_depth, d->sink)) return -1;
+    return 1;
+}
+
+
+OCTREE_DEF
+int64_t node_diff_save(
+        node_pool_t *from_pool, const node_t *from,
+        node_pool_t *to_pool, node_t *to, uint8_t oc_depth,
+        char *buff, size_t size)
+{
+    save_sink_t sink = {buff, buff ? size : SIZE_MAX, 0, 0, NULL};
+    diff_t d;
+    const uint8_t magic[6] = {
+        'O', 'C', 'T', 'P', OCTREE_DIFF_VERSION, oc_depth - to->level
+    };
+    const uint8_t same = DIFF_SAME;
+    int ret;
+
+    if (from->level != to->level) return -1;
+
+    d.from_pool = from_pool;
+    d.to_pool = to_pool;
+    d.oc_depth = oc_depth;
+    d.sink = &sink;
+    d.written = to->level;
+
+    if (!sink_write(&sink, magic, sizeof(magic))) return -1;
+
+    ret = diff_node(&d, from, to);
+    if (ret < 0 || (ret == 0 && !sink_write(&sink, &same, 1))) return -1;
+
+    return (int64_t)sink.total;
+}
+
+
+static bool diff_apply_node(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth, load_source_t *src)
+{
+    simple_node_t snode;
+    node_t *childreen;
+    uint8_t op, mask;
+
+    if (!source_read(src, &op, 1)) return false;
+
+    if (op == DIFF_REPLACE) return node_load(pool, node, oc_depth, src);
+
+    if (op != DIFF_DESCEND ||
+        !source_read(src, &snode, sizeof(snode)) ||
+        !source_read(src, &mask, 1) ||
+        snode.level != node->level || snode.is_full ||
+        node->level >= oc_depth - 1) return false;
+
+    if (node->is_full) {
+        if (!node_init_childreen(pool, node)) return false;
+    }
+    else if (pool->shared && !node_unshare(pool, node, oc_depth)) {
+        return false;
+    }
+    node->is_original = snode.is_original;
+    node->dom_leaf = snode.dom_leaf;
+
+    childreen = pool_childreen(pool, node->childreen);
+    for (int i = 0; i < 8; i++) {
+        if (!(mask & (1 << i))) continue;
+
+        if (!diff_apply_node(pool, childreen + i, oc_depth, src)) return false;
+    }
+    return true;
+}
+
+
+OCTREE_DEF
+int64_t node_diff_apply(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size)
+{
+    load_source_t src = {buff, size, 0, 0, NULL, NULL, 0, NULL};
+
+    if (size < 7 || memcmp(buff, "OCTP", 4) != 0 ||
+        buff[4] != OCTREE_DIFF_VERSION ||
+        (uint8_t)buff[5] != oc_depth - node->level) return -1;
+
+    src.ofs = src.total = 6;
+    if (buff[6] == DIFF_SAME) return 7;
+
+    if (!diff_apply_node(pool, node, oc_depth, &src)) return -1;
+
+    return (int64_t)src.total;
+}
+
+
+static size_t file_write(void *user, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE *)user);
+}
+
+
+static size_t file_read(void *user, void *data, size_t size)
+{
+    return fread(data, 1, size, (FILE *)user);
+}
+
+
+static int file_unread(void *user, size_t size)
+{
+    return fseek((FILE *)user, -(long)size, SEEK_CUR);
+}
+
+
+OCTREE_DEF
+octree_stream_t octree_stream_file(FILE *file)
+{
+    return (octree_stream_t) {file_write, file_read, file_unread, file};
+}
+
+
+#if defined(OCTREE_POSIX)
+static size_t fd_write(void *user, const void *data, size_t size)
+{
+    const int fd = (int)(intptr_t)user;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+
+static size_t fd_read(void *user, void *data, size_t size)
+{
+    ssize_t n = read((int)(intptr_t)user, data, size);
+
+    return (n < 0) ? 0 : (size_t)n;
+}
+
+
+static int fd_unread(void *user, size_t size)
+{
+    return (lseek((int)(intptr_t)user, -(long)size, SEEK_CUR) < 0) ? -1 : 0;
+}
+
+
+OCTREE_DEF
+octree_stream_t octree_stream_fd(int fd)
+{
+    return (octree_stream_t) {
+        fd_write, fd_read, fd_unread, (void *)(intptr_t)fd
+    };
+}
+#endif /* OCTREE_POSIX */
+
+
+OCTREE_DEF
+int64_t node_save_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream)
+{
+    char local[OCTREE_STREAM_BUFFER];
+    save_sink_t sink = {local, sizeof(local), 0, 0, stream};
+
+    if (!node_save(pool, node, oc_depth, &sink) || !sink_flush(&sink)) {
+        return -1;
+    }
+    return (int64_t)sink.total;
+}
+
+
+OCTREE_DEF
+int64_t node_load_stream(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        octree_stream_t *stream)
+{
+    char local[OCTREE_STREAM_BUFFER];
+    load_source_t src = {
+        local, 0, 0, 0, stream, local, sizeof(local), NULL
+    };
+
+    if (!node_load(pool, node, oc_depth, &src)) return -1;
+
+    /* Give back what was read past the octree */
+    if (src.size > src.ofs && stream->unread) {
+        stream->unread(stream->user, src.size - src.ofs);
+    }
+    return (int64_t)src.total;
+}
+
+
+/* Growable byte buffer used while encoding the compact format */
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t cap;
+} bytes_t;
+
+
+/* Maps leaf values to their index in the palette */
+typedef struct
+{
+    uint32_t *slots;
+    uint32_t mask;
+    leaf_t *leaves;
+    uint32_t count;
+    uint32_t cap;
+} palette_t;
+
+
+typedef struct
+{
+    const node_pool_t *pool;
+    uint8_t oc_depth;
+    bool ok;
+    bytes_t bits;
+    uint32_t n_bits;
+    uint32_t *values;
+    size_t n_values;
+    size_t cap_values;
+    palette_t palette;
+} compact_enc_t;
+
+
+typedef struct
+{
+    node_pool_t *pool;
+    uint8_t oc_depth;
+    const uint8_t *bits;
+    size_t n_bits;
+    size_t bit;
+    const uint8_t *runs;
+    size_t size;
+    size_t ofs;
+    uint64_t remaining;
+    bool literal;
+    uint32_t value;
+    uint64_t acc;
+    int acc_bits;
+    int value_bits;
+    const leaf_t *palette;
+    uint32_t palette_count;
+    /* Version 1 didn't store the dom_leaf of split nodes */
+    bool split_dom;
+} compact_dec_t;
+
+
+/* Runs shorter than this are bit-packed as literals */
+#define COMPACT_MIN_RUN 8
+
+
+static bool bytes_put(bytes_t *b, const void *data, size_t n)
+{
+    if (n == 0) return true;
+
+    if (b->cap - b->size < n) {
+        size_t cap = (b->cap) ? b->cap : 256;
+        uint8_t *new_data;
+
+        while (cap - b->size < n) cap *= 2;
+
+        new_data = (uint8_t *)realloc(b->data, cap);
+        if (new_data == NULL) return false;
+
+        b->data = new_data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->size, data, n);
+    b->size += n;
+    return true;
+}
+
+
+static bool bytes_put_varint(bytes_t *b, uint64_t x)
+{
+    uint8_t tmp[10];
+    size_t n = 0;
+
+    do {
+        tmp[n] = x & 0x7F;
+        x >>= 7;
+        if (x) tmp[n] |= 0x80;
+        n++;
+    } while (x);
+
+    return bytes_put(b, tmp, n);
+}
+
+
+static bool read_varint(
+        const uint8_t *buff, size_t size, size_t *ofs, uint64_t *x)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; *ofs < size && shift < 64; shift += 7) {
+        uint8_t c = buff[(*ofs)++];
+
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *x = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static uint32_t leaf_hash(leaf_t leaf)
+{
+    return (uint32_t)(((uint64_t)leaf * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+
+static int64_t palette_index(palette_t *p, leaf_t leaf)
+{
+    uint32_t slot;
+
+    /* Keep the table at most half full */
+    if (p->count * 2 >= p->mask) {
+        uint32_t mask = (p->mask) ? p->mask * 2 + 1 : 63;
+        uint32_t *slots = (uint32_t *)calloc(mask + 1, sizeof(uint32_t));
+
+        if (slots == NULL) return -1;
+
+        for (uint32_t i = 0; i < p->count; i++) {
+            slot = leaf_hash(p->leaves[i]) & mask;
+            while (slots[slot]) slot = (slot + 1) & mask;
+            slots[slot] = i + 1;
+        }
+        free(p->slots);
+        p->slots = slots;
+        p->mask = mask;
+    }
+
+    slot = leaf_hash(leaf) & p->mask;
+    for (; p->slots[slot]; slot = (slot + 1) & p->mask) {
+        if (p->leaves[p->slots[slot] - 1] == leaf) return p->slots[slot] - 1;
+    }
+
+    if (p->count == p->cap) {
+        uint32_t cap = (p->cap) ? p->cap * 2 : 16;
+        leaf_t *leaves = (leaf_t *)realloc(p->leaves, cap * sizeof(leaf_t));
+
+        if (leaves == NULL) return -1;
+
+        p->leaves = leaves;
+        p->cap = cap;
+    }
+    p->leaves[p->count] = leaf;
+    p->slots[slot] = ++p->count;
+
+    return p->count - 1;
+}
+
+
+static void compact_put_bit(compact_enc_t *enc, bool bit)
+{
+    if ((enc->n_bits & 0x7) == 0) {
+        uint8_t zero = 0;
+
+        enc->ok &= bytes_put(&enc->bits, &zero, 1);
+        if (!enc->ok) return;
+    }
+    enc->bits.data[enc->bits.size - 1] |= bit << (enc->n_bits & 0x7);
+    enc->n_bits++;
+}
+
+
+static void compact_put_value(compact_enc_t *enc, leaf_t leaf)
+{
+    int64_t index = palette_index(&enc->palette, leaf);
+
+    if (index < 0) {
+        enc->ok = false;
+        return;
+    }
+
+    if (enc->n_values == enc->cap_values) {
+        size_t cap = (enc->cap_values) ? enc->cap_values * 2 : 1024;
+        uint32_t *values =
+            (uint32_t *)realloc(enc->values, cap * sizeof(uint32_t));
+
+        if (values == NULL) {
+            enc->ok = false;
+            return;
+        }
+        enc->values = values;
+        enc->cap_values = cap;
+    }
+    enc->values[enc->n_values++] = (uint32_t)index;
+}
+
+
+static void compact_enc_node(compact_enc_t *enc, const node_t *node)
+{
+    if (!enc->ok) return;
+
+    compact_put_bit(enc, node->is_full);
+    compact_put_value(enc, node->dom_leaf);
+
+    if (node->is_full) return;
+
+    if (node->level == enc->oc_depth - 1) {
+        const leaf_t *leaves = pool_leaves(enc->pool, node->leaves);
+
+        for (int i = 0; i < 8; i++) compact_put_value(enc, leaves[i]);
+    }
+    else {
+        const node_t *childreen = pool_childreen(enc->pool, node->childreen);
+
+        for (int i = 0; i < 8; i++) compact_enc_node(enc, childreen + i);
+    }
+}
+
+
+static bool compact_put_runs(
+        bytes_t *out, const uint32_t *values, size_t n, int value_bits)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        size_t run = 1, end = i;
+        uint64_t acc = 0;
+        int acc_bits = 0;
+
+        while (i + run < n && values[i + run] == values[i]) run++;
+
+        if (run >= COMPACT_MIN_RUN) {
+            if (!bytes_put_varint(out, (uint64_t)run << 1) ||
+                !bytes_put_varint(out, values[i])) return false;
+            i += run;
+            continue;
+        }
+
+        /* Literal values up to the next long run */
+        while (end < n) {
+            size_t r = 1;
+
+            while (end + r < n && r < COMPACT_MIN_RUN &&
+                   values[end + r] == values[end]) r++;
+            if (r >= COMPACT_MIN_RUN) break;
+            end += r;
+        }
+
+        if (!bytes_put_varint(out, ((uint64_t)(end - i) << 1) | 1)) {
+            return false;
+        }
+        for (; i < end; i++) {
+            acc |= (uint64_t)values[i] << acc_bits;
+            acc_bits += value_bits;
+
+            while (acc_bits >= 8) {
+                uint8_t byte = acc & 0xFF;
+
+                if (!bytes_put(out, &byte, 1)) return false;
+                acc >>= 8;
+                acc_bits -= 8;
+            }
+        }
+        if (acc_bits > 0) {
+            uint8_t byte = acc & 0xFF;
+
+            if (!bytes_put(out, &byte, 1)) return false;
+        }
+    }
+    return true;
+}
+
+
+static bool compact_get_bit(compact_dec_t *dec, bool *bit)
+{
+    if (dec->bit >= dec->n_bits) return false;
+
+    *bit = (dec->bits[dec->bit >> 3] >> (dec->bit & 0x7)) & 1;
+    dec->bit++;
+    return true;
+}
+
+
+static bool compact_get_value(compact_dec_t *dec, leaf_t *leaf)
+{
+    uint32_t value;
+
+    if (dec->remaining == 0) {
+        uint64_t head, v;
+
+        if (!read_varint(dec->runs, dec->size, &dec->ofs, &head)) return false;
+
+        dec->remaining = head >> 1;
+        dec->literal = head & 1;
+        dec->acc = 0;
+        dec->acc_bits = 0;
+
+        if (dec->remaining == 0) return false;
+
+        if (dec->literal) {
+            /* Make sure every packed value is in the buffer */
+            uint64_t avail = (uint64_t)(dec->size - dec->ofs) * 8;
+
+            if (dec->value_bits &&
+                dec->remaining > avail / dec->value_bits) return false;
+        }
+        else {
+            if (!read_varint(dec->runs, dec->size, &dec->ofs, &v) ||
+                v >= dec->palette_count) return false;
+            dec->value = (uint32_t)v;
+        }
+    }
+
+    if (dec->literal) {
+        while (dec->acc_bits < dec->value_bits) {
+            dec->acc |= (uint64_t)dec->runs[dec->ofs++] << dec->acc_bits;
+            dec->acc_bits += 8;
+        }
+        value = (uint32_t)(dec->acc & ((1ull << dec->value_bits) - 1));
+        dec->acc >>= dec->value_bits;
+        dec->acc_bits -= dec->value_bits;
+
+        if (value >= dec->palette_count) return false;
+    }
+    else {
+        value = dec->value;
+    }
+    dec->remaining--;
+
+    *leaf = dec->palette[value];
+    return true;
+}
+
+
+static bool compact_dec_node(compact_dec_t *dec, node_t *node)
+{
+    bool is_full;
+    node_t *childreen;
+
+    leaf_t dom_leaf;
+
+    if (!compact_get_bit(dec, &is_full)) return false;
+
+    if (is_full) {
+        node->is_full = true;
+        return compact_get_value(dec, &node->dom_leaf);
+    }
+
+    if (dec->split_dom && !compact_get_value(dec, &dom_leaf)) return false;
+
+    if (node->level == dec->oc_depth - 1) {
+        leaf_t *leaves;
+
+        node_leaves_init(dec->pool, node, node->dom_leaf);
+        if (node->is_full) return false;
+
+        leaves = pool_leaves(dec->pool, node->leaves);
+        for (int i = 0; i < 8; i++) {
+            if (!compact_get_value(dec, leaves + i)) return false;
+        }
+        node->dom_leaf = (dec->split_dom) ? dom_leaf : leaves[0];
+        return true;
+    }
+
+    if (!node_init_childreen(dec->pool, node)) return false;
+
+    childreen = pool_childreen(dec->pool, node->childreen);
+    for (int i = 0; i < 8; i++) {
+        if (!compact_dec_node(dec, childreen + i)) return false;
+    }
+    node->dom_leaf = (dec->split_dom) ? dom_leaf : childreen[0].dom_leaf;
+    return true;
+}
+
+
+OCTREE_DEF
+int64_t node_save_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, int flags)
+{
+    compact_enc_t enc;
+    bytes_t payload = {NULL, 0, 0},
+            runs = {NULL, 0, 0},
+            head = {NULL, 0, 0};
+    const uint8_t *body;
+    size_t body_size;
+    uint8_t stored_flags = 0;
+    int value_bits = 0;
+    int64_t ret = -1;
+    bool ok;
+
+#if defined(OCTREE_ZLIB)
+    Bytef *deflated = NULL;
+    uLongf deflated_size = 0;
+#endif
+
+    memset(&enc, 0, sizeof(enc));
+    enc.pool = pool;
+    enc.oc_depth = oc_depth;
+    enc.ok = true;
+
+    compact_enc_node(&enc, node);
+    if (!enc.ok) goto done;
+
+    if (enc.palette.count > 1) {
+        value_bits = _octree_log2(enc.palette.count - 1) + 1;
+    }
+
+    ok = compact_put_runs(&runs, enc.values, enc.n_values, value_bits) &&
+         bytes_put_varint(&payload, enc.bits.size) &&
+         bytes_put(&payload, enc.bits.data, enc.bits.size) &&
+         bytes_put(&payload, runs.data, runs.size);
+    if (!ok) goto done;
+
+    body = payload.data;
+    body_size = payload.size;
+
+#if defined(OCTREE_ZLIB)
+    if (flags & OCTREE_COMPACT_DEFLATE) {
+        deflated_size = compressBound(payload.size);
+        deflated = (Bytef *)malloc(deflated_size);
+
+        if (deflated == NULL ||
+            compress(deflated, &deflated_size,
+                     payload.data, payload.size) != Z_OK) goto done;
+
+        body = deflated;
+        body_size = deflated_size;
+        stored_flags |= OCTREE_COMPACT_DEFLATE;
+    }
+#else
+    (void)flags;
+#endif
+
+    {
+        const uint8_t magic[8] = {
+            'O', 'C', 'T', 'C', OCTREE_COMPACT_VERSION, stored_flags,
+            oc_depth - node->level, sizeof(leaf_t)
+        };
+
+        ok = bytes_put(&head, magic, sizeof(magic)) &&
+             bytes_put_varint(&head, enc.palette.count);
+
+        for (uint32_t i = 0; ok && i < enc.palette.count; i++) {
+            ok = bytes_put_varint(&head, (uint64_t)enc.palette.leaves[i]);
+        }
+        ok = ok && bytes_put_varint(&head, payload.size);
+        if (stored_flags & OCTREE_COMPACT_DEFLATE) {
+            ok = ok && bytes_put_varint(&head, body_size);
+        }
+        if (!ok) goto done;
+    }
+
+    ret = (int64_t)(head.size + body_size);
+    if (buff) {
+        if ((uint64_t)ret > size) {
+            ret = -1;
+        }
+        else {
+            memcpy(buff, head.data, head.size);
+            memcpy(buff + head.size, body, body_size);
+        }
+    }
+
+done:
+#if defined(OCTREE_ZLIB)
+    free(deflated);
+#endif
+    free(enc.bits.data);
+    free(enc.values);
+    free(enc.palette.slots);
+    free(enc.palette.leaves);
+    free(payload.data);
+    free(runs.data);
+    free(head.data);
+    return ret;
+}
+
+
+OCTREE_DEF
+int64_t node_load_compact(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size)
+{
+    const uint8_t *in = (const uint8_t *)buff;
+    const uint8_t *payload;
+    uint8_t *inflated = NULL;
+    leaf_t *palette = NULL;
+    uint64_t count, raw_size, n_bytes;
+    size_t ofs = 7, p_ofs = 0;
+    compact_dec_t dec;
+    int64_t ret = -1;
+    uint8_t flags, version;
+
+    node_clear(pool, node, oc_depth, 0);
+
+    if (size < 7 || memcmp(in, "OCTC", 4) != 0 ||
+        in[6] != oc_depth - node->level) return -1;
+
+    version = in[4];
+    if (version < 1 || version > OCTREE_COMPACT_VERSION) return -1;
+
+    /* Leaves wider than this build's would be truncated */
+    if (version >= 2 && (size < 8 || in[ofs++] > sizeof(leaf_t))) return -1;
+
+    flags = in[5];
+    if (flags & ~OCTREE_COMPACT_DEFLATE) return -1;
+
+    /* Every palette entry takes at least one byte */
+    if (!read_varint(in, size, &ofs, &count) ||
+        count == 0 || count > size - ofs) return -1;
+
+    palette = (leaf_t *)malloc(count * sizeof(leaf_t));
+    if (palette == NULL) return -1;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t v;
+
+        if (!read_varint(in, size, &ofs, &v)) goto done;
+        palette[i] = (leaf_t)v;
+    }
+
+    if (!read_varint(in, size, &ofs, &raw_size)) goto done;
+
+    if (flags & OCTREE_COMPACT_DEFLATE) {
+#if defined(OCTREE_ZLIB)
+        uint64_t stored;
+        uLongf inflated_size = (uLongf)raw_size;
+
+        /* deflate can't do better than about 1032:1 */
+        if (!read_varint(in, size, &ofs, &stored) ||
+            stored > size - ofs || raw_size / 1032 > stored) goto done;
+
+        inflated = (uint8_t *)malloc(raw_size ? raw_size : 1);
+        if (inflated == NULL ||
+            uncompress(inflated, &inflated_size,
+                       in + ofs, (uLong)stored) != Z_OK ||
+            inflated_size != raw_size) goto done;
+
+        payload = inflated;
+        ofs += stored;
+#else
+        goto done;
+#endif
+    }
+    else {
+        if (raw_size > size - ofs) goto done;
+
+        payload = in + ofs;
+        ofs += raw_size;
+    }
+
+    if (!read_varint(payload, raw_size, &p_ofs, &n_bytes) ||
+        n_bytes > raw_size - p_ofs) goto done;
+
+    memset(&dec, 0, sizeof(dec));
+    dec.pool = pool;
+    dec.oc_depth = oc_depth;
+    dec.bits = payload + p_ofs;
+    dec.n_bits = n_bytes * 8;
+    dec.runs = payload + p_ofs + n_bytes;
+    dec.size = raw_size - p_ofs - n_bytes;
+    dec.palette = palette;
+    dec.palette_count = (uint32_t)count;
+    dec.value_bits = (count > 1) ? _octree_log2((uint32_t)count - 1) + 1 : 0;
+    dec.split_dom = (version >= 2);
+
+    if (compact_dec_node(&dec, node)) ret = (int64_t)ofs;
+
+done:
+    if (ret < 0) node_clear(pool, node, oc_depth, 0);
+    free(palette);
+    free(inflated);
+    return ret;
+}
+
+
+/* Open addressing set of blocks keyed by their content */
+typedef struct
+{
+    uint32_t *ids;
+    uint32_t *hashes;
+    uint32_t mask;
+    uint32_t count;
+} block_set_t;
+
+
+typedef struct
+{
+    node_pool_t *pool;
+    uint8_t oc_depth;
+    block_set_t childreen;
+    block_set_t leaves;
+    int64_t merged;
+    bool ok;
+} dedup_t;
+
+
+static uint32_t hash_mix(uint32_t h, uint64_t x)
+{
+    return (uint32_t)(((h ^ x) * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+
+/* is_original is left out, it doesn't change what a node holds */
+static uint32_t block_hash(const node_pool_t *pool, uint32_t id, bool leaves)
+{
+    uint32_t h = 0;
+
+    if (leaves) {
+        const leaf_t *l = pool_leaves(pool, id);
+
+        for (int i = 0; i < 8; i++) h = hash_mix(h, (uint64_t)l[i]);
+    }
+    else {
+        const node_t *n = pool_childreen(pool, id);
+
+        for (int i = 0; i < 8; i++) {
+            uint64_t x = (uint64_t)n[i].dom_leaf << 32 |
+                         ((n[i].is_full) ? 0 : n[i].childreen);
+
+            h = hash_mix(h, x ^ (uint64_t)n[i].level << 60);
+        }
+    }
+    return h;
+}
+
+
+static bool block_same(
+        const node_pool_t *pool, uint32_t a, uint32_t b, bool leaves)
+{
+    if (leaves) {
+        return memcmp(pool_leaves(pool, a), pool_leaves(pool, b),
+                      sizeof(leaf_t [8])) == 0;
+    }
+    else {
+        const node_t *na = pool_childreen(pool, a),
+                     *nb = pool_childreen(pool, b);
+
+        for (int i = 0; i < 8; i++) {
+            if (na[i].is_full != nb[i].is_full ||
+                na[i].level != nb[i].level ||
+                na[i].dom_leaf != nb[i].dom_leaf ||
+                (!na[i].is_full && na[i].childreen != nb[i].childreen)) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+
+/* Returns the block identical to id, id itself once inserted, 0 if there is
+ * none and insert is false or -1 if memory ran out */
+static int64_t block_set_find(
+        block_set_t *set, const node_pool_t *pool,
+        uint32_t id, bool leaves, bool insert)
+{
+    uint32_t h = block_hash(pool, id, leaves), slot;
+
+    if (set->mask) {
+        for (slot = h & set->mask; set->ids[slot];
+             slot = (slot + 1) & set->mask) {
+            if (set->hashes[slot] == h &&
+                block_same(pool, set->ids[slot], id, leaves)) {
+                return set->ids[slot];
+            }
+        }
+    }
+    if (!insert) return 0;
+
+    /* Keep the table at most half full */
+    if (set->count * 2 >= set->mask) {
+        uint32_t mask = (set->mask) ? set->mask * 2 + 1 : 1023;
+        uint32_t *ids = (uint32_t *)calloc(mask + 1, sizeof(uint32_t)),
+                 *hashes = (uint32_t *)malloc((mask + 1) * sizeof(uint32_t));
+
+        if (ids == NULL || hashes == NULL) {
+            free(ids);
+            free(hashes);
+            return -1;
+        }
+
+        for (uint32_t i = 0; set->mask && i <= set->mask; i++) {
+            if (set->ids[i] == 0) continue;
+
+            slot = set->hashes[i] & mask;
+            while (ids[slot]) slot = (slot + 1) & mask;
+            ids[slot] = set->ids[i];
+            hashes[slot] = set->hashes[i];
+        }
+        free(set->ids);
+        free(set->hashes);
+        set->ids = ids;
+        set->hashes = hashes;
+        set->mask = mask;
+    }
+
+    slot = h & set->mask;
+    while (set->ids[slot]) slot = (slot + 1) & set->mask;
+    set->ids[slot] = id;
+    set->hashes[slot] = h;
+    set->count++;
+
+    return id;
+}
+
+
+/* Bottom up, so the childreen of a block are merged before the block is
+ * compared with the others */
+static void dedup_node(dedup_t *d, node_t *node)
+{
+    node_pool_t *pool = d->pool;
+    const node_t dup = *node;
+    int64_t same;
+
+    if (node->is_full || !d->ok) return;
+
+    if (node->level == d->oc_depth - 1) {
+        same = block_set_find(&d->leaves, pool, node->leaves, true, true);
+
+        if (same < 0) {
+            d->ok = false;
+        }
+        else if ((uint32_t)same != node->leaves) {
+            node_t merged = *node;
+
+            merged.leaves = (uint32_t)same;
+            pool_retain_leaves(pool, (uint32_t)same);
+            node_write(node, merged);
+            pool_free_leaves(pool, dup.leaves);
+            d->merged++;
+        }
+        return;
+    }
+
+    /* Blocks already merged in this pass are found without descending */
+    same = block_set_find(&d->childreen, pool, node->childreen, false, false);
+
+    if (same == 0) {
+        node_t *childreen = pool_childreen(pool, node->childreen);
+
+        for (int i = 0; i < 8; i++) dedup_node(d, childreen + i);
+        if (!d->ok) return;
+
+        same = block_set_find(
+                &d->childreen, pool, node->childreen, false, true);
+        if (same < 0) {
+            d->ok = false;
+            return;
+        }
+    }
+
+    if ((uint32_t)same != node->childreen) {
+        node_t merged = *node;
+
+        merged.childreen = (uint32_t)same;
+        pool_retain_childreen(pool, (uint32_t)same);
+        node_write(node, merged);
+        node_release(pool, &dup, d->oc_depth);
+        d->merged++;
+    }
+}
+
+
+OCTREE_DEF
+int64_t node_dedup(node_pool_t *pool, node_t *node, uint8_t oc_depth)
+{
+    dedup_t d;
+
+    if (!pool_share(pool)) return -1;
+
+    memset(&d, 0, sizeof(d));
+    d.pool = pool;
+    d.oc_depth = oc_depth;
+    d.ok = true;
+
+    dedup_node(&d, node);
+
+    free(d.childreen.ids);
+    free(d.childreen.hashes);
+    free(d.leaves.ids);
+    free(d.leaves.hashes);
+    return (d.ok) ? d.merged : -1;
+}
+
+
+/* Block id to the block's index in the saved DAG */
+typedef struct
+{
+    uint32_t *ids;
+    uint32_t *index;
+    uint32_t mask;
+    uint32_t count;
+} id_map_t;
+
+
+typedef struct
+{
+    node_pool_t *pool;
+    uint8_t oc_depth;
+    uint8_t top_level;
+    id_map_t leaf_map;
+    id_map_t node_map;
+    bytes_t leaf_blocks;
+    bytes_t node_blocks;
+    uint32_t n_leaf_blocks;
+    uint32_t n_node_blocks;
+    bool ok;
+} dag_enc_t;
+
+
+/* Returns the slot of id, which is empty if id isn't in the map */
+static uint32_t id_map_slot(const id_map_t *map, uint32_t id)
+{
+    uint32_t slot = hash_mix(0, id) & map->mask;
+
+    while (map->ids[slot] && map->ids[slot] != id) {
+        slot = (slot + 1) & map->mask;
+    }
+    return slot;
+}
+
+
+static bool id_map_put(id_map_t *map, uint32_t id, uint32_t index)
+{
+    uint32_t slot;
+
+    if (map->count * 2 >= map->mask) {
+        id_map_t grown = {NULL, NULL, (map->mask) ? map->mask * 2 + 1 : 1023, 0};
+
+        grown.ids = (uint32_t *)calloc(grown.mask + 1, sizeof(uint32_t));
+        grown.index = (uint32_t *)malloc((grown.mask + 1) * sizeof(uint32_t));
+
+        if (grown.ids == NULL || grown.index == NULL) {
+            free(grown.ids);
+            free(grown.index);
+            return false;
+        }
+
+        for (uint32_t i = 0; map->mask && i <= map->mask; i++) {
+            if (map->ids[i] == 0) continue;
+
+            slot = id_map_slot(&grown, map->ids[i]);
+            grown.ids[slot] = map->ids[i];
+            grown.index[slot] = map->index[i];
+        }
+        grown.count = map->count;
+        free(map->ids);
+        free(map->index);
+        *map = grown;
+    }
+
+    slot = id_map_slot(map, id);
+    map->ids[slot] = id;
+    map->index[slot] = index;
+    map->count++;
+    return true;
+}
+
+
+/* Write node's block and every block below it that wasn't written yet.
+ * Returns 1 + the block's index, 0 for full nodes */
+static uint64_t dag_put_block(dag_enc_t *enc, const node_t *node)
+{
+    bool is_last = (node->level == enc->oc_depth - 1);
+    id_map_t *map = (is_last) ? &enc->leaf_map : &enc->node_map;
+    uint32_t slot;
+
+    if (node->is_full || !enc->ok) return 0;
+
+    if (map->mask) {
+        slot = id_map_slot(map, node->childreen);
+        if (map->ids[slot]) return (uint64_t)map->index[slot] + 1;
+    }
+
+    if (is_last) {
+        const leaf_t *leaves = pool_leaves(enc->pool, node->leaves);
+
+        for (int i = 0; i < 8; i++) {
+            enc->ok &= bytes_put_varint(&enc->leaf_blocks, (uint64_t)leaves[i]);
+        }
+        enc->ok = enc->ok &&
+                  id_map_put(map, node->leaves, enc->n_leaf_blocks);
+        return ++enc->n_leaf_blocks;
+    }
+    else {
+        const node_t *childreen = pool_childreen(enc->pool, node->childreen);
+        const uint8_t level = childreen[0].level - enc->top_level;
+        uint64_t refs[8];
+
+        for (int i = 0; i < 8; i++) {
+            refs[i] = dag_put_block(enc, childreen + i);
+        }
+
+        enc->ok &= bytes_put(&enc->node_blocks, &level, 1);
+        for (int i = 0; i < 8; i++) {
+            enc->ok = enc->ok &&
+                      bytes_put_varint(&enc->node_blocks, refs[i]) &&
+                      bytes_put_varint(&enc->node_blocks,
+                                       (uint64_t)childreen[i].dom_leaf);
+        }
+        enc->ok = enc->ok &&
+                  id_map_put(map, node->childreen, enc->n_node_blocks);
+        return ++enc->n_node_blocks;
+    }
+}
+
+
+OCTREE_DEF
+int64_t node_save_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size)
+{
+    dag_enc_t enc;
+    bytes_t out = {NULL, 0, 0};
+    const uint8_t magic[6] = {
+        'O', 'C', 'T', 'D', OCTREE_DAG_VERSION, oc_depth - node->level
+    };
+    uint64_t root;
+    int64_t ret = -1;
+
+    memset(&enc, 0, sizeof(enc));
+    enc.pool = pool;
+    enc.oc_depth = oc_depth;
+    enc.top_level = node->level;
+    enc.ok = true;
+
+    root = dag_put_block(&enc, node);
+
+    if (enc.ok &&
+        bytes_put(&out, magic, sizeof(magic)) &&
+        bytes_put_varint(&out, enc.n_leaf_blocks) &&
+        bytes_put(&out, enc.leaf_blocks.data, enc.leaf_blocks.size) &&
+        bytes_put_varint(&out, enc.n_node_blocks) &&
+        bytes_put(&out, enc.node_blocks.data, enc.node_blocks.size) &&
+        bytes_put_varint(&out, root) &&
+        bytes_put_varint(&out, (uint64_t)node->dom_leaf)) {
+        ret = (int64_t)out.size;
+
+        if (buff) {
+            if (out.size > size) ret = -1;
+            else memcpy(buff, out.data, out.size);
+        }
+    }
+
+    free(enc.leaf_map.ids);
+    free(enc.leaf_map.index);
+    free(enc.node_map.ids);
+    free(enc.node_map.index);
+    free(enc.leaf_blocks.data);
+    free(enc.node_blocks.data);
+    free(out.data);
+    return ret;
+}
+
+
+typedef struct
+{
+    const uint8_t *in;
+    size_t size;
+    size_t ofs;
+    uint8_t oc_depth;
+    uint32_t *leaf_ids;
+    uint32_t *leaf_uses;
+    uint32_t *node_ids;
+    uint32_t *node_uses;
+    uint8_t *node_levels;
+    uint32_t n_leaf_blocks;
+    uint32_t n_node_blocks;
+} dag_dec_t;
+
+
+/* Read a node at level. Only blocks before the one being read can be
+ * referenced, which rules out cycles */
+static bool dag_get_node(dag_dec_t *dec, uint8_t level, node_t *node)
+{
+    uint64_t ref, dom;
+
+    if (!read_varint(dec->in, dec->size, &dec->ofs, &ref) ||
+        !read_varint(dec->in, dec->size, &dec->ofs, &dom)) return false;
+
+    node->dom_leaf = (leaf_t)dom;
+    node->is_full = (ref == 0);
+    node->childreen = 0;
+
+    if (ref == 0) return true;
+    ref--;
+
+    if (level == dec->oc_depth - 1) {
+        if (ref >= dec->n_leaf_blocks) return false;
+
+        node->leaves = dec->leaf_ids[ref];
+        dec->leaf_uses[ref]++;
+    }
+    else {
+        if (ref >= dec->n_node_blocks ||
+            dec->node_levels[ref] != level + 1) return false;
+
+        node->childreen = dec->node_ids[ref];
+        dec->node_uses[ref]++;
+    }
+    return true;
+}
+
+
+OCTREE_DEF
+int64_t node_load_dag(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size)
+{
+    dag_dec_t dec;
+    uint64_t count;
+    int64_t ret = -1;
+
+    node_clear(pool, node, oc_depth, 0);
+
+    if (size < 6 || memcmp(buff, "OCTD", 4) != 0 ||
+        buff[4] != OCTREE_DAG_VERSION ||
+        (uint8_t)buff[5] != oc_depth - node->level) return -1;
+
+    if (!pool_share(pool)) return -1;
+
+    memset(&dec, 0, sizeof(dec));
+    dec.in = (const uint8_t *)buff;
+    dec.size = size;
+    dec.ofs = 6;
+    dec.oc_depth = oc_depth;
+
+    /* A leaf block takes at least 8 bytes */
+    if (!read_varint(dec.in, size, &dec.ofs, &count) ||
+        count > (size - dec.ofs) / 8) return -1;
+
+    dec.leaf_ids = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    dec.leaf_uses = (uint32_t *)calloc(count + 1, sizeof(uint32_t));
+    if (dec.leaf_ids == NULL || dec.leaf_uses == NULL) goto done;
+
+    for (; dec.n_leaf_blocks < count; dec.n_leaf_blocks++) {
+        uint32_t id = pool_alloc_leaves(pool);
+        leaf_t *leaves;
+
+        if (id == 0) goto done;
+
+        dec.leaf_ids[dec.n_leaf_blocks] = id;
+        leaves = pool_leaves(pool, id);
+
+        for (int i = 0; i < 8; i++) {
+            uint64_t v;
+
+            if (!read_varint(dec.in, size, &dec.ofs, &v)) {
+                dec.n_leaf_blocks++;
+                goto done;
+            }
+            leaves[i] = (leaf_t)v;
+        }
+    }
+
+    /* And a node block at least 17 */
+    if (!read_varint(dec.in, size, &dec.ofs, &count) ||
+        count > (size - dec.ofs) / 17) goto done;
+
+    dec.node_ids = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    dec.node_uses = (uint32_t *)calloc(count + 1, sizeof(uint32_t));
+    dec.node_levels = (uint8_t *)malloc(count + 1);
+    if (dec.node_ids == NULL || dec.node_uses == NULL ||
+        dec.node_levels == NULL) goto done;
+
+    for (; dec.n_node_blocks < count; dec.n_node_blocks++) {
+        const uint32_t k = dec.n_node_blocks;
+        uint32_t id = pool_alloc_childreen(pool);
+        uint8_t level;
+        node_t *childreen;
+
+        if (id == 0) goto done;
+
+        dec.node_ids[k] = id;
+        if (dec.ofs == size) {
+            dec.n_node_blocks++;
+            goto done;
+        }
+
+        level = node->level + dec.in[dec.ofs++];
+        childreen = pool_childreen(pool, id);
+
+        if (level <= node->level || level >= oc_depth) {
+            dec.n_node_blocks++;
+            goto done;
+        }
+        dec.node_levels[k] = level;
+
+        for (int i = 0; i < 8; i++) {
+            childreen[i] = (node_t) {{0}, 1, 1, level, 0};
+
+            if (!dag_get_node(&dec, level, childreen + i)) {
+                dec.n_node_blocks++;
+                goto done;
+            }
+        }
+    }
+
+    if (!dag_get_node(&dec, node->level, node)) goto done;
+
+    /* Blocks nothing points to would never be freed */
+    for (uint32_t i = 0; i < dec.n_leaf_blocks; i++) {
+        if (dec.leaf_uses[i] == 0) goto done;
+    }
+    for (uint32_t i = 0; i < dec.n_node_blocks; i++) {
+        if (dec.node_uses[i] == 0) goto done;
+    }
+
+    for (uint32_t i = 0; i < dec.n_leaf_blocks; i++) {
+        for (uint32_t n = 1; n < dec.leaf_uses[i]; n++) {
+            pool_retain_leaves(pool, dec.leaf_ids[i]);
+        }
+    }
+    for (uint32_t i = 0; i < dec.n_node_blocks; i++) {
+        for (uint32_t n = 1; n < dec.node_uses[i]; n++) {
+            pool_retain_childreen(pool, dec.node_ids[i]);
+        }
+    }
+    ret = (int64_t)dec.ofs;
+
+done:
+    if (ret < 0) {
+        /* Nothing is retained yet, every block goes straight back */
+        for (uint32_t i = 0; i < dec.n_leaf_blocks; i++) {
+            pool_free_leaves(pool, dec.leaf_ids[i]);
+        }
+        for (uint32_t i = 0; i < dec.n_node_blocks; i++) {
+            pool_free_childreen(pool, dec.node_ids[i]);
+        }
+        node->childreen = 0;
+        node->is_full = true;
+        node->dom_leaf = 0;
+    }
+    free(dec.leaf_ids);
+    free(dec.leaf_uses);
+    free(dec.node_ids);
+    free(dec.node_uses);
+    free(dec.node_levels);
+    return ret;
+}
+
+
+/* Most subtrees the indexed format splits a node in */
+#define INDEXED_MAX_SUBTREES (1u << (OCTREE_INDEXED_MAX_SPLIT * 3))
+
+
+typedef void (*task_fn)(void *data, uint32_t i);
+
+
+typedef struct
+{
+    task_fn fn;
+    void *data;
+    const uint32_t *order;
+    uint32_t n;
+    uint32_t next;
+#if defined(OCTREE_THREADS)
+    pthread_mutex_t lock;
+#endif /* OCTREE_THREADS */
+} task_queue_t;
+
+
+#if defined(OCTREE_THREADS)
+static void *task_worker(void *arg)
+{
+    task_queue_t *queue = (task_queue_t *)arg;
+
+    for (;;) {
+        uint32_t i;
+
+        pthread_mutex_lock(&queue->lock);
+        i = queue->next;
+        if (i < queue->n) queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->n) return NULL;
+
+        queue->fn(queue->data, queue->order[i]);
+    }
+}
+#endif /* OCTREE_THREADS */
+
+
+/* Call fn for order[0] to order[n - 1] on up to threads threads, the calling
+ * one included */
+static void run_tasks(
+        task_fn fn, void *data, const uint32_t *order, uint32_t n,
+        int threads)
+{
+#if defined(OCTREE_THREADS)
+    task_queue_t queue;
+
+    queue.fn = fn;
+    queue.data = data;
+    queue.order = order;
+    queue.n = n;
+    queue.next = 0;
+
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = (cores > 0) ? (int)cores : 1;
+    }
+    if ((uint32_t)threads > n) threads = (int)n;
+
+    if (threads > 1 && pthread_mutex_init(&queue.lock, NULL) == 0) {
+        pthread_t workers[INDEXED_MAX_SUBTREES];
+        int started = 0;
+
+        /* Threads that can't be started leave more work to the others */
+        for (; started < threads - 1; started++) {
+            if (pthread_create(
+                        workers + started, NULL, task_worker, &queue)) break;
+        }
+        task_worker(&queue);
+
+        for (int t = 0; t < started; t++) pthread_join(workers[t], NULL);
+        pthread_mutex_destroy(&queue.lock);
+        return;
+    }
+#else
+    (void)threads;
+#endif /* OCTREE_THREADS */
+
+    for (uint32_t i = 0; i < n; i++) fn(data, order[i]);
+}
+
+
+/* Allocate n blocks with consecutive ids, leaving the free list alone.
+ * Returns the first id or 0 if n is 0 or memory ran out */
+static uint32_t pool_reserve(node_pool_t *pool, bool leaves, uint32_t n)
+{
+    slab_t *slab = (leaves) ? &pool->leaves : &pool->childreen;
+    const uint32_t free_list = slab->free_list;
+    uint32_t first = 0, k = 0;
+
+    slab->free_list = 0;
+    for (; k < n; k++) {
+        uint32_t id = (leaves)
+            ? pool_alloc_leaves(pool)
+            : pool_alloc_childreen(pool);
+
+        if (id == 0) break;
+        if (k == 0) first = id;
+    }
+    slab->free_list = free_list;
+
+    if (k < n) {
+        while (k-- > 0) slab_release(slab, first + k);
+        return 0;
+    }
+    return first;
+}
+
+
+typedef struct
+{
+    node_pool_t *pool;
+    uint8_t oc_depth;
+    const char *in;
+    char *out;
+    uint32_t n_subs;
+    node_t *subs[INDEXED_MAX_SUBTREES];
+    uint32_t n_childreen[INDEXED_MAX_SUBTREES];
+    uint32_t n_leaves[INDEXED_MAX_SUBTREES];
+    uint64_t ofs[INDEXED_MAX_SUBTREES];
+    uint64_t sizes[INDEXED_MAX_SUBTREES];
+    uint32_t order[INDEXED_MAX_SUBTREES];
+    load_range_t ranges[INDEXED_MAX_SUBTREES];
+    bool ok[INDEXED_MAX_SUBTREES];
+} indexed_t;
+
+
+static void node_count_blocks(
+        const node_pool_t *pool, const node_t *node, uint8_t oc_depth,
+        uint32_t *childreen, uint32_t *leaves)
+{
+    if (node->is_full) return;
+
+    if (node->level == oc_depth - 1) {
+        (*leaves)++;
+        return;
+    }
+    (*childreen)++;
+
+    for (int i = 0; i < 8; i++) {
+        node_count_blocks(
+                pool, pool_childreen(pool, node->childreen) + i, oc_depth,
+                childreen, leaves);
+    }
+}
+
+
+/* Bytes node_save_buffer writes for a subtree with these blocks */
+static uint64_t indexed_size(uint32_t childreen, uint32_t leaves)
+{
+    return (1 + 8 * (uint64_t)childreen) * sizeof(simple_node_t) +
+           (uint64_t)leaves * sizeof(leaf_t [8]);
+}
+
+
+/* Biggest subtrees first so no thread is left with a big one at the end */
+static void indexed_order(indexed_t *ix)
+{
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        uint32_t k = i;
+
+        for (; k && ix->sizes[ix->order[k - 1]] < ix->sizes[i]; k--) {
+            ix->order[k] = ix->order[k - 1];
+        }
+        ix->order[k] = i;
+    }
+}
+
+
+static bool indexed_put_top(
+        indexed_t *ix, bytes_t *head, node_t *node, uint8_t split_level)
+{
+    const simple_node_t snode = simple_node(node);
+
+    if (node->level == split_level) {
+        ix->subs[ix->n_subs++] = node;
+        return true;
+    }
+    if (!bytes_put(head, &snode, sizeof(snode))) return false;
+
+    if (node->is_full) return true;
+
+    for (int i = 0; i < 8; i++) {
+        node_t *child = pool_childreen(ix->pool, node->childreen) + i;
+
+        if (!indexed_put_top(ix, head, child, split_level)) return false;
+    }
+    return true;
+}
+
+
+static void indexed_count_task(void *data, uint32_t i)
+{
+    indexed_t *ix = (indexed_t *)data;
+
+    node_count_blocks(ix->pool, ix->subs[i], ix->oc_depth,
+                      ix->n_childreen + i, ix->n_leaves + i);
+}
+
+
+static void indexed_save_task(void *data, uint32_t i)
+{
+    indexed_t *ix = (indexed_t *)data;
+    save_sink_t sink = {ix->out + ix->ofs[i], ix->sizes[i], 0, 0, NULL};
+
+    ix->ok[i] = node_save(ix->pool, ix->subs[i], ix->oc_depth, &sink) &&
+                sink.total == ix->sizes[i];
+}
+
+
+OCTREE_DEF
+int64_t node_save_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        char *buff, size_t size, uint8_t split, int threads)
+{
+    const uint8_t levels = oc_depth - node->level;
+    indexed_t *ix = (indexed_t *)calloc(1, sizeof(indexed_t));
+    bytes_t head = {NULL, 0, 0};
+    uint64_t total;
+    int64_t ret = -1;
+
+    if (ix == NULL) return -1;
+
+    /* Subtrees can't start below the last level */
+    if (split > OCTREE_INDEXED_MAX_SPLIT) split = OCTREE_INDEXED_MAX_SPLIT;
+    if (split > levels - 1) split = levels - 1;
+
+    ix->pool = pool;
+    ix->oc_depth = oc_depth;
+
+    {
+        const uint8_t magic[7] = {
+            'O', 'C', 'T', 'I', OCTREE_INDEXED_VERSION, levels, split
+        };
+
+        if (!bytes_put(&head, magic, sizeof(magic)) ||
+            !indexed_put_top(ix, &head, node, node->level + split)) goto done;
+    }
+
+    for (uint32_t i = 0; i < ix->n_subs; i++) ix->order[i] = i;
+    run_tasks(indexed_count_task, ix, ix->order, ix->n_subs, threads);
+
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        if (!bytes_put_varint(&head, ix->n_childreen[i]) ||
+            !bytes_put_varint(&head, ix->n_leaves[i])) goto done;
+    }
+
+    total = head.size;
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        ix->ofs[i] = total;
+        ix->sizes[i] = indexed_size(ix->n_childreen[i], ix->n_leaves[i]);
+        total += ix->sizes[i];
+    }
+
+    ret = (int64_t)total;
+    if (buff == NULL) goto done;
+
+    if (total > size) {
+        ret = -1;
+        goto done;
+    }
+    memcpy(buff, head.data, head.size);
+
+    ix->out = buff;
+    indexed_order(ix);
+    run_tasks(indexed_save_task, ix, ix->order, ix->n_subs, threads);
+
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        if (!ix->ok[i]) ret = -1;
+    }
+
+done:
+    free(head.data);
+    free(ix);
+    return ret;
+}
+
+
+static bool indexed_get_top(
+        indexed_t *ix, const uint8_t *in, size_t size, size_t *ofs,
+        node_t *node, uint8_t split_level)
+{
+    simple_node_t snode;
+
+    if (node->level == split_level) {
+        ix->subs[ix->n_subs++] = node;
+        return true;
+    }
+    if (size - *ofs < sizeof(snode)) return false;
+
+    memcpy(&snode, in + *ofs, sizeof(snode));
+    *ofs += sizeof(snode);
+
+    if (snode.level != node->level) return false;
+
+    node->is_original = snode.is_original;
+    node->dom_leaf = snode.dom_leaf;
+
+    if (snode.is_full) return true;
+
+    if (!node_init_childreen(ix->pool, node)) return false;
+
+    for (int i = 0; i < 8; i++) {
+        node_t *child = pool_childreen(ix->pool, node->childreen) + i;
+
+        if (!indexed_get_top(ix, in, size, ofs, child, split_level)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void indexed_load_task(void *data, uint32_t i)
+{
+    indexed_t *ix = (indexed_t *)data;
+    load_source_t src = {
+        ix->in + ix->ofs[i], ix->sizes[i], 0, 0, NULL, NULL, 0, ix->ranges + i
+    };
+
+    ix->ok[i] = node_load(ix->pool, ix->subs[i], ix->oc_depth, &src) &&
+                src.total == ix->sizes[i];
+}
+
+
+OCTREE_DEF
+int64_t node_load_indexed(
+        node_pool_t *pool, node_t *node, uint8_t oc_depth,
+        const char *buff, size_t size, int threads)
+{
+    const uint8_t *in = (const uint8_t *)buff;
+    const uint8_t levels = oc_depth - node->level;
+    indexed_t *ix;
+    size_t ofs = 7;
+    int64_t ret = -1;
+
+    node_clear(pool, node, oc_depth, 0);
+
+    if (size < 7 || memcmp(in, "OCTI", 4) != 0 ||
+        in[4] != OCTREE_INDEXED_VERSION || in[5] != levels ||
+        in[6] > OCTREE_INDEXED_MAX_SPLIT || in[6] >= levels) return -1;
+
+    ix = (indexed_t *)calloc(1, sizeof(indexed_t));
+    if (ix == NULL) return -1;
+
+    ix->pool = pool;
+    ix->oc_depth = oc_depth;
+    ix->in = buff;
+
+    if (!indexed_get_top(ix, in, size, &ofs, node, node->level + in[6])) {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        uint64_t childreen, leaves;
+
+        /* Every block is stored as 8 records or 8 leaves */
+        if (!read_varint(in, size, &ofs, &childreen) ||
+            !read_varint(in, size, &ofs, &leaves) ||
+            childreen > size / (8 * sizeof(simple_node_t)) ||
+            leaves > size / sizeof(leaf_t [8])) goto done;
+
+        ix->n_childreen[i] = (uint32_t)childreen;
+        ix->n_leaves[i] = (uint32_t)leaves;
+        ix->sizes[i] = indexed_size(ix->n_childreen[i], ix->n_leaves[i]);
+    }
+
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        load_range_t *range = ix->ranges + i;
+
+        if (ix->sizes[i] > size - ofs) goto done;
+
+        ix->ofs[i] = ofs;
+        ofs += ix->sizes[i];
+
+        /* The blocks are set aside here so the threads don't allocate */
+        range->childreen = pool_reserve(pool, false, ix->n_childreen[i]);
+        if (range->childreen == 0 && ix->n_childreen[i]) goto done;
+        range->end_childreen = range->childreen + ix->n_childreen[i];
+
+        range->leaves = pool_reserve(pool, true, ix->n_leaves[i]);
+        if (range->leaves == 0 && ix->n_leaves[i]) goto done;
+        range->end_leaves = range->leaves + ix->n_leaves[i];
+    }
+
+    indexed_order(ix);
+    run_tasks(indexed_load_task, ix, ix->order, ix->n_subs, threads);
+
+    ret = (int64_t)ofs;
+    for (uint32_t i = 0; i < ix->n_subs; i++) {
+        const load_range_t *range = ix->ranges + i;
+
+        /* The counts have to match what the subtree used */
+        if (!ix->ok[i] || range->childreen != range->end_childreen ||
+            range->leaves != range->end_leaves) ret = -1;
+    }
+
+done:
+    if (ret < 0) {
+        /* Blocks the subtrees didn't get to use were never linked */
+        for (uint32_t i = 0; i < ix->n_subs; i++) {
+            const load_range_t *range = ix->ranges + i;
+
+            for (uint32_t id = range->childreen;
+                 id < range->end_childreen; id++) {
+                slab_release(&pool->childreen, id);
+            }
+            for (uint32_t id = range->leaves; id < range->end_leaves; id++) {
+                slab_release(&pool->leaves, id);
+            }
+        }
+        node_clear(pool, node, oc_depth, 0);
+    }
+    free(ix);
+    return ret;
+}
+
+
+OCTREE_DEF
+octree_t *octree_construct(uint8_t depth)
+{
+    octree_t *octree = (octree_t *)malloc(sizeof(octree_t));
+
+    if (octree == NULL) return NULL;
+
+    octree->root = node_construct();
+    octree->pool = pool_construct();
+    octree->depth = depth;
+
+    if (octree->root == NULL || octree->pool == NULL) {
+        free(octree->root);
+        if (octree->pool) pool_free(octree->pool);
+        free(octree);
+        return NULL;
+    }
+    octree->root->is_full = true;
+
+    return octree;
+}
+
+
+OCTREE_DEF
+void octree_r_free(octree_t *octree)
+{
+    /* Every node below the root lives in the pool */
+    if (--octree->pool->users)
+        node_clear(octree->pool, octree->root, octree->depth, 0);
+    else
+        pool_free(octree->pool);
+    free(octree->root);
+    free(octree);
+}
+
+
+OCTREE_DEF
+octree_t *octree_snapshot(octree_t *octree)
+{
+    node_pool_t *pool = octree->pool;
+    const node_t root = *octree->root;
+    octree_t *snapshot;
+
+    if (!pool->shared && !pool_share(pool)) return NULL;
+
+    snapshot = (octree_t *)malloc(sizeof(octree_t));
+    if (snapshot == NULL) return NULL;
+
+    snapshot->root = node_construct();
+    if (snapshot->root == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+
+    /* The root's block gets a second reference, the first write through
+     * either root copies it */
+    if (!root.is_full) {
+        if (root.level == octree->depth - 1)
+            pool_retain_leaves(pool, root.leaves);
+        else
+            pool_retain_childreen(pool, root.childreen);
+    }
+    *snapshot->root = root;
+    snapshot->pool = pool;
+    snapshot->depth = octree->depth;
+    pool->users++;
+
+    return snapshot;
+}
+
+
+OCTREE_DEF
+int octree_free_step(octree_t *octree, size_t budget)
+{
+    if (octree->pool->users > 1) {
+        octree_r_free(octree);
+        return 1;
+    }
+    if (!pool_free_step(octree->pool, budget)) return 0;
+
+    free(octree->root);
+    free(octree);
+    return 1;
+}
+
+
+OCTREE_DEF
+void octree_clear(octree_t *octree)
+{
+#if defined(OCTREE_CONCURRENT)
+    node_clear(octree->pool, octree->root, octree->depth, 0);
+#else
+    if (octree->pool->users > 1) {
+        node_clear(octree->pool, octree->root, octree->depth, 0);
+        return;
+    }
+    pool_reset(octree->pool);
+    *(octree->root) = (node_t) {{0}, 1, 0, 0, 0};
+#endif /* OCTREE_CONCURRENT */
+}
+
+
+OCTREE_DEF
+int octree_optimize(octree_t *octree)
+{
+    return node_optimize(octree->pool, octree->root, octree->depth);
+}
+
+
+#if defined(OCTREE_CONCURRENT)
+OCTREE_DEF
+octree_reader_t *octree_reader_join(octree_t *octree)
+{
+    return pool_reader_join(octree->pool);
+}
+
+
+OCTREE_DEF
+size_t octree_reclaim(octree_t *octree)
+{
+    return pool_reclaim(octree->pool);
+}
+#endif /* OCTREE_CONCURRENT */
+
+
+/* octree_load_buffer
+ * params:
+ *      * octree - octree to write to.
+ *      * buff - buffer containing the raw octree data.
+ * description:
+ *      * Attempt to load raw data into octree. On failure -1  is returned and
+ *      the octree is left empty. Otherwise the bits read is returned
+ */
+OCTREE_DEF
+int octree_load_buffer(octree_t *octree, const char *buff)
+{
+    return node_load_buffer(octree->pool, octree->root, octree->depth, buff);
+}
+
+
+OCTREE_DEF
+int octree_save_buffer(octree_t *octree, char *buff)
+{
+    return node_save_buffer(octree->pool, octree->root, octree->depth, buff);
+}
+
+
+OCTREE_DEF
+size_t octree_save_size(octree_t *octree)
+{
+    return node_save_size(octree->pool, octree->root, octree->depth);
+}
+
+
+/* Rough size of a malloc of n bytes: a header word, rounded up to 16 */
+static size_t malloc_bytes(size_t n)
+{
+    return (n + sizeof(size_t) + 15) & ~(size_t)15;
+}
+
+
+static size_t slab_bytes(const slab_t *slab)
+{
+    size_t bytes = slab->n_chunks *
+                   malloc_bytes((size_t)OCTREE_POOL_CHUNK * slab->block_size);
+
+    if (slab->chunks) bytes += malloc_bytes(slab->cap_chunks * sizeof(char *));
+    if (slab->refs) {
+        bytes += malloc_bytes(slab->cap_chunks * sizeof(uint32_t *)) +
+                 slab->n_chunks *
+                 malloc_bytes(OCTREE_POOL_CHUNK * sizeof(uint32_t));
+    }
+    return bytes;
+}
+
+
+static size_t octree_bytes(const octree_t *octree)
+{
+    const node_pool_t *pool = octree->pool;
+    size_t bytes = malloc_bytes(sizeof(octree_t)) +
+                   malloc_bytes(sizeof(node_t)) +
+                   malloc_bytes(sizeof(node_pool_t)) +
+                   slab_bytes(&pool->childreen) + slab_bytes(&pool->leaves);
+
+#if defined(OCTREE_CONCURRENT)
+    if (pool->retired)
+        bytes += malloc_bytes(pool->cap_retired * sizeof(pool_retired_t));
+    for (const octree_reader_t *r = pool->readers; r; r = r->next)
+        bytes += malloc_bytes(sizeof(octree_reader_t));
+#endif /* OCTREE_CONCURRENT */
+    return bytes;
+}
+
+
+OCTREE_DEF
+void octree_stats(octree_t *octree, octree_stats_t *stats)
+{
+    memset(stats, 0, sizeof(octree_stats_t));
+    node_stats(octree->pool, octree->root, octree->depth, stats);
+    stats->bytes = octree_bytes(octree);
+}
+
+
+#if defined(OCTREE_COUNTERS)
+OCTREE_DEF
+void octree_stats_totals(const octree_t *octree, octree_stats_t *stats)
+{
+    const node_pool_t *pool = octree->pool;
+
+    memset(stats, 0, sizeof(octree_stats_t));
+    stats->childreen_blocks = pool->childreen.live;
+    stats->leaf_blocks = pool->leaves.live;
+    /* Every split node owns one block, every block holds 8 nodes */
+    stats->n_nodes = 1 + 8 * stats->childreen_blocks;
+    stats->n_split = stats->childreen_blocks + stats->leaf_blocks;
+    stats->n_full = stats->n_nodes - stats->n_split;
+    stats->bytes = octree_bytes(octree);
+}
+#endif /* OCTREE_COUNTERS */
+
+
+OCTREE_DEF
+int octree_load_buffer_n(octree_t *octree, const char *buff, size_t size)
+{
+    return node_load_buffer_n(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+OCTREE_DEF
+int octree_save_buffer_n(octree_t *octree, char *buff, size_t size)
+{
+    return node_save_buffer_n(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+OCTREE_DEF
+int64_t octree_save_stream(octree_t *octree, octree_stream_t *stream)
+{
+    return node_save_stream(octree->pool, octree->root, octree->depth, stream);
+}
+
+
+OCTREE_DEF
+int64_t octree_load_stream(octree_t *octree, octree_stream_t *stream)
+{
+    return node_load_stream(octree->pool, octree->root, octree->depth, stream);
+}
+
+
+OCTREE_DEF
+int64_t octree_save_compact(
+        octree_t *octree, char *buff, size_t size, int flags)
+{
+    return node_save_compact(
+            octree->pool, octree->root, octree->depth, buff, size, flags);
+}
+
+
+OCTREE_DEF
+int64_t octree_load_compact(octree_t *octree, const char *buff, size_t size)
+{
+    return node_load_compact(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+OCTREE_DEF
+int64_t octree_dedup(octree_t *octree)
+{
+    return node_dedup(octree->pool, octree->root, octree->depth);
+}
+
+
+OCTREE_DEF
+int64_t octree_save_dag(octree_t *octree, char *buff, size_t size)
+{
+    return node_save_dag(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+OCTREE_DEF
+int64_t octree_load_dag(octree_t *octree, const char *buff, size_t size)
+{
+    return node_load_dag(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+OCTREE_DEF
+int64_t octree_save_indexed(
+        octree_t *octree, char *buff, size_t size, uint8_t split, int threads)
+{
+    return node_save_indexed(
+            octree->pool, octree->root, octree->depth,
+            buff, size, split, threads);
+}
+
+
+OCTREE_DEF
+int64_t octree_load_indexed(
+        octree_t *octree, const char *buff, size_t size, int threads)
+{
+    /* The blocks are reserved past the free ones, start from an empty pool
+     * so the old chunks get reused */
+    octree_clear(octree);
+
+    return node_load_indexed(
+            octree->pool, octree->root, octree->depth, buff, size, threads);
+}
+
+
+OCTREE_DEF
+int64_t octree_diff_save(
+        octree_t *old, octree_t *new, char *buff, size_t size)
+{
+    if (old->depth != new->depth) return -1;
+
+    return node_diff_save(
+            old->pool, old->root, new->pool, new->root, new->depth,
+            buff, size);
+}
+
+
+OCTREE_DEF
+int64_t octree_diff_apply(octree_t *octree, const char *buff, size_t size)
+{
+    return node_diff_apply(
+            octree->pool, octree->root, octree->depth, buff, size);
+}
+
+
+enum
+{
+    CHUNK_RESIDENT,
+    CHUNK_LOADING,
+    CHUNK_SAVING
+};
+
+
+#if defined(OCTREE_THREADS)
+#define WORLD_LOCK(world) pthread_mutex_lock(&(world)->lock)
+#define WORLD_UNLOCK(world) pthread_mutex_unlock(&(world)->lock)
+#else
+#define WORLD_LOCK(world) ((void)(world))
+#define WORLD_UNLOCK(world) ((void)(world))
+#endif /* OCTREE_THREADS */
+
+
+/* Floor of v / 2^depth */
+static int world_chunk_of(int v, uint8_t depth)
+{
+    return (v >= 0) ? v >> depth : -((-(v + 1)) >> depth) - 1;
+}
+
+
+static octree_chunk_t **world_bucket(octree_world_t *world, const int pos[3])
+{
+    uint32_t h = hash_mix(0, (uint32_t)pos[0]);
+
+    h = hash_mix(h, (uint32_t)pos[1]);
+    h = hash_mix(h, (uint32_t)pos[2]);
+    return world->buckets + (h & world->mask);
+}
+
+
+static octree_chunk_t *world_find(octree_world_t *world, const int pos[3])
+{
+    octree_chunk_t *chunk = *world_bucket(world, pos);
+
+    while (chunk && memcmp(chunk->pos, pos, sizeof(chunk->pos)))
+        chunk = chunk->hash_next;
+    return chunk;
+}
+
+
+static void world_grow(octree_world_t *world)
+{
+    const uint32_t old_mask = world->mask;
+    octree_chunk_t **old = world->buckets, **buckets;
+
+    buckets = (octree_chunk_t **)calloc(
+            (size_t)old_mask * 2 + 2, sizeof(octree_chunk_t *));
+    /* Longer chains are still fine */
+    if (buckets == NULL) return;
+
+    world->buckets = buckets;
+    world->mask = old_mask * 2 + 1;
+    for (uint32_t i = 0; i <= old_mask; i++) {
+        octree_chunk_t *chunk = old[i];
+
+        while (chunk) {
+            octree_chunk_t *next = chunk->hash_next,
+                           **bucket = world_bucket(world, chunk->pos);
+
+            chunk->hash_next = *bucket;
+            *bucket = chunk;
+            chunk = next;
+        }
+    }
+    free(old);
+}
+
+
+static void world_unlink(octree_world_t *world, octree_chunk_t *chunk)
+{
+    octree_chunk_t **p = world_bucket(world, chunk->pos);
+
+    while (*p != chunk) p = &(*p)->hash_next;
+    *p = chunk->hash_next;
+    world->count--;
+}
+
+
+static void lru_remove(octree_world_t *world, octree_chunk_t *chunk)
+{
+    if (chunk->lru_prev) chunk->lru_prev->lru_next = chunk->lru_next;
+    else world->lru_head = chunk->lru_next;
+
+    if (chunk->lru_next) chunk->lru_next->lru_prev = chunk->lru_prev;
+    else world->lru_tail = chunk->lru_prev;
+}
+
+
+static void lru_push(octree_world_t *world, octree_chunk_t *chunk)
+{
+    chunk->lru_prev = NULL;
+    chunk->lru_next = world->lru_head;
+    if (world->lru_head) world->lru_head->lru_prev = chunk;
+    else world->lru_tail = chunk;
+    world->lru_head = chunk;
+}
+
+
+/* "dir/x_y_z.oct" followed by ext */
+static char *world_path(
+        const octree_world_t *world, const int pos[3], const char *ext)
+{
+    const size_t size = strlen(world->dir) + strlen(ext) + 48;
+    char *path = (char *)malloc(size);
+
+    if (path) {
+        snprintf(path, size, "%s/%d_%d_%d.oct%s",
+                 world->dir, pos[0], pos[1], pos[2], ext);
+    }
+    return path;
+}
+
+
+/* The chunk's octree, empty if it has no file yet */
+static octree_t *world_read(const octree_world_t *world, const int pos[3])
+{
+    char *path = world_path(world, pos, "");
+    octree_t *octree = octree_construct(world->depth);
+    FILE *file;
+
+    if (path == NULL || octree == NULL) goto error;
+
+    file = fopen(path, "rb");
+    if (file) {
+        octree_stream_t stream = octree_stream_file(file);
+        const int64_t read = octree_load_stream(octree, &stream);
+
+        fclose(file);
+        if (read < 0) goto error;
+    }
+    else if (errno != ENOENT) {
+        goto error;
+    }
+    free(path);
+    return octree;
+
+error:
+    free(path);
+    if (octree) octree_r_free(octree);
+    return NULL;
+}
+
+
+/* Write the chunk to a temporary file renamed over the old one, so a failed
+ * save leaves the previous version. Empty chunks just lose their file */
+static bool world_write(const octree_world_t *world, const octree_chunk_t *chunk)
+{
+    const node_t root = *chunk->octree->root;
+    char *path = world_path(world, chunk->pos, ""),
+         *tmp = world_path(world, chunk->pos, ".tmp");
+    bool ok = false;
+
+    if (path == NULL || tmp == NULL) goto done;
+
+    if (root.is_full && root.dom_leaf == 0) {
+        ok = (remove(path) == 0 || errno == ENOENT);
+    }
+    else {
+        FILE *file = fopen(tmp, "wb");
+        octree_stream_t stream;
 
+        if (file == NULL) goto done;
 
+        stream = octree_stream_file(file);
+        ok = (octree_save_stream(chunk->octree, &stream) >= 0);
+        ok &= (fclose(file) == 0);
 
-/* TODO: rename this function to something better */
-OCTREE_INLINE
-uint32_t _octree_i3d_to_uint(uint32_t x)
-{
-    return ((x) & 0x1) | (((x) & 0x2) << 9) | (((x) & 0x4) << 18);
+        /* rename only replaces an existing file on POSIX */
+        if (ok && rename(tmp, path) != 0) {
+            remove(path);
+            ok = (rename(tmp, path) == 0);
+        }
+        if (!ok) remove(tmp);
+    }
+
+done:
+    free(path);
+    free(tmp);
+    return ok;
 }
 
 
-/* TODO: rename this function to something better */
-OCTREE_INLINE
-uint32_t _octree_uint_to_i3d(uint32_t x) {
-    return ((x) & 0x1) | (((x) >> 9) & 0x2) | (((x) >> 18) & 0x4);
+/* Load or save chunk. Called without the lock, the chunk is only touched by
+ * the I/O thread until world_finish */
+static bool world_run(octree_world_t *world, octree_chunk_t *chunk)
+{
+    if (chunk->state == CHUNK_LOADING) {
+        chunk->octree = world_read(world, chunk->pos);
+        if (chunk->octree == NULL) return false;
+
+        chunk->bytes = octree_bytes(chunk->octree);
+        return true;
+    }
+    return !chunk->dirty || world_write(world, chunk);
 }
 
 
-OCTREE_INLINE
-uint32_t octree_pack_pos(int p[3])
+/* Publish the result of world_run, with the lock held */
+static void world_finish(octree_world_t *world, octree_chunk_t *chunk, bool ok)
 {
-    return (((uint32_t)p[0] & 0x3FF) |
-            ((uint32_t)p[1] & 0x3FF) << 10 |
-            ((uint32_t)p[2] & 0x3FF) << 20);
+    chunk->busy = false;
+    world->pending--;
+
+    if (chunk->state == CHUNK_LOADING) {
+        /* A failed chunk is dropped by the next world_get looking for it */
+        chunk->failed = !ok;
+        if (!ok) return;
+    }
+    else if (ok) {
+        world_unlink(world, chunk);
+        octree_r_free(chunk->octree);
+        free(chunk);
+        return;
+    }
+    else {
+        /* Keep the chunk until it can be saved */
+        world->error = true;
+    }
+    chunk->state = CHUNK_RESIDENT;
+    world->resident += chunk->bytes;
+    lru_push(world, chunk);
 }
 
 
-OCTREE_INLINE
-void octree_unpack_pos(uint32_t x, int pos[3])
+#if defined(OCTREE_THREADS)
+static void *world_worker(void *arg)
 {
-    pos[0] = (x & 0x3FF);
-    pos[1] = (x & 0xFFC00) >> 10;
-    pos[2] = (x & 0x3FF00000) >> 20;
+    octree_world_t *world = (octree_world_t *)arg;
+
+    pthread_mutex_lock(&world->lock);
+    for (;;) {
+        octree_chunk_t *chunk = world->tasks;
+        bool ok;
+
+        if (chunk == NULL) {
+            if (world->stop) break;
+
+            pthread_cond_wait(&world->wake, &world->lock);
+            continue;
+        }
+        world->tasks = chunk->task_next;
+        chunk->busy = true;
+        pthread_mutex_unlock(&world->lock);
+
+        ok = world_run(world, chunk);
+
+        pthread_mutex_lock(&world->lock);
+        world_finish(world, chunk, ok);
+        pthread_cond_broadcast(&world->done);
+    }
+    pthread_mutex_unlock(&world->lock);
+    return NULL;
 }
+#endif /* OCTREE_THREADS */
 
 
-OCTREE_INLINE
-uint32_t octree_packed_pos_to_index(uint32_t packed, uint8_t oc_depth)
+/* Hand chunk to the I/O thread, or load or save it right away without
+ * threads. Loads go first, someone is likely waiting for them */
+static void world_push(octree_world_t *world, octree_chunk_t *chunk)
 {
-    uint32_t index = 0,
-             bit = 0;
-    for (int i = 0; i < oc_depth; i++) {
-        index += _octree_uint_to_i3d(packed >> i) << bit;
-        bit += 3;
+    world->pending++;
+#if defined(OCTREE_THREADS)
+    if (chunk->state == CHUNK_LOADING) {
+        chunk->task_next = world->tasks;
+        world->tasks = chunk;
+    }
+    else {
+        octree_chunk_t **p = &world->tasks;
+
+        while (*p) p = &(*p)->task_next;
+        chunk->task_next = NULL;
+        *p = chunk;
     }
-    return index;
+    pthread_cond_signal(&world->wake);
+#else
+    world_finish(world, chunk, world_run(world, chunk));
+#endif /* OCTREE_THREADS */
 }
 
 
-OCTREE_INLINE
-uint32_t octree_index_to_packed_pos(uint32_t index, uint8_t oc_depth)
+/* Take chunk back from the queue if the I/O thread didn't pick it yet */
+static bool world_cancel(octree_world_t *world, octree_chunk_t *chunk)
 {
-    uint32_t packed = 0,
-             bit = 0;
-    for (int i = 0; i < oc_depth; i++) {
-        packed += _octree_i3d_to_uint(index >> bit) << i;
-        bit += 3;
+    for (octree_chunk_t **p = &world->tasks; *p; p = &(*p)->task_next) {
+        if (*p == chunk) {
+            *p = chunk->task_next;
+            world->pending--;
+            return true;
+        }
     }
-    return packed;
+    return false;
 }
 
 
-OCTREE_INLINE
-uint32_t octree_pos_to_index(int pos[3], uint8_t oc_depth)
+static void world_wait(octree_world_t *world)
 {
-    uint32_t packed = octree_pack_pos(pos);
-
-    return octree_packed_pos_to_index(packed, oc_depth);
+#if defined(OCTREE_THREADS)
+    pthread_cond_wait(&world->done, &world->lock);
+#else
+    (void)world;
+#endif /* OCTREE_THREADS */
 }
 
 
-OCTREE_INLINE
-void octree_index_to_pos(uint32_t index, int pos[3], uint8_t oc_depth)
+static octree_chunk_t *world_add(octree_world_t *world, const int pos[3])
 {
-    uint32_t packed = octree_index_to_packed_pos(index, oc_depth);
+    octree_chunk_t *chunk =
+        (octree_chunk_t *)calloc(1, sizeof(octree_chunk_t));
+    octree_chunk_t **bucket;
 
-    octree_unpack_pos(packed, pos);
-}
+    if (chunk == NULL) return NULL;
 
+    if (world->count > world->mask) world_grow(world);
 
-OCTREE_DEF
-node_t *node_construct(void)
-{
-    node_t *node = (node_t *)malloc(sizeof(node_t));
+    memcpy(chunk->pos, pos, sizeof(chunk->pos));
+    chunk->state = CHUNK_LOADING;
+    bucket = world_bucket(world, pos);
+    chunk->hash_next = *bucket;
+    *bucket = chunk;
+    world->count++;
 
-    if (node) *node = (node_t) {{NULL}, 0, 0, 0, 0};
-    return node;
+    world_push(world, chunk);
+    return chunk;
 }
 
 
-OCTREE_DEF
-int node_init_childreen(node_t *node)
+/* The resident chunk at pos, loaded if needed. Called with the lock held */
+static octree_chunk_t *world_get(octree_world_t *world, const int pos[3])
 {
-    int success = 0;
-    const uint8_t level = node->level + 1;
-    node_t base_node = {{NULL}, 1, 1, level, node->dom_leaf};
-    
-    node->childreen = (node_t **)calloc(8, sizeof(node_t *));
-    node->is_full = 0;
+    for (;;) {
+        octree_chunk_t *chunk = world_find(world, pos);
 
-    if (node->childreen) {
-        for (int i = 0; i < 8; i++) {
-            node_t *child = node->childreen[i] = node_construct();
+        if (chunk == NULL) {
+            if (world_add(world, pos) == NULL) return NULL;
+            continue;
+        }
+        if (chunk->state == CHUNK_RESIDENT) return chunk;
 
-            if (child) {
-                *(child) = base_node;
-                success = 1;
-            }
+        if (chunk->failed) {
+            world_unlink(world, chunk);
+            free(chunk);
+            return NULL;
+        }
+        if (chunk->state == CHUNK_SAVING && world_cancel(world, chunk)) {
+            /* Evicted but not saved yet, it can be used as it is */
+            chunk->state = CHUNK_RESIDENT;
+            world->resident += chunk->bytes;
+            lru_push(world, chunk);
+            return chunk;
         }
+        world_wait(world);
     }
-    return success;
 }
 
 
-/* Naive function, shouldn't be used */
-OCTREE_INLINE
-node_t *node_get(node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
+/* Hand the least recently used chunks other than keep to the I/O thread
+ * until the budget is met. Each chunk is tried once, one that can't be
+ * saved comes back */
+static void world_evict(octree_world_t *world, octree_chunk_t *keep)
 {
-    node_t *l_node = node;
-    uint8_t c_level = node->level;
-    uint32_t bit = (oc_depth - c_level - 1) * 3;
+    uint32_t n = world->count;
 
-    for (; c_level < level; c_level++) {
-        uint8_t c_index = (index >> bit) & 0x7;
-        
-        l_node = l_node->childreen[c_index];
-        bit -= 3;
+    while (world->resident > world->budget && n-- > 0) {
+        octree_chunk_t *chunk = world->lru_tail;
+
+        if (chunk == NULL || chunk == keep) break;
+
+        lru_remove(world, chunk);
+        world->resident -= chunk->bytes;
+        chunk->state = CHUNK_SAVING;
+        world_push(world, chunk);
     }
-    return l_node;
 }
 
 
-/* Get the nearest node to the level */
-OCTREE_INLINE
-node_t *node_get_nearest(
-        node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
+static octree_chunk_t *world_use(
+        octree_world_t *world, const int pos[3], bool write)
 {
-    node_t *l_node = node;
+    octree_chunk_t *chunk = world->last;
+
+    if (chunk == NULL || memcmp(chunk->pos, pos, sizeof(chunk->pos))) {
+        WORLD_LOCK(world);
+        chunk = world_get(world, pos);
+        if (chunk) {
+            /* The previous chunk may have grown while it was being used */
+            if (world->last) {
+                const size_t bytes = octree_bytes(world->last->octree);
+
+                world->resident += bytes - world->last->bytes;
+                world->last->bytes = bytes;
+            }
+            lru_remove(world, chunk);
+            lru_push(world, chunk);
+            world->last = chunk;
+            world_evict(world, chunk);
+        }
+        WORLD_UNLOCK(world);
 
-    uint8_t c_level = node->level;
-    uint32_t bit = (oc_depth - c_level - 1) * 3;
-    for (; c_level < level; c_level++) {
-        uint8_t c_index = (index >> bit) & 0x7;
+        if (chunk == NULL) return NULL;
+    }
+    chunk->dirty |= write;
+    return chunk;
+}
 
-        if (l_node->is_full || !l_node->childreen) break;
 
-        l_node = l_node->childreen[c_index];
-        bit -= 3;
-    }
-    return l_node;
+OCTREE_DEF
+octree_world_t *octree_world_construct(
+        const char *dir, uint8_t depth, size_t budget)
+{
+    octree_world_t *world;
+
+    if (depth == 0 || depth > OCTREE_MAX_DEPTH) return NULL;
+
+    world = (octree_world_t *)calloc(1, sizeof(octree_world_t));
+    if (world == NULL) return NULL;
+
+    world->dir = (char *)malloc(strlen(dir) + 1);
+    world->mask = 63;
+    world->buckets = (octree_chunk_t **)calloc(
+            world->mask + 1, sizeof(octree_chunk_t *));
+    world->budget = budget;
+    world->depth = depth;
+    if (world->dir == NULL || world->buckets == NULL) goto error;
+
+    strcpy(world->dir, dir);
+
+#if defined(OCTREE_THREADS)
+    if (pthread_mutex_init(&world->lock, NULL)) goto error;
+    if (pthread_cond_init(&world->wake, NULL)) goto error_lock;
+    if (pthread_cond_init(&world->done, NULL)) goto error_wake;
+    if (pthread_create(&world->thread, NULL, world_worker, world))
+        goto error_done;
+#endif /* OCTREE_THREADS */
+    return world;
+
+#if defined(OCTREE_THREADS)
+error_done:
+    pthread_cond_destroy(&world->done);
+error_wake:
+    pthread_cond_destroy(&world->wake);
+error_lock:
+    pthread_mutex_destroy(&world->lock);
+#endif /* OCTREE_THREADS */
+error:
+    free(world->dir);
+    free(world->buckets);
+    free(world);
+    return NULL;
 }
 
 
-/* Get nodes or create them if they don't exist */
 OCTREE_DEF
-node_t *node_get_or_create(
-        node_t *node, uint32_t index, uint8_t level, uint8_t oc_depth)
+int octree_world_flush(octree_world_t *world)
 {
-    node_t *l_node = node;
+    int ok = 1;
 
-    uint8_t c_level = node->level;
-    uint32_t bit = (oc_depth - c_level - 1) * 3;
-    for (; c_level < level; c_level++) {
-        uint8_t c_index = (index >> bit) & 0x7;
+    WORLD_LOCK(world);
+    while (world->pending) world_wait(world);
 
-        if (l_node->is_full) {
-            node_init_childreen(l_node);
-        }
+    for (octree_chunk_t *chunk = world->lru_head; chunk;
+         chunk = chunk->lru_next) {
+        if (!chunk->dirty) continue;
 
-        l_node = l_node->childreen[c_index];
-        bit -= 3;
+        if (world_write(world, chunk)) chunk->dirty = false;
+        else ok = 0;
     }
-    return l_node;
+    WORLD_UNLOCK(world);
+    return ok;
 }
 
 
-/* Recrusively free the last level */
-/* TODO: write a none recursive versino of this function */
 OCTREE_DEF
-void node_r_free_last(node_t *node, uint8_t last_level, uint8_t depth)
+int octree_world_free(octree_world_t *world)
 {
-    uint8_t level = node->level;
-    bool is_local_last = (level == last_level - 1);
-    bool is_last_node = (level == depth - 1);
+    int ok = octree_world_flush(world) && !world->error;
 
-    if (node->is_full) return;
+#if defined(OCTREE_THREADS)
+    pthread_mutex_lock(&world->lock);
+    world->stop = true;
+    pthread_cond_signal(&world->wake);
+    pthread_mutex_unlock(&world->lock);
+    pthread_join(world->thread, NULL);
 
-    if (is_local_last) {
-        if (is_last_node) {
-            free(node->leaves);
-            node->leaves = NULL;
-        }
-        else {
-            for (int i = 0; i < 8; i++) {
-                free(node->childreen[i]);
-            }
-            free(node->childreen);
-            node->childreen = NULL;
-        }
-    }
-    else {
-        for (int i = 0; i < 8; i++) {
-            node_r_free_last(node->childreen[i], last_level, depth);
+    pthread_cond_destroy(&world->done);
+    pthread_cond_destroy(&world->wake);
+    pthread_mutex_destroy(&world->lock);
+#endif /* OCTREE_THREADS */
+
+    for (uint32_t i = 0; i <= world->mask; i++) {
+        octree_chunk_t *chunk = world->buckets[i];
+
+        while (chunk) {
+            octree_chunk_t *next = chunk->hash_next;
+
+            if (chunk->octree) octree_r_free(chunk->octree);
+            free(chunk);
+            chunk = next;
         }
     }
+    free(world->buckets);
+    free(world->dir);
+    free(world);
+    return ok;
 }
 
 
 OCTREE_DEF
-void node_r_free(node_t *node, uint8_t depth)
+octree_t *octree_world_chunk(
+        octree_world_t *world, const int chunk[3], bool write)
 {
-    // Free all childreen nodes
-    for (int i = depth; i > node->level; i--) {
-        node_r_free_last(node, i, depth);
-    }
+    octree_chunk_t *c = world_use(world, chunk, write);
 
-    free(node);
+    return (c) ? c->octree : NULL;
 }
 
 
 OCTREE_DEF
-int node_save_buffer(node_t *node, uint8_t oc_depth, char *buff)
+void octree_world_prefetch(octree_world_t *world, const int chunk[3])
 {
-    node_t *cnode = node;
-    uint32_t i = 0, c = 0,
-             bits_written = 0, ofs = 0,
-             max_i = 1 << (oc_depth * 3);
-
-    while (i < max_i) {
-        simple_node_t snode = {
-            .is_full = cnode->is_full,
-            .is_original = cnode->is_original,
-            .level = cnode->level,
-            .dom_leaf = cnode->dom_leaf
-        };
-        
-        bool is_last = (snode.level == oc_depth - 1);
-        bool is_full = snode.is_full;
-        uint8_t depth = oc_depth - snode.level;
-        uint8_t levels = depth - (!(is_full || is_last));
-        uint32_t increment = (is_full || is_last) << (levels * 3);
-        uint32_t prev_i = i, nl;
+#if defined(OCTREE_THREADS)
+    WORLD_LOCK(world);
+    if (world_find(world, chunk) == NULL) world_add(world, chunk);
+    WORLD_UNLOCK(world);
+#else
+    (void)world;
+    (void)chunk;
+#endif /* OCTREE_THREADS */
+}
 
-        memcpy(buff + ofs, &snode, sizeof(snode));
-        ofs += sizeof(snode);
 
-        bits_written += sizeof(snode);
+/* Chunk holding pos and pos relative to it */
+static void world_split(
+        const octree_world_t *world, const int pos[3],
+        int chunk[3], int local[3])
+{
+    for (int a = 0; a < 3; a++) {
+        chunk[a] = world_chunk_of(pos[a], world->depth);
+        local[a] = pos[a] - chunk[a] * (1 << world->depth);
+    }
+}
 
-        if (!is_full) {
-            if (is_last) {
-                memcpy(buff + ofs, cnode->leaves, sizeof(leaf_t [8]));
-                ofs += sizeof(leaf_t [8]);
 
-                bits_written += sizeof(leaf_t [8]);
-            }
-        }
-        i+= increment;
+OCTREE_DEF
+leaf_t octree_world_leaf_get(octree_world_t *world, const int pos[3])
+{
+    int chunk[3], local[3];
+    octree_chunk_t *c;
 
-        /* Next level to write */
-        if (increment == 0) {
-            nl = snode.level + 1;
-        }
-        else {
-            uint32_t diff = 1 ^ prev_i;
-            nl = 1;
-            for (; nl < snode.level; nl++)
-                if ((diff >> ((oc_depth - nl) * 3)) & 0x7) break;
-        }
-        cnode = node_get_nearest(node, i, nl, oc_depth);
-        c++;
-    }
+    world_split(world, pos, chunk, local);
+    c = world_use(world, chunk, false);
+    if (c == NULL) return 0;
 
-    return bits_written;
+    return octree_leaf_get(c->octree, octree_pos_to_index(local, world->depth));
 }
 
 
 OCTREE_DEF
-int node_load_buffer(node_t *node, uint8_t oc_depth, const char *buff)
+int octree_world_leaf_set(octree_world_t *world, const int pos[3], leaf_t leaf)
 {
-    node_t *cnode = node;
-    uint32_t i = 0, c = 0,
-             bits_read = 0, ofs = 0,
-             max_i = 1 << (oc_depth * 3);
+    int chunk[3], local[3];
+    octree_chunk_t *c;
 
-    while (i < max_i) {
-        simple_node_t snode;
-        uint32_t levels, increment, depth;
-        bool is_full, is_last;
+    world_split(world, pos, chunk, local);
+    c = world_use(world, chunk, true);
+    if (c == NULL) return 0;
 
-        memcpy(&snode, buff + ofs, sizeof(snode));
+    return octree_leaf_set(
+            c->octree, octree_pos_to_index(local, world->depth), leaf);
+}
 
-        ofs += sizeof(snode);
-        bits_read += sizeof(snode);
 
-        depth = oc_depth - snode.level;
-        is_last = (snode.level == oc_depth - 1);
-        levels = depth - (!(snode.is_full || is_last));
+/* Call fn for every chunk overlapping [min, max) with the box relative to
+ * the chunk. Stops at the first non-zero value returned */
+typedef int (*world_box_fn)(
+        octree_chunk_t *chunk, int min[3], int max[3], void *data);
 
-        cnode->is_full = snode.is_full;
-        cnode->is_original = snode.is_original;
-        cnode->level = snode.level;
-        cnode->dom_leaf = snode.dom_leaf;
 
-        increment = (snode.is_full || is_last) << (levels * 3);
-        
-        if (!snode.is_full) {
-            if (is_last) {
-                cnode->leaves = (leaf_t *)calloc(8, sizeof(leaf_t));
+static int world_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        bool write, world_box_fn fn, void *data)
+{
+    const int side = 1 << world->depth;
+    int from[3], to[3], c[3];
 
-                if (cnode->leaves == NULL) return -1;
+    for (int a = 0; a < 3; a++) {
+        if (max[a] <= min[a]) return 0;
 
-                memcpy(cnode->leaves, buff + ofs, sizeof(leaf_t [8]));
+        from[a] = world_chunk_of(min[a], world->depth);
+        to[a] = world_chunk_of(max[a] - 1, world->depth);
+    }
 
-                ofs += sizeof(leaf_t [8]);
-                bits_read += sizeof(leaf_t [8]);
-            }
-            else {
-                if (!node_init_childreen(cnode)) return -1;
+    for (c[2] = from[2]; c[2] <= to[2]; c[2]++) {
+        for (c[1] = from[1]; c[1] <= to[1]; c[1]++) {
+            for (c[0] = from[0]; c[0] <= to[0]; c[0]++) {
+                octree_chunk_t *chunk = world_use(world, c, write);
+                int l_min[3], l_max[3], ret;
+
+                if (chunk == NULL) return -1;
+
+                /* Clip to the chunk so the box can't overflow */
+                for (int a = 0; a < 3; a++) {
+                    const int base = c[a] * side;
+
+                    l_min[a] = (min[a] > base) ? min[a] - base : 0;
+                    l_max[a] = (max[a] - base < side) ? max[a] - base : side;
+                }
+                ret = fn(chunk, l_min, l_max, data);
+                if (ret) return ret;
             }
         }
-        i += increment;
-
-        cnode = node_get_nearest(node, i, oc_depth - 1, oc_depth);
-        c++;
     }
-    return bits_read;
+    return 0;
 }
 
 
-OCTREE_INLINE
-bool leaves_full(leaf_t *leaves, leaf_t leaf)
+static int world_fill(octree_chunk_t *chunk, int min[3], int max[3], void *data)
 {
-    return memcmp(leaves, LEAVES(leaf), sizeof(leaf_t) * 8) == 0;
+    return !octree_fill_box(chunk->octree, min, max, *(const leaf_t *)data);
 }
 
 
-OCTREE_INLINE
-void leaves_fill(leaf_t *leaves, leaf_t leaf)
+OCTREE_DEF
+int octree_world_fill_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        leaf_t leaf)
 {
-    leaves[0] = leaves[1] =
-    leaves[2] = leaves[3] =
-    leaves[4] = leaves[5] =
-    leaves[6] = leaves[7] = leaf;
+    return world_box(world, min, max, true, world_fill, &leaf) == 0;
 }
 
 
-OCTREE_INLINE
-void node_leaves_init(node_t *node, leaf_t leaf)
+typedef struct
 {
-    node->is_full = false;
-    node->leaves = (leaf_t *)calloc(8, sizeof(leaf_t));
-
-    if (node->leaves) leaves_fill(node->leaves, node->dom_leaf);
-}
+    const int *chunk;
+    octree_leaf_fn match;
+    octree_world_fn fn;
+    void *data;
+} world_query_t;
 
 
-OCTREE_INLINE
-int leaf_get(node_t *node, uint32_t index, uint8_t oc_depth)
+static bool world_query_match(leaf_t leaf, void *data)
 {
-    /* Get node at the last level*/
-    node_t *l_node = node_get_nearest(node, index, oc_depth - 1, oc_depth);
+    const world_query_t *q = (const world_query_t *)data;
 
-    int leaf =
-        (l_node->is_full)
-            ? l_node->dom_leaf
-            : l_node->leaves[index & 0x7];
-
-    return leaf;
+    return leaf_match(q->match, q->data, leaf);
 }
 
 
-OCTREE_INLINE
-int leaf_set(node_t *node, uint32_t index, uint8_t oc_depth, leaf_t leaf)
+static int world_query_visit(const octree_run_t *run, void *data)
 {
-    int success = 0;
-    node_t *l_node = node_get_nearest(node, index, oc_depth - 1, oc_depth);
-    bool is_last = (l_node->level == oc_depth - 1);
+    const world_query_t *q = (const world_query_t *)data;
 
-    if (l_node->is_full) {
-        /* Nothing to be done */
-        if (l_node->dom_leaf == leaf) return 1;
-
-        l_node = (is_last)
-            ? l_node
-            : node_get_or_create(node, index, oc_depth - 1, oc_depth);
-
-        node_leaves_init(l_node, l_node->dom_leaf);
-    }
+    return q->fn(q->chunk, run, q->data);
+}
 
-    if (l_node->leaves) {
-        l_node->leaves[index & 0x7] = leaf;
-        success = 1;
 
-        /* TODO: Add node_optimize function */
-        if (leaves_full(l_node->leaves, leaf)) {
-            free(l_node->leaves);
-            l_node->leaves = NULL;
-            l_node->is_full = true;
-            l_node->dom_leaf = leaf;
-        }
-    }
+static int world_query(
+        octree_chunk_t *chunk, int min[3], int max[3], void *data)
+{
+    world_query_t *q = (world_query_t *)data;
 
-    return success;
+    q->chunk = chunk->pos;
+    return octree_query_box(
+            chunk->octree, min, max, world_query_match, world_query_visit, q);
 }
 
 
-
 OCTREE_DEF
-octree_t *octree_construct(uint8_t depth)
+int octree_world_query_box(
+        octree_world_t *world, const int min[3], const int max[3],
+        octree_leaf_fn match, octree_world_fn fn, void *data)
 {
-    octree_t *octree = (octree_t *)malloc(sizeof(octree_t));
+    world_query_t q = {NULL, match, fn, data};
 
-    if (octree) {
-        octree->root = node_construct();
-        octree->depth = depth;
-    }
-    return octree;
+    return world_box(world, min, max, false, world_query, &q);
 }
 
 
-OCTREE_DEF
-void octree_r_free(octree_t *octree)
+/* Floor for doubles well within the range of long long */
+static double world_floor(double x)
 {
-    node_r_free(octree->root, octree->depth);
-    free(octree);
+    const double f = (double)(long long)x;
+
+    return (f > x) ? f - 1 : f;
 }
 
 
-OCTREE_INLINE
-node_t *octree_node_get(octree_t *octree, uint32_t index, uint8_t level)
+/* Step through the chunks the ray crosses like a voxel traversal with
+ * chunk sized voxels, casting the ray in each with the same parameter */
+/* True if the chunk isn't in memory and has no file, so it's empty */
+static bool world_missing(octree_world_t *world, const int pos[3])
 {
-    return node_get(octree->root, index, level, octree->depth);
+    char *path;
+    FILE *file;
+    bool missing;
+
+    WORLD_LOCK(world);
+    missing = (world_find(world, pos) == NULL);
+    WORLD_UNLOCK(world);
+
+    /* Chunks that aren't in the table aren't being saved either */
+    if (!missing || (path = world_path(world, pos, "")) == NULL) return false;
+
+    file = fopen(path, "rb");
+    if (file) fclose(file);
+    missing = (file == NULL && errno == ENOENT);
+    free(path);
+    return missing;
 }
 
 
-OCTREE_INLINE
-node_t *octree_node_get_nearest(octree_t *octree, uint32_t index, uint8_t level)
+OCTREE_DEF
+int octree_world_raycast(
+        octree_world_t *world, const float origin[3], const float dir[3],
+        float max_dist, octree_leaf_fn match, void *data, octree_hit_t *hit)
 {
-    return node_get_nearest(octree->root, index, level, octree->depth);
-}
+    const double side = (double)(1 << world->depth);
+    /* Chunks holding int positions, hit->pos must fit */
+    const int lo = world_chunk_of(INT_MIN, world->depth),
+              hi = world_chunk_of(INT_MAX, world->depth);
+    double t_next[3], t_delta[3];
+    int chunk[3], step[3];
+    /* Stands in for the missing chunks when the ray can stop at a 0 */
+    octree_t *empty = NULL;
+    int ret = 0;
+
+    hit->distance = -1;
+    if (!(max_dist >= 0 && max_dist <= FLT_MAX)) return 0;
+
+    for (int a = 0; a < 3; a++) {
+        const double c = world_floor(origin[a] / side);
+
+        if (c < lo || c > hi) return 0;
+        chunk[a] = (int)c;
+
+        step[a] = (dir[a] > 0) - (dir[a] < 0);
+        if (step[a] == 0) {
+            t_next[a] = t_delta[a] = DBL_MAX;
+            continue;
+        }
+        t_next[a] = ((c + (step[a] > 0)) * side - origin[a]) / dir[a];
+        t_delta[a] = side / (step[a] * (double)dir[a]);
+    }
 
+    for (uint32_t n = 0; n < OCTREE_WORLD_RAY_CHUNKS; n++) {
+        octree_t *octree = NULL;
+        int axis = 0;
 
-OCTREE_INLINE
-node_t *octree_node_get_or_create(
-        octree_t *octree, uint32_t index, uint8_t level)
-{
-    return node_get_or_create(octree->root, index, level, octree->depth);
+        if (!world_missing(world, chunk)) {
+            octree_chunk_t *c = world_use(world, chunk, false);
+
+            if (c == NULL) break;
+            octree = c->octree;
+        }
+        else if (leaf_match(match, data, 0)) {
+            if (empty == NULL) empty = octree_construct(world->depth);
+            if (empty == NULL) break;
+            octree = empty;
+        }
+
+        if (octree) {
+            float local[3];
+
+            for (int a = 0; a < 3; a++)
+                local[a] = (float)(origin[a] - chunk[a] * side);
+
+            if (octree_raycast(octree, local, dir, max_dist,
+                               match, data, hit)) {
+                for (int a = 0; a < 3; a++)
+                    hit->pos[a] += chunk[a] * (1 << world->depth);
+                ret = 1;
+                break;
+            }
+        }
 
+        if (t_next[1] < t_next[axis]) axis = 1;
+        if (t_next[2] < t_next[axis]) axis = 2;
+        if (t_next[axis] > max_dist) break;
+
+        if (chunk[axis] == ((step[axis] > 0) ? hi : lo)) break;
+
+        chunk[axis] += step[axis];
+        t_next[axis] += t_delta[axis];
+    }
+
+    if (empty) octree_r_free(empty);
+    return ret;
 }
 
 
-/* octree_load_buffer
- * params:
- *      * octree - octree to write to.
- *      * buff - buffer containing the raw octree data.
- * description:
- *      * Attempt to load raw data into octree. On failure -1  is returned and
- *      the octree's root node is freed. Otherwise the bits read is returned
- */
-OCTREE_DEF
-int octree_load_buffer(octree_t *octree, const char *buff)
+#if defined(OCTREE_SSE2)
+#define SHUFFLE4(a, b, w, x, y, z) \
+    _mm_castps_si128(_mm_shuffle_ps( \
+            _mm_castsi128_ps(a), _mm_castsi128_ps(b), \
+            _MM_SHUFFLE(z, y, x, w)))
+
+
+static __m128i morton_spread4(__m128i x)
 {
-    return node_load_buffer(octree->root, octree->depth, buff);
+    x = _mm_and_si128(x, _mm_set1_epi32(0x3FF));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 16)),
+                      _mm_set1_epi32(0x030000FF));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)),
+                      _mm_set1_epi32(0x0300F00F));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)),
+                      _mm_set1_epi32(0x030C30C3));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)),
+                      _mm_set1_epi32(OCTREE_MORTON_X));
+    return x;
 }
 
 
-OCTREE_DEF
-int octree_save_buffer(octree_t *octree, char *buff)
+static __m128i morton_compact4(__m128i x)
 {
-    return node_save_buffer(octree->root, octree->depth, buff);
+    x = _mm_and_si128(x, _mm_set1_epi32(OCTREE_MORTON_X));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 2)),
+                      _mm_set1_epi32(0x030C30C3));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 4)),
+                      _mm_set1_epi32(0x0300F00F));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 8)),
+                      _mm_set1_epi32(0x030000FF));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_srli_epi32(x, 16)),
+                      _mm_set1_epi32(0x3FF));
+    return x;
 }
+#endif /* OCTREE_SSE2 */
 
 
-OCTREE_INLINE
-leaf_t octree_leaf_get(octree_t *octree, uint32_t index)
+OCTREE_DEF
+void octree_pos_to_index_n(
+        int pos[][3], octree_index_t *index, size_t n, uint8_t oc_depth)
 {
-    return leaf_get(octree->root, index, octree->depth);
+    size_t i = 0;
+
+#if defined(OCTREE_SSE2)
+    const __m128i mask = _mm_set1_epi32((int)octree_index_mask(oc_depth));
+
+    for (; i + 4 <= n; i += 4) {
+        /* v0 = x0 y0 z0 x1, v1 = y1 z1 x2 y2, v2 = z2 x3 y3 z3 */
+        __m128i v0 = _mm_loadu_si128((const __m128i *)pos[i]);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)pos[i] + 1);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)pos[i] + 2);
+
+        __m128i x = SHUFFLE4(v0, SHUFFLE4(v1, v2, 2, 0, 1, 0), 0, 3, 0, 2);
+        __m128i y = SHUFFLE4(SHUFFLE4(v0, v1, 1, 0, 0, 3),
+                             SHUFFLE4(v1, v2, 3, 0, 2, 0), 0, 2, 0, 2);
+        __m128i z = SHUFFLE4(SHUFFLE4(v0, v1, 2, 0, 1, 0), v2, 0, 2, 0, 3);
+
+        __m128i idx = _mm_or_si128(
+                morton_spread4(x),
+                _mm_or_si128(_mm_slli_epi32(morton_spread4(y), 1),
+                             _mm_slli_epi32(morton_spread4(z), 2)));
+
+        _mm_storeu_si128((__m128i *)(index + i), _mm_and_si128(idx, mask));
+    }
+#endif
+    for (; i < n; i++) {
+        index[i] = octree_pos_to_index(pos[i], oc_depth);
+    }
 }
 
 
-OCTREE_INLINE
-int octree_leaf_set(octree_t *octree, uint32_t index, leaf_t leaf)
+OCTREE_DEF
+void octree_index_to_pos_n(
+        const octree_index_t *index, int pos[][3], size_t n, uint8_t oc_depth)
 {
-    return leaf_set(octree->root, index, octree->depth, leaf);
+    size_t i = 0;
+
+#if defined(OCTREE_SSE2)
+    const __m128i mask = _mm_set1_epi32((int)octree_index_mask(oc_depth));
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i idx = _mm_and_si128(
+                _mm_loadu_si128((const __m128i *)(index + i)), mask);
+        __m128i x = morton_compact4(idx);
+        __m128i y = morton_compact4(_mm_srli_epi32(idx, 1));
+        __m128i z = morton_compact4(_mm_srli_epi32(idx, 2));
+
+        /* Interleave back into x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3 */
+        __m128i xy_lo = _mm_unpacklo_epi32(x, y);
+        __m128i xy_hi = _mm_unpackhi_epi32(x, y);
+        __m128i v0 = SHUFFLE4(xy_lo, SHUFFLE4(z, xy_lo, 0, 0, 2, 2),
+                              0, 1, 0, 2);
+        __m128i v1 = SHUFFLE4(SHUFFLE4(xy_lo, z, 3, 3, 1, 1), xy_hi,
+                              0, 2, 0, 1);
+        __m128i v2 = SHUFFLE4(SHUFFLE4(z, xy_hi, 2, 2, 2, 2),
+                              SHUFFLE4(xy_hi, z, 3, 3, 3, 3), 0, 2, 0, 2);
+
+        _mm_storeu_si128((__m128i *)pos[i], v0);
+        _mm_storeu_si128((__m128i *)pos[i] + 1, v1);
+        _mm_storeu_si128((__m128i *)pos[i] + 2, v2);
+    }
+#endif
+    for (; i < n; i++) {
+        octree_index_to_pos(index[i], pos[i], oc_depth);
+    }
 }
 
 #endif /* OCTREE_H */